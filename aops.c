@@ -1,67 +1,927 @@
 #include <linux/fs.h>
+#include <linux/aio.h>
 #include <linux/buffer_head.h>
+#include <linux/pagevec.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include <linux/writeback.h>
 
 #include "testfs.h"
 #include "inode.h"
 #include "aops.h"
+#include "balloc.h"
+#include "commit.h"
+#include "inline.h"
 
+/*
+ * Buffered writes use delayed allocation: write_begin only reserves a
+ * block for every hole it writes to, and marks its buffer delayed. The
+ * blocks are allocated at writeback, a run of consecutive delayed blocks
+ * at a time, so a file written in many small appends still ends up in a
+ * few large extents, and a file removed before writeback never allocates
+ * at all.
+ */
 
-int testfs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
+
+/*
+ * A file growing at its end allocates from a window of free blocks set
+ * aside for it alone, so files written side by side do not interleave
+ * their blocks. Every window a file uses up is followed by one twice as
+ * large, up to WINDOW_MAX blocks; a write elsewhere gives the window back
+ * and starts over. What is left of it goes back when the last writer
+ * closes the file, and when the inode is evicted.
+ */
+#define WINDOW_MIN	8
+#define WINDOW_MAX	1024
+
+
+/*
+ * takes up to *count blocks for the hole at iblock from the window of the
+ * inode, setting a new one aside if needed. Returns 0 if the blocks came
+ * from a window, an error if the caller has to allocate them itself.
+ * Called with i_alloc_mutex held
+ */
+static int alloc_from_window(struct inode *inode, sector_t iblock, unsigned long *count, unsigned long *block)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct testfs_window *win		= &testfs_inode->i_window;
+	struct super_block *sb			= inode->i_sb;
+	unsigned long goal, len;
+	int err;
+
+	if (iblock != testfs_inode->i_window_lblk) {
+		testfs_balloc_window_release(sb, win);
+		testfs_inode->i_window_size = 0;
+	}
+
+	if (!win->len) {
+		/* only a file growing at its end gets a window */
+		if (iblock + *count < DIV_ROUND_UP(i_size_read(inode), sb->s_blocksize))
+			return -ENOSPC;
+
+		goal = testfs_extent_goal(inode, iblock);
+		if (!goal)
+			goal = inode_data_goal(sb, inode);
+
+		testfs_inode->i_window_size = clamp_t(u32, testfs_inode->i_window_size * 2, WINDOW_MIN, WINDOW_MAX);
+
+		len = *count + testfs_inode->i_window_size;
+		err = testfs_balloc_window(sb, goal, &len, win);
+		if (err)
+			return err;
+	}
+
+	*count = min(*count, win->len);
+
+	return testfs_balloc_claim(sb, win, *count, block);
+}
+
+
+/*
+ * the last writer closed the file, nothing is going to grow into its window
+ */
+void testfs_release_window(struct inode *inode)
+{
+	struct testfs_inode_info *testfs_inode = TESTFS_GET_INODE(inode);
+
+	mutex_lock(&testfs_inode->i_alloc_mutex);
+	testfs_balloc_window_release(inode->i_sb, &testfs_inode->i_window);
+	mutex_unlock(&testfs_inode->i_alloc_mutex);
+}
+
+
+/*
+ * allocates count blocks for the hole at iblock and adds them to the
+ * extents. With TESTFS_MAP_RESERVED in flags they were reserved at
+ * write_begin. Called with i_alloc_mutex held
+ */
+static int alloc_blocks(struct inode *inode, sector_t iblock, unsigned long *count, unsigned long *block,
+	int flags)
+{
+	int err;
+
+	*count = min_t(unsigned long, *count, TESTFS_EXTENT_MAX_LEN);
+
+	err = alloc_from_window(inode, iblock, count, block);
+	if (err)
+		err = inode_alloc_data_blocks(inode->i_sb, inode, testfs_extent_goal(inode, iblock), count, block,
+					      (flags & TESTFS_MAP_RESERVED) ? TESTFS_ALLOC_RESERVED : 0);
+	if (err)
+		return err;
+
+	TESTFS_GET_INODE(inode)->i_window_lblk = iblock + *count;
+
+	inode->i_blocks += *count << (inode->i_blkbits - 9);
+
+	err = testfs_extent_insert(inode, iblock, *block, *count, 0);
+	if (err) {
+		inode->i_blocks -= *count << (inode->i_blkbits - 9);
+		inode_delete_data_blocks(inode->i_sb, *block, *count);
+	}
+
+	return err;
+}
+
+
+/*
+ * gives the hole map describes a freshly allocated run, placed right after
+ * the previous extent of the file. Called with i_alloc_mutex held, inside
+ * a transaction
+ */
+static int map_create(struct inode *inode, struct testfs_map *map, int flags)
 {
+	unsigned long block, count;
+	int err;
+
+	count 	= map->m_len;
+	err 	= alloc_blocks(inode, map->m_lblk, &count, &block, flags);
+	if (err)
+		return err;
+
+	map->m_pblk 	= block;
+	map->m_len 	= count;
+	map->m_type 	= TESTFS_MAP_MAPPED;
+	map->m_new 	= 1;
+
+	return 0;
+}
+
+
+/*
+ * the block mapping every data path goes through: looks up the run of up
+ * to len blocks starting at lblk, and with TESTFS_MAP_CREATE makes sure it
+ * has blocks. Unwritten blocks are reported as such and never touched:
+ * they only become regular ones once the data written to them is on disk
+ */
+int testfs_map_blocks(struct inode *inode, u32 lblk, u32 len, int flags, struct testfs_map *map)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct testfs_handle handle;
+	int err;
+
+	map->m_lblk 	= lblk;
+	map->m_len 	= len;
+	map->m_new 	= 0;
+
+	err = testfs_extent_map(inode, lblk, &map->m_len, &map->m_pblk);
+	if (err < 0)
+		return err;
+
+	map->m_type = err;
+	if (map->m_type != TESTFS_MAP_HOLE || !(flags & TESTFS_MAP_CREATE))
+		return 0;
+
+	testfs_trans_start(inode->i_sb, &handle);
+	mutex_lock(&testfs_inode->i_alloc_mutex);
+
+	/* somebody else may have filled the hole in the meantime */
+	map->m_len 	= len;
+	err 		= testfs_extent_map(inode, lblk, &map->m_len, &map->m_pblk);
+	if (err >= 0) {
+		map->m_type 	= err;
+		err 		= 0;
+		if (map->m_type == TESTFS_MAP_HOLE)
+			err = map_create(inode, map, flags);
+	}
+
+	mutex_unlock(&testfs_inode->i_alloc_mutex);
+	testfs_trans_stop(&handle);
+
+	return err;
+}
+
+
+/*
+ * notes that writeback is writing to the unwritten blocks from lblk to
+ * lblk + len, testfs_convert_written() turns them into regular ones once
+ * the pages are on disk
+ */
+static int queue_unwritten(struct inode *inode, u32 lblk, u32 len)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct testfs_unwritten *run;
+	int err					= 0;
+
+	mutex_lock(&testfs_inode->i_alloc_mutex);
+
+	/* writeback goes through a file in order, the last run usually grows */
+	if (!list_empty(&testfs_inode->i_unwritten)) {
+		run = list_entry(testfs_inode->i_unwritten.prev, struct testfs_unwritten, list);
+		if (lblk >= run->lblk && lblk <= run->lblk + run->len) {
+			run->len = max(run->len, lblk + len - run->lblk);
+			goto out;
+		}
+	}
+
+	run = kmalloc(sizeof(*run), GFP_NOFS);
+	if (!run) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	run->lblk 	= lblk;
+	run->len 	= len;
+	list_add_tail(&run->list, &testfs_inode->i_unwritten);
+
+out:
+	mutex_unlock(&testfs_inode->i_alloc_mutex);
+	return err;
+}
+
+
+/*
+ * get_block on top of testfs_map_blocks(): maps iblock and as many blocks
+ * after it as fit in bh_result->b_size, so that mpage_readpages(),
+ * mpage_writepages() and direct I/O can build large bios. Holes are left
+ * unmapped unless TESTFS_MAP_CREATE is set, unwritten blocks are only
+ * mapped for a write
+ */
+static int get_blocks(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int flags)
+{
+	struct testfs_map map;
+	u32 len		= max_t(u32, bh_result->b_size >> inode->i_blkbits, 1);
+	int err;
+
+	/* writepage of a page whose delayed blocks writepages did not get to */
+	if ((flags & TESTFS_MAP_CREATE) && buffer_delay(bh_result))
+		flags |= TESTFS_MAP_RESERVED;
+
+	err = testfs_map_blocks(inode, iblock, len, flags, &map);
+	if (err)
+		return err;
 
-	int err = 0;
-	struct testfs_inode *testfs_inode = TESTFS_GET_INODE(inode); 
+	if (map.m_type == TESTFS_MAP_HOLE)
+		return 0;
 
-	if (testfs_inode->block_ptr == 0) {
-		if (create == 0) 
+	if (map.m_type == TESTFS_MAP_UNWRITTEN) {
+		if (!(flags & (TESTFS_MAP_CREATE | TESTFS_MAP_DIRECT)))
 			return 0;
 
-		err = inode_alloc_data_block(inode->i_sb, inode);
-                if (err) 
-                        return err;
+		/* direct I/O converts them itself, at completion */
+		if (!(flags & TESTFS_MAP_DIRECT)) {
+			err = queue_unwritten(inode, map.m_lblk, map.m_len);
+			if (err)
+				return err;
+		}
 
-		bh_result->b_state |= (1UL << BH_New) | (1UL << BH_Mapped);
+		/* nothing of the file is in them yet, direct I/O zeroes the rest of a partial block */
+		map.m_new = 1;
 	}
-	else {
-		bh_result->b_state      |= (1UL << BH_Mapped);
+
+	if (map.m_new)
+		set_buffer_new(bh_result);
+
+	if (flags & TESTFS_MAP_RESERVED) {
+		clear_buffer_delay(bh_result);
+		testfs_balloc_release(inode->i_sb, 1);
 	}
-	
+
+	map_bh(bh_result, inode->i_sb, map.m_pblk);
+	bh_result->b_size = map.m_len << inode->i_blkbits;
+
+	return 0;
+}
+
+int testfs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
+{
+	return get_blocks(inode, iblock, bh_result, create ? TESTFS_MAP_CREATE : 0);
+}
+
+
+/*
+ * get_block of O_DIRECT writes. Within the file the generic code does not
+ * ask to create, and a hole falls back to a buffered write; unwritten
+ * blocks are written all the same
+ */
+static int testfs_get_block_direct(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
+{
+	return get_blocks(inode, iblock, bh_result, TESTFS_MAP_DIRECT | (create ? TESTFS_MAP_CREATE : 0));
+}
+
+
+/*
+ * get_block of write_begin: a hole gets a reservation instead of a block.
+ * The buffer stays unmapped, so every later write to it comes back here.
+ * An unwritten block is handled the same way and only becomes a regular
+ * one once written back; an extent block splitting its extent then takes
+ * comes out of the blocks kept for metadata
+ */
+static int testfs_da_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
+{
+	struct testfs_map map;
+	int err;
+
+	err = testfs_map_blocks(inode, iblock, 1, 0, &map);
+	if (err)
+		return err;
+
+	if (map.m_type == TESTFS_MAP_MAPPED) {
+		map_bh(bh_result, inode->i_sb, map.m_pblk);
+		return 0;
+	}
+
+	if (buffer_delay(bh_result))
+		return 0;
+
+	err = testfs_balloc_reserve(inode->i_sb, 1);
+	if (err)
+		return err;
+
+	/* block_write_begin() looks up stale metadata at b_blocknr of new buffers */
 	bh_result->b_bdev 	= inode->i_sb->s_bdev;
-        bh_result->b_blocknr 	= testfs_inode->block_ptr;
+	bh_result->b_blocknr 	= (sector_t)-1;
+	set_buffer_delay(bh_result);
+	set_buffer_new(bh_result);
+
+	return 0;
+}
+
+
+/*
+ * allocates len blocks from iblock on, skipping the ones that already have
+ * a block, unwritten ones included. Like writepage, this runs with a page
+ * locked, which has to be taken before the transaction and i_alloc_mutex
+ */
+static int alloc_delayed_run(struct inode *inode, sector_t iblock, u32 len)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct testfs_handle handle;
+	struct testfs_map map;
+	u32 end;
+	int err					= 0;
+
+	testfs_trans_start(inode->i_sb, &handle);
+	mutex_lock(&testfs_inode->i_alloc_mutex);
+
+	/* blocks a truncate cut off meanwhile must not come back */
+	end = DIV_ROUND_UP(i_size_read(inode), inode->i_sb->s_blocksize);
+	len = iblock < end ? min_t(u32, len, end - iblock) : 0;
+
+	while (len) {
+		map.m_lblk 	= iblock;
+		map.m_len 	= len;
+		map.m_new 	= 0;
+
+		err = testfs_extent_map(inode, iblock, &map.m_len, &map.m_pblk);
+		if (err < 0)
+			break;
+
+		map.m_type 	= err;
+		err 		= 0;
+		if (map.m_type == TESTFS_MAP_HOLE) {
+			err = map_create(inode, &map, TESTFS_MAP_RESERVED);
+			if (err)
+				break;
+		}
+
+		iblock 	+= map.m_len;
+		len 	-= map.m_len;
+	}
+
+	mutex_unlock(&testfs_inode->i_alloc_mutex);
+	testfs_trans_stop(&handle);
+
+	return err;
+}
+
+
+/*
+ * gives the delayed buffers of the dirty pages from start to end their
+ * blocks, so that mpage_writepages() finds them mapped and builds large
+ * bios. The first pass allocates every run of consecutive delayed blocks
+ * in one go, the second maps the buffers and queues the unwritten blocks
+ * among them for conversion. Only the first *nr_pages dirty pages are
+ * looked at, *nr_pages is left with what remains of them
+ */
+static int map_delayed_range(struct address_space *mapping, pgoff_t start, pgoff_t end, long *nr_pages)
+{
+	struct inode *inode			= mapping->host;
+	struct buffer_head *bh, *head;
+	struct pagevec pvec;
+	struct page *page;
+	struct testfs_map map;
+	sector_t iblock, run_start		= 0;
+	u32 run_len				= 0;
+	pgoff_t index;
+	int i, nr, pass, err			= 0;
+
+	if (*nr_pages <= 0)
+		return 0;
+
+	pagevec_init(&pvec, 0);
+
+	for (pass = 0; pass < 2 && !err; pass++) {
+		index = start;
+
+		while (!err && index <= end &&
+		       (nr = pagevec_lookup_tag(&pvec, mapping, &index, PAGECACHE_TAG_DIRTY,
+						min(end - index, (pgoff_t)PAGEVEC_SIZE - 1) + 1))) {
+			for (i = 0; i < nr && !err; i++) {
+				page = pvec.pages[i];
+				if (page->index > end)
+					break;
+
+				/* out of pages to write, the second pass stops where the first did */
+				if (pass == 0 && *nr_pages <= 0) {
+					end = page->index - 1;
+					break;
+				}
+				if (pass == 0)
+					(*nr_pages)--;
+
+				lock_page(page);
+				if (page->mapping != mapping || !page_has_buffers(page)) {
+					unlock_page(page);
+					continue;
+				}
+
+				iblock 	= (sector_t)page->index << (PAGE_CACHE_SHIFT - inode->i_blkbits);
+				bh 	= head = page_buffers(page);
+				do {
+					if (!buffer_delay(bh)) {
+						if (run_len)
+							err = alloc_delayed_run(inode, run_start, run_len);
+						run_len = 0;
+					}
+					else if (pass == 0) {
+						if (run_len && run_start + run_len == iblock) {
+							run_len++;
+						}
+						else {
+							if (run_len)
+								err = alloc_delayed_run(inode, run_start, run_len);
+							run_start 	= iblock;
+							run_len 	= 1;
+						}
+					}
+					else {
+						if (!testfs_map_blocks(inode, iblock, 1, 0, &map) &&
+						    (map.m_type == TESTFS_MAP_MAPPED ||
+						     (map.m_type == TESTFS_MAP_UNWRITTEN &&
+						      !queue_unwritten(inode, iblock, 1)))) {
+							clear_buffer_delay(bh);
+							map_bh(bh, inode->i_sb, map.m_pblk);
+							testfs_balloc_release(inode->i_sb, 1);
+						}
+					}
+
+					iblock++;
+				} while (!err && (bh = bh->b_this_page) != head);
+
+				unlock_page(page);
+			}
+
+			pagevec_release(&pvec);
+			cond_resched();
+		}
+
+		if (!err && run_len)
+			err = alloc_delayed_run(inode, run_start, run_len);
+		run_len = 0;
+	}
+
+	return err;
+}
+
+
+/*
+ * maps the delayed blocks of the pages writeback is going to write: the
+ * range of wbc, or for a cyclic writeback from writeback_index on, coming
+ * around to the start of the file. No more than nr_to_write pages
+ */
+static int map_delayed_blocks(struct address_space *mapping, struct writeback_control *wbc)
+{
+	long nr_pages		= wbc->nr_to_write;
+	pgoff_t start;
+	int err;
+
+	if (!wbc->range_cyclic)
+		return map_delayed_range(mapping, wbc->range_start >> PAGE_CACHE_SHIFT,
+					 wbc->range_end >> PAGE_CACHE_SHIFT, &nr_pages);
+
+	start 	= mapping->writeback_index;
+	err 	= map_delayed_range(mapping, start, (pgoff_t)-1, &nr_pages);
+	if (!err && start)
+		err = map_delayed_range(mapping, 0, start - 1, &nr_pages);
+
+	return err;
+}
+
+/*
+ * finds the first unwritten block from *lblk to end, leaving its number in
+ * *lblk. Returns 1 if there is one, 0 if not
+ */
+static int find_unwritten(struct inode *inode, u32 *lblk, u32 end)
+{
+	u32 len, pblk;
+	int type;
+
+	for (; *lblk < end; *lblk += len) {
+		len 	= end - *lblk;
+		type 	= testfs_extent_map(inode, *lblk, &len, &pblk);
+		if (type < 0)
+			return type;
+		if (type == TESTFS_MAP_UNWRITTEN)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * turns the unwritten blocks from lblk to end into regular ones, once the
+ * data written to them is on disk
+ */
+static int convert_unwritten(struct inode *inode, u32 lblk, u32 end)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct testfs_handle handle;
+	int err;
+
+	/* most writes never hit an unwritten block, look before taking the locks */
+	err = find_unwritten(inode, &lblk, end);
+	if (err <= 0)
+		return err;
+
+	testfs_trans_start(inode->i_sb, &handle);
+	mutex_lock(&testfs_inode->i_alloc_mutex);
+	err = testfs_extent_set_flags(inode, lblk, end - lblk, 0);
+	mutex_unlock(&testfs_inode->i_alloc_mutex);
+	testfs_trans_stop(&handle);
+
+	return err;
+}
+
+
+/*
+ * converts the unwritten blocks writeback queued, waiting for their pages
+ * to be on disk first. The blocks of pages that failed to get there stay
+ * unwritten. An unlinked inode on its way out only forgets them. Anything
+ * that turns blocks unwritten or frees them calls this first, so that a
+ * conversion still pending cannot undo it; errors are left in the mapping
+ * for fsync
+ */
+int testfs_convert_written(struct inode *inode)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct address_space *mapping		= inode->i_mapping;
+	struct testfs_unwritten *run, *next;
+	LIST_HEAD(runs);
+	int err, ret				= 0;
+
+	mutex_lock(&testfs_inode->i_convert_mutex);
+
+	mutex_lock(&testfs_inode->i_alloc_mutex);
+	list_splice_init(&testfs_inode->i_unwritten, &runs);
+	mutex_unlock(&testfs_inode->i_alloc_mutex);
+
+	list_for_each_entry_safe(run, next, &runs, list) {
+		if (inode->i_nlink || !(inode->i_state & I_FREEING)) {
+			err = filemap_fdatawait_range(mapping, (loff_t)run->lblk << inode->i_blkbits,
+						      ((loff_t)(run->lblk + run->len) << inode->i_blkbits) - 1);
+			if (!err)
+				err = convert_unwritten(inode, run->lblk, run->lblk + run->len);
+			if (err && !ret)
+				ret = err;
+		}
+
+		list_del(&run->list);
+		kfree(run);
+	}
+
+	mutex_unlock(&testfs_inode->i_convert_mutex);
+
+	/* the wait took the error of the pages, fsync still has to see it */
+	if (ret)
+		mapping_set_error(mapping, ret);
+
+	return ret;
+}
+
+
+/*
+ * frees every block past size. The page cache past size must be gone
+ * already
+ */
+int testfs_truncate_blocks(struct inode *inode, loff_t size)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct testfs_handle handle;
+	int err;
+
+	testfs_convert_written(inode);
+
+	testfs_trans_start(inode->i_sb, &handle);
+	mutex_lock(&testfs_inode->i_alloc_mutex);
+	err = testfs_extent_remove(inode, (size + inode->i_sb->s_blocksize - 1) >> inode->i_blkbits, (u32)-1);
+	mutex_unlock(&testfs_inode->i_alloc_mutex);
+	testfs_trans_stop(&handle);
+
+	return err;
+}
+
+
+/* direct write to unwritten blocks completing asynchronously, see testfs_end_dio() */
+struct testfs_dio_end {
+	struct work_struct work;
+	struct kiocb *iocb;
+	loff_t offset;
+	ssize_t bytes;
+	int ret;
+};
+
+
+/*
+ * converts the unwritten blocks a direct write went to, bytes from offset
+ */
+static void convert_dio(struct inode *inode, loff_t offset, ssize_t bytes)
+{
+	int err;
+
+	err = convert_unwritten(inode, offset >> inode->i_blkbits,
+				(offset + bytes + inode->i_sb->s_blocksize - 1) >> inode->i_blkbits);
+	if (err) {
+		printk(KERN_ERR "testfs: error %d converting unwritten blocks of inode %lu\n", err, inode->i_ino);
+		mapping_set_error(inode->i_mapping, err);
+	}
+}
+
+static void end_dio_work(struct work_struct *work)
+{
+	struct testfs_dio_end *end	= container_of(work, struct testfs_dio_end, work);
+	struct inode *inode		= end->iocb->ki_filp->f_mapping->host;
+
+	convert_dio(inode, end->offset, end->bytes);
+	inode_dio_done(inode);
+	aio_complete(end->iocb, end->ret, 0);
+	kfree(end);
+}
+
+
+/*
+ * end_io of a direct write that hit unwritten blocks: their data is on
+ * disk, they become regular blocks before the write completes. An
+ * asynchronous write completes in interrupt context and hands this over
+ * to a worker
+ */
+static void testfs_end_dio(struct kiocb *iocb, loff_t offset, ssize_t bytes, void *private,
+		int ret, bool is_async)
+{
+	struct inode *inode		= iocb->ki_filp->f_mapping->host;
+	struct testfs_dio_end *end	= iocb->private;
+
+	iocb->private = NULL;
+
+	if (is_async) {
+		end->offset 	= offset;
+		end->bytes 	= bytes;
+		end->ret 	= ret;
+		queue_work(system_unbound_wq, &end->work);
+		return;
+	}
+
+	kfree(end);
+	convert_dio(inode, offset, bytes);
+	inode_dio_done(inode);
+}
+
+
+/*
+ * O_DIRECT reads and writes go between the user buffers and the blocks:
+ * holes and unwritten blocks read as zeros, a write allocates the holes
+ * it hits past the end of the file and goes to unwritten blocks as they
+ * are, converting them once it is done. The generic code writes back and
+ * invalidates the cached pages of the range around the I/O. A failed
+ * write past the end of the file frees the blocks it allocated there
+ */
+static ssize_t testfs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov,
+		loff_t offset, unsigned long nr_segs)
+{
+	struct inode *inode	= iocb->ki_filp->f_mapping->host;
+	loff_t end		= offset + iov_length(iov, nr_segs);
+	dio_iodone_t *end_io	= NULL;
+	get_block_t *get_block	= testfs_get_block;
+	struct testfs_dio_end *dio_end;
+	loff_t size;
+	u32 lblk;
+	ssize_t ret;
+
+	/* an inline file has no blocks, the generic code falls back to buffered I/O */
+	if (testfs_has_inline(inode))
+		return 0;
+
+	iocb->private = NULL;
+	if (rw & WRITE) {
+		get_block = testfs_get_block_direct;
+
+		/* i_mutex keeps fallocate from adding unwritten blocks meanwhile */
+		lblk = offset >> inode->i_blkbits;
+		ret = find_unwritten(inode, &lblk, (end + inode->i_sb->s_blocksize - 1) >> inode->i_blkbits);
+		if (ret < 0)
+			return ret;
+
+		if (ret) {
+			end_io = testfs_end_dio;
+
+			if (!is_sync_kiocb(iocb)) {
+				dio_end = kmalloc(sizeof(*dio_end), GFP_NOFS);
+				if (!dio_end)
+					return -ENOMEM;
+
+				INIT_WORK(&dio_end->work, end_dio_work);
+				dio_end->iocb 	= iocb;
+				iocb->private 	= dio_end;
+			}
+		}
+	}
+
+	ret = __blockdev_direct_IO(rw, iocb, inode, inode->i_sb->s_bdev, iov, offset, nr_segs,
+				   get_block, end_io, NULL, DIO_LOCKING | DIO_SKIP_HOLES);
+
+	/* nothing was written, end_io was not called */
+	if (ret != -EIOCBQUEUED && iocb->private) {
+		kfree(iocb->private);
+		iocb->private = NULL;
+	}
+
+	if (ret < 0 && (rw & WRITE)) {
+		size = i_size_read(inode);
+		if (end > size) {
+			truncate_pagecache(inode, end, size);
+			testfs_truncate_blocks(inode, size);
+		}
+	}
+
+	return ret;
+}
+
+
+/*
+ * page of an inline file dirtied through mmap, which cannot have taken it
+ * past the inline area. The data goes back to the inode
+ */
+static int inline_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct inode *inode	= page->mapping->host;
+	struct testfs_handle handle;
+	int err			= 0;
+
+	if (!page->index) {
+		testfs_trans_start(inode->i_sb, &handle);
+		err = testfs_inline_write(inode, page, i_size_read(inode));
+		testfs_trans_stop(&handle);
+	}
+
+	if (err) {
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return err;
+	}
+
+	set_page_writeback(page);
+	unlock_page(page);
+	end_page_writeback(page);
 
 	return 0;
 }
 
 static int testfs_writepage(struct page *page, struct writeback_control *wbc)
 {
-	printk(KERN_INFO "testfs: testfs_writepage called\n");
-	return block_write_full_page(page, testfs_get_block, wbc);
+	struct inode *inode = page->mapping->host;
+	int ret;
+
+	if (testfs_has_inline(inode))
+		return inline_writepage(page, wbc);
+
+	ret = block_write_full_page(page, testfs_get_block, wbc);
+
+	/* unwritten blocks it queued get converted by the next writepages */
+	if (!list_empty(&TESTFS_GET_INODE(inode)->i_unwritten))
+		__mark_inode_dirty(inode, I_DIRTY_PAGES);
+
+	return ret;
 }
 
 static int testfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
 {
-	return mpage_writepages(mapping, wbc, testfs_get_block);
+	int err, ret, conv_err;
+
+	if (testfs_has_inline(mapping->host))
+		return generic_writepages(mapping, wbc);
+
+	/* fsync and close report it even if writepage gets the pages out after all */
+	err = map_delayed_blocks(mapping, wbc);
+	if (err) {
+		printk(KERN_ERR "testfs: error %d allocating delayed blocks of inode %lu\n",
+			err, mapping->host->i_ino);
+		mapping_set_error(mapping, err);
+	}
+
+	/* a window set aside at writeback of a closed file would only sit there */
+	if (atomic_read(&mapping->host->i_writecount) <= 0)
+		testfs_release_window(mapping->host);
+
+	/* whatever is still delayed goes through writepage one page at a time */
+	ret = mpage_writepages(mapping, wbc, testfs_get_block);
+
+	/* the unwritten blocks the pages went to, once the pages are on disk */
+	conv_err = testfs_convert_written(mapping->host);
+
+	return ret ? ret : err ? err : conv_err;
 }
 
 static int testfs_readpage(struct file *file, struct page *page)
 {
-	printk(KERN_INFO "testfs: testfs_readpage called\n");
+	struct inode *inode = page->mapping->host;
+	int err;
+
+	if (testfs_has_inline(inode)) {
+		err = testfs_inline_readpage(inode, page);
+		unlock_page(page);
+		return err;
+	}
+
 	return mpage_readpage(page, testfs_get_block);
 }
 
 static int testfs_readpages(struct file *file, struct address_space *mapping,
 		struct list_head *pages, unsigned nr_pages)
 {
-	printk(KERN_INFO "testfs: testfs_readpages called\n");
+	/* the data came in with the inode, readpage copies it */
+	if (testfs_has_inline(mapping->host))
+		return 0;
+
 	return mpage_readpages(mapping, pages, nr_pages, testfs_get_block);
 }
 
 
+/*
+ * a write that still fits in the inode works on page 0, filled from the
+ * inode; anything else makes the file a regular one first
+ */
 static int testfs_write_begin(struct file *file, struct address_space *mapping,
 		loff_t pos, unsigned len, unsigned flags,
 		struct page **pagep, void **fsdata)
 {
-	return block_write_begin(mapping, pos, len, flags, pagep, testfs_get_block);
+	struct inode *inode	= mapping->host;
+	struct page *page	= NULL;
+	int err;
+
+	if (testfs_has_inline(inode)) {
+		if (pos + len > TESTFS_INLINE_SIZE(inode->i_sb)) {
+			err = testfs_inline_convert(inode);
+			if (err)
+				return err;
+		}
+		else {
+			page = grab_cache_page_write_begin(mapping, 0, flags);
+			if (!page)
+				return -ENOMEM;
+
+			if (!PageUptodate(page)) {
+				err = testfs_inline_readpage(inode, page);
+				if (err) {
+					unlock_page(page);
+					page_cache_release(page);
+					return err;
+				}
+			}
+
+			*pagep = page;
+			return 0;
+		}
+	}
+
+	return block_write_begin(mapping, pos, len, flags, pagep, testfs_da_get_block);
+}
+
+
+/*
+ * the data of an inline file goes straight to the inode, the page stays
+ * clean
+ */
+static int inline_write_end(struct inode *inode, loff_t pos, unsigned copied, struct page *page)
+{
+	struct testfs_handle handle;
+	loff_t size = max_t(loff_t, i_size_read(inode), pos + copied);
+	int err;
+
+	testfs_trans_start(inode->i_sb, &handle);
+
+	err = testfs_inline_write(inode, page, size);
+	if (!err && size > i_size_read(inode)) {
+		i_size_write(inode, size);
+		mark_inode_dirty(inode);
+	}
+
+	testfs_trans_stop(&handle);
+
+	unlock_page(page);
+	page_cache_release(page);
+
+	return err ? err : copied;
 }
 
 
@@ -69,13 +929,94 @@ static int testfs_write_end(struct file *file, struct address_space *mapping,
 			loff_t pos, unsigned len, unsigned copied,
 			struct page *page, void *fsdata)
 {
+	if (testfs_has_inline(mapping->host))
+		return inline_write_end(mapping->host, pos, copied, page);
+
 	return generic_write_end(file, mapping, pos, len, copied, page, fsdata);
 }
 
 
+/*
+ * delayed buffers thrown away before writeback give their reservation back
+ */
+static void testfs_invalidatepage(struct page *page, unsigned long offset)
+{
+	struct buffer_head *bh, *head;
+	unsigned long start = 0;
+
+	if (page_has_buffers(page)) {
+		bh = head = page_buffers(page);
+		do {
+			if (start >= offset && buffer_delay(bh)) {
+				clear_buffer_delay(bh);
+				testfs_balloc_release(page->mapping->host->i_sb, 1);
+			}
+			start += bh->b_size;
+		} while ((bh = bh->b_this_page) != head);
+	}
+
+	block_invalidatepage(page, offset);
+}
+
+
+/*
+ * gives the data of an inline file to page 0, as delayed data, and clears
+ * the flag: the file gets its first block at writeback like any other.
+ * Called with i_mutex held, before the file grows past the inline area
+ */
+int testfs_inline_convert(struct inode *inode)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct testfs_handle handle;
+	struct page *page			= NULL;
+	unsigned size				= i_size_read(inode);
+	int err					= 0;
+
+	page = grab_cache_page_write_begin(inode->i_mapping, 0, AOP_FLAG_NOFS);
+	if (!page)
+		return -ENOMEM;
+
+	if (!PageUptodate(page)) {
+		err = testfs_inline_readpage(inode, page);
+		if (err)
+			goto out;
+	}
+
+	if (size) {
+		err = __block_write_begin(page, 0, size, testfs_da_get_block);
+		if (err) {
+			testfs_invalidatepage(page, 0);
+			goto out;
+		}
+	}
+
+	testfs_trans_start(inode->i_sb, &handle);
+	testfs_inode->i_flags &= ~TESTFS_INODE_INLINE;
+	mark_inode_dirty(inode);
+	testfs_trans_stop(&handle);
+
+	if (size)
+		block_commit_write(page, 0, size);
+
+out:
+	unlock_page(page);
+	page_cache_release(page);
+	return err;
+}
+
+
 static sector_t testfs_bmap(struct address_space *mapping, sector_t block)
 {
-	return generic_block_bmap(mapping,block,testfs_get_block);
+	struct testfs_map map;
+
+	/* delayed blocks have no number yet */
+	if (mapping_tagged(mapping, PAGECACHE_TAG_DIRTY))
+		filemap_write_and_wait(mapping);
+
+	if (testfs_map_blocks(mapping->host, block, 1, 0, &map) || map.m_type != TESTFS_MAP_MAPPED)
+		return 0;
+
+	return map.m_pblk;
 }
 
 
@@ -86,5 +1027,7 @@ const struct address_space_operations testfs_aops = {
 	.readpages	= testfs_readpages,
 	.write_begin	= testfs_write_begin,
 	.write_end	= testfs_write_end,
-	.bmap		= testfs_bmap
+	.invalidatepage	= testfs_invalidatepage,
+	.bmap		= testfs_bmap,
+	.direct_IO	= testfs_direct_IO
 };
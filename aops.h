@@ -5,4 +5,33 @@
 
 extern const struct address_space_operations testfs_aops;
 
+/* Run of file blocks as seen by testfs_map_blocks() */
+struct testfs_map {
+	u32 m_lblk;		/* First logical block */
+	u32 m_pblk;		/* First physical block, 0 for a hole */
+	u32 m_len;		/* Number of blocks */
+	int m_type;		/* TESTFS_MAP_HOLE, _MAPPED or _UNWRITTEN, see extent.h */
+	int m_new;		/* The blocks were allocated just now */
+};
+
+/* testfs_map_blocks() flags */
+#define TESTFS_MAP_CREATE	0x0001	/* Allocate holes */
+#define TESTFS_MAP_RESERVED	0x0002	/* Delayed allocation reserved the holes */
+#define TESTFS_MAP_DIRECT	0x0004	/* Direct write, converts unwritten blocks itself */
+
+/* Run of unwritten blocks writeback wrote to, on i_unwritten of the inode */
+struct testfs_unwritten {
+	struct list_head list;
+	u32 lblk;
+	u32 len;
+};
+
+int testfs_map_blocks(struct inode *inode, u32 lblk, u32 len, int flags, struct testfs_map *map);
+
+int testfs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create);
+void testfs_release_window(struct inode *inode);
+int testfs_convert_written(struct inode *inode);
+int testfs_truncate_blocks(struct inode *inode, loff_t size);
+int testfs_inline_convert(struct inode *inode);
+
 #endif
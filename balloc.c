@@ -0,0 +1,1040 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/percpu.h>
+#include <linux/rbtree_augmented.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "testfs.h"
+#include "super.h"
+#include "inode.h"
+#include "balloc.h"
+#include "commit.h"
+
+/*
+ * The block allocator keeps the free runs of every group's block bitmap in
+ * an rbtree sorted by start. Each node also knows the longest run in its
+ * subtree, so a run of a given length is found in O(log n) and a full
+ * group is recognized by its empty tree, without touching the bitmap. The
+ * tree of a group is built from its bitmap the first time the group is
+ * used; the bitmap stays the on disk truth and is updated together with it.
+ */
+struct free_extent {
+	struct rb_node rb;
+	u32 start;		/* First free block, relative to first_data_block */
+	u32 len;		/* Number of free blocks */
+	u32 max_len;		/* Longest run in this subtree */
+};
+
+#define NO_GOAL		((u32)-1)
+
+/* Kept free by reservations, for extent blocks allocated at writeback */
+#define RESERVED_META_BLOCKS	64
+
+/* No windows are handed out once fewer blocks are left */
+#define WINDOW_MIN_FREE		16384
+
+/* Groups checked by one worker at mount */
+#define SCAN_GROUPS		1024
+
+/* A range of descriptors checked and summed up at mount */
+struct group_scan {
+	struct work_struct work;
+	struct super_block *sb;
+	unsigned long start;
+	unsigned long end;
+	s64 free_blocks;
+	s64 free_inodes;
+	s64 dirs;
+	int err;
+};
+
+
+static inline u32 compute_max_len(struct free_extent *fe)
+{
+	struct free_extent *child;
+	u32 max = fe->len;
+
+	if (fe->rb.rb_left) {
+		child = rb_entry(fe->rb.rb_left, struct free_extent, rb);
+		if (child->max_len > max)
+			max = child->max_len;
+	}
+	if (fe->rb.rb_right) {
+		child = rb_entry(fe->rb.rb_right, struct free_extent, rb);
+		if (child->max_len > max)
+			max = child->max_len;
+	}
+
+	return max;
+}
+
+RB_DECLARE_CALLBACKS(static, free_extent_cb, struct free_extent, rb, u32, max_len, compute_max_len)
+
+
+static void insert_extent(struct rb_root *root, struct free_extent *new)
+{
+	struct rb_node **p 	= &root->rb_node;
+	struct rb_node *parent	= NULL;
+	struct free_extent *fe;
+
+	new->max_len = new->len;
+
+	while (*p) {
+		parent 	= *p;
+		fe 	= rb_entry(parent, struct free_extent, rb);
+
+		if (fe->max_len < new->len)
+			fe->max_len = new->len;
+
+		if (new->start < fe->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	rb_link_node(&new->rb, parent, p);
+	rb_insert_augmented(&new->rb, root, &free_extent_cb);
+}
+
+
+static void erase_extent(struct rb_root *root, struct free_extent *fe)
+{
+	rb_erase_augmented(&fe->rb, root, &free_extent_cb);
+	kfree(fe);
+}
+
+
+/* to be called whenever the length of fe changed */
+static inline void update_extent(struct free_extent *fe)
+{
+	free_extent_cb_propagate(&fe->rb, NULL);
+}
+
+
+static void destroy_extents(struct rb_root *root)
+{
+	struct rb_node *node;
+
+	while ((node = rb_first(root))) {
+		rb_erase(node, root);
+		kfree(rb_entry(node, struct free_extent, rb));
+	}
+}
+
+
+/*
+ * last free run starting at or before bit, NULL if there is none
+ */
+static struct free_extent *find_prev(struct rb_root *root, u32 bit)
+{
+	struct rb_node *n 		= root->rb_node;
+	struct free_extent *fe, *prev 	= NULL;
+
+	while (n) {
+		fe = rb_entry(n, struct free_extent, rb);
+
+		if (fe->start <= bit) {
+			prev 	= fe;
+			n 	= n->rb_right;
+		}
+		else {
+			n 	= n->rb_left;
+		}
+	}
+
+	return prev;
+}
+
+
+/*
+ * leftmost free run starting at or after from that is at least want blocks
+ * long. Subtrees without such a run are never entered
+ */
+static struct free_extent *find_fit(struct rb_node *n, u32 from, u32 want)
+{
+	struct free_extent *fe, *found;
+
+	if (!n)
+		return NULL;
+
+	fe = rb_entry(n, struct free_extent, rb);
+	if (fe->max_len < want)
+		return NULL;
+
+	if (fe->start >= from) {
+		found = find_fit(n->rb_left, from, want);
+		if (found)
+			return found;
+		if (fe->len >= want)
+			return fe;
+	}
+
+	return find_fit(n->rb_right, from, want);
+}
+
+
+/*
+ * removes the len blocks at start from the free run fe. Taking them from
+ * the middle of the run splits it, which needs the spare node
+ */
+static void take_blocks(struct rb_root *root, struct free_extent *fe, u32 start, u32 len,
+	struct free_extent **spare)
+{
+	u32 end = fe->start + fe->len;
+
+	if (start == fe->start) {
+		fe->start 	+= len;
+		fe->len 	-= len;
+
+		if (fe->len)
+			update_extent(fe);
+		else
+			erase_extent(root, fe);
+		return;
+	}
+
+	fe->len = start - fe->start;
+	update_extent(fe);
+
+	if (start + len < end) {
+		(*spare)->start = start + len;
+		(*spare)->len 	= end - start - len;
+		insert_extent(root, *spare);
+		*spare = NULL;
+	}
+}
+
+
+/*
+ * returns the len blocks at start to the free runs, merging them with the
+ * runs on both sides
+ */
+static int add_blocks(struct rb_root *root, u32 start, u32 len, struct free_extent **spare)
+{
+	struct free_extent *prev, *next	= NULL;
+	struct rb_node *n;
+
+	prev 	= find_prev(root, start);
+	n 	= prev ? rb_next(&prev->rb) : rb_first(root);
+	if (n)
+		next = rb_entry(n, struct free_extent, rb);
+
+	if ((prev && prev->start + prev->len > start) || (next && start + len > next->start))
+		return -EINVAL;
+
+	if (prev && prev->start + prev->len == start) {
+		if (next && start + len == next->start) {
+			len += next->len;
+			erase_extent(root, next);
+		}
+		prev->len += len;
+		update_extent(prev);
+		return 0;
+	}
+
+	if (next && start + len == next->start) {
+		next->start 	= start;
+		next->len 	+= len;
+		update_extent(next);
+		return 0;
+	}
+
+	if (!*spare)
+		return -ENOMEM;
+
+	(*spare)->start = start;
+	(*spare)->len 	= len;
+	insert_extent(root, *spare);
+	*spare = NULL;
+
+	return 0;
+}
+
+
+/*
+ * number of data blocks tracked by the block bitmap of a group. The data area
+ * starts at first_data_block and runs up to the end of the group, but never
+ * past what a single bitmap block can describe
+ */
+static unsigned long group_data_blocks(struct super_block *sb, unsigned long group,
+	struct testfs_group_desc *desc)
+{
+	unsigned long group_end = (group + 1) * TESTFS_BLOCKS_PER_GROUP(sb);
+
+	return min(group_end - le32_to_cpu(desc->first_data_block),
+		   (unsigned long)sb->s_blocksize * 8);
+}
+
+
+/*
+ * adds blocks and inodes (negative when allocating) to the free counts of
+ * a group, and dirs to its directory count. Taking the first block or
+ * inode of a group means its bitmap is initialized from then on. The
+ * caller holds the group lock, and adds the descriptor to the transaction
+ * once it dropped it
+ */
+void testfs_group_update(struct super_block *sb, unsigned long group, int blocks, int inodes, int dirs)
+{
+	struct testfs_info *testfs_i	= TESTFS_GET_SB_INFO(sb);
+	struct testfs_group_desc *desc	= TESTFS_GROUP_DESC(sb, group);
+
+	if (blocks) {
+		le32_add_cpu(&desc->free_blocks_count, blocks);
+		percpu_counter_add(&testfs_i->free_blocks, blocks);
+		if (blocks < 0)
+			desc->flags &= cpu_to_le16(~TESTFS_BG_BLOCK_UNINIT);
+	}
+
+	if (inodes) {
+		le32_add_cpu(&desc->free_inodes_count, inodes);
+		percpu_counter_add(&testfs_i->free_inodes, inodes);
+		if (inodes < 0)
+			desc->flags &= cpu_to_le16(~TESTFS_BG_INODE_UNINIT);
+	}
+
+	if (dirs) {
+		le16_add_cpu(&desc->used_dirs_count, dirs);
+		percpu_counter_add(&testfs_i->dirs, dirs);
+	}
+}
+
+
+/*
+ * returns the block bitmap of a group. A bitmap that was never written is
+ * not read, see init_block_bitmap()
+ */
+static struct buffer_head *get_block_bitmap(struct super_block *sb, struct testfs_group_desc *desc)
+{
+	struct buffer_head *bitmap_bh = NULL;
+
+	if (le16_to_cpu(desc->flags) & TESTFS_BG_BLOCK_UNINIT)
+		return sb_getblk(sb, le32_to_cpu(desc->block_bitmap));
+
+	if (!(bitmap_bh = sb_bread(sb, le32_to_cpu(desc->block_bitmap))))
+		printk(KERN_ERR "testfs: error reading data block bitmap at block: %u\n", le32_to_cpu(desc->block_bitmap));
+
+	return bitmap_bh;
+}
+
+
+/*
+ * every data block of a group whose bitmap was never written is free. Called
+ * with the group lock held, which keeps the flag stable
+ */
+static void init_block_bitmap(struct super_block *sb, struct testfs_group_desc *desc,
+	struct buffer_head *bitmap_bh)
+{
+	if (!(le16_to_cpu(desc->flags) & TESTFS_BG_BLOCK_UNINIT))
+		return;
+
+	memset(bitmap_bh->b_data, 0x00, sb->s_blocksize);
+	set_buffer_uptodate(bitmap_bh);
+}
+
+
+/*
+ * builds the free runs of a group from its block bitmap. The bitmap is
+ * scanned without the group lock; a free that slips in meanwhile bumps
+ * free_gen, and the scan is started over
+ */
+static int load_group(struct super_block *sb, unsigned long group, struct testfs_group_info *gi)
+{
+	struct testfs_group_desc *desc	= TESTFS_GROUP_DESC(sb, group);
+	struct buffer_head *bitmap_bh	= NULL;
+	struct free_extent *fe		= NULL;
+	struct rb_root root		= RB_ROOT;
+	unsigned long nbits		= group_data_blocks(sb, group, desc);
+	unsigned long bit, end, gen;
+	int uninit;
+
+	for (;;) {
+		spin_lock(&gi->lock);
+		if (gi->free_loaded) {
+			spin_unlock(&gi->lock);
+			return 0;
+		}
+		gen 	= gi->free_gen;
+		uninit 	= le16_to_cpu(desc->flags) & TESTFS_BG_BLOCK_UNINIT;
+		spin_unlock(&gi->lock);
+
+		if (uninit) {
+			if (!(fe = kmalloc(sizeof(*fe), GFP_NOFS)))
+				return -ENOMEM;
+
+			fe->start 	= 0;
+			fe->len 	= nbits;
+			insert_extent(&root, fe);
+		}
+		else {
+			if (!(bitmap_bh = get_block_bitmap(sb, desc)))
+				return -EIO;
+
+			bit = find_next_zero_bit_le(bitmap_bh->b_data, nbits, 0);
+			while (bit < nbits) {
+				end = find_next_bit_le(bitmap_bh->b_data, nbits, bit);
+
+				fe = kmalloc(sizeof(*fe), GFP_NOFS);
+				if (!fe) {
+					destroy_extents(&root);
+					brelse(bitmap_bh);
+					return -ENOMEM;
+				}
+
+				fe->start 	= bit;
+				fe->len 	= end - bit;
+				insert_extent(&root, fe);
+
+				bit = find_next_zero_bit_le(bitmap_bh->b_data, nbits, end);
+			}
+
+			brelse(bitmap_bh);
+		}
+
+		spin_lock(&gi->lock);
+		if (!gi->free_loaded && gi->free_gen == gen) {
+			gi->free_extents 	= root;
+			gi->free_loaded 	= 1;
+			root 			= RB_ROOT;
+		}
+		spin_unlock(&gi->lock);
+
+		/* somebody else's tree won, or ours is stale */
+		destroy_extents(&root);
+	}
+}
+
+
+/*
+ * picks up to *count free blocks of a group: a free goal block along with
+ * whatever follows it, otherwise the first run after the goal long enough
+ * for the whole request, or the longest one if no run is. Returns the run
+ * they come from, NULL if the group has none. Called with the group lock
+ * held
+ */
+static struct free_extent *pick_blocks(struct rb_root *root, u32 goal, unsigned long *count, u32 *start,
+	struct free_extent *spare)
+{
+	struct free_extent *fe	= NULL;
+	u32 want;
+
+	if (RB_EMPTY_ROOT(root))
+		return NULL;
+
+	want = min_t(unsigned long, *count, rb_entry(root->rb_node, struct free_extent, rb)->max_len);
+
+	if (goal != NO_GOAL) {
+		fe = find_prev(root, goal);
+		if (fe && goal < fe->start + fe->len && (goal == fe->start || spare)) {
+			*start 	= goal;
+			*count 	= min_t(unsigned long, *count, fe->start + fe->len - goal);
+			return fe;
+		}
+	}
+	else {
+		goal = 0;
+	}
+
+	fe = find_fit(root->rb_node, goal, want);
+	if (!fe)
+		fe = find_fit(root->rb_node, 0, want);
+
+	*start 	= fe->start;
+	*count 	= want;
+
+	return fe;
+}
+
+
+/*
+ * allocates up to *count blocks from a group, see pick_blocks(). Called
+ * with the group lock held
+ */
+static int alloc_in_group(struct super_block *sb, unsigned long group, struct testfs_group_info *gi,
+	struct testfs_group_desc *desc, struct buffer_head *bitmap_bh, u32 goal,
+	unsigned long *count, u32 *bit, struct free_extent **spare)
+{
+	struct free_extent *fe		= NULL;
+	u32 start, i;
+
+	fe = pick_blocks(&gi->free_extents, goal, count, &start, *spare);
+	if (!fe)
+		return -ENOSPC;
+
+	init_block_bitmap(sb, desc, bitmap_bh);
+
+	for (i = start; i < start + *count; i++)
+		__set_bit_le(i, bitmap_bh->b_data);
+
+	testfs_group_update(sb, group, -(int)*count, 0, 0);
+	take_blocks(&gi->free_extents, fe, start, *count, spare);
+
+	*bit = start;
+
+	return 0;
+}
+
+
+/*
+ * adds count to the reserved blocks if that leaves margin blocks free on
+ * top of every reservation and window
+ */
+static int reserve_blocks(struct testfs_info *testfs_i, unsigned long count, s64 margin)
+{
+	s64 free, dirty;
+
+	free 	= percpu_counter_read_positive(&testfs_i->free_blocks);
+	dirty 	= percpu_counter_read_positive(&testfs_i->dirty_blocks) +
+		  percpu_counter_read_positive(&testfs_i->window_blocks);
+
+	/* the cheap reads can be off by a batch per CPU, look closer near the end */
+	if (free - dirty < count + margin + 6 * percpu_counter_batch * num_online_cpus()) {
+		free 	= percpu_counter_sum_positive(&testfs_i->free_blocks);
+		dirty 	= percpu_counter_sum_positive(&testfs_i->dirty_blocks) +
+			  percpu_counter_sum_positive(&testfs_i->window_blocks);
+
+		if (free - dirty < count + margin)
+			return -ENOSPC;
+	}
+
+	percpu_counter_add(&testfs_i->dirty_blocks, count);
+	return 0;
+}
+
+
+/*
+ * allocates up to *count physically contiguous blocks, starting the search
+ * in group and as close to goal as possible (0 for no goal). On success
+ * *block is the first allocated block and *count the number allocated.
+ * Blocks reserved for delayed allocation or set aside in windows are not
+ * taken, unless flags has TESTFS_ALLOC_RESERVED: the caller turns its own
+ * reservation into blocks
+ */
+int testfs_balloc_alloc(struct super_block *sb, unsigned long group, unsigned long goal,
+	unsigned long *count, unsigned long *block, int flags)
+{
+	struct testfs_info *testfs_i		= TESTFS_GET_SB_INFO(sb);
+	struct testfs_group_info *gi		= NULL;
+	struct testfs_group_desc *desc		= NULL;
+	struct buffer_head *bitmap_bh		= NULL;
+	struct free_extent *spare		= NULL;
+	unsigned long first, nbits;
+	unsigned long want			= *count;
+	u32 goal_bit, bit;
+	int i, err				= -ENOSPC;
+
+	/* reserved for the time of the search, so that nobody else counts on them */
+	if (!(flags & TESTFS_ALLOC_RESERVED)) {
+		err = reserve_blocks(testfs_i, want, (flags & TESTFS_ALLOC_META) ? 0 : RESERVED_META_BLOCKS);
+		if (err)
+			return err;
+	}
+
+	/* splitting a free run needs a node, which cannot be allocated later */
+	spare = kmalloc(sizeof(*spare), GFP_NOFS);
+
+	for (i = 0; i < testfs_i->sb->group_count; i++, group = (group + 1) % testfs_i->sb->group_count) {
+		gi 	= &testfs_i->group_info[group];
+		desc 	= TESTFS_GROUP_DESC(sb, group);
+		first 	= le32_to_cpu(desc->first_data_block);
+		nbits 	= group_data_blocks(sb, group, desc);
+
+		/* full groups are skipped without taking their lock */
+		if (!le32_to_cpu(desc->free_blocks_count))
+			continue;
+
+		/* the goal only makes sense in the group it belongs to */
+		goal_bit = NO_GOAL;
+		if (i == 0 && goal >= first && goal - first < nbits)
+			goal_bit = goal - first;
+
+		err = load_group(sb, group, gi);
+		if (err)
+			goto out;
+
+		if (!(bitmap_bh = get_block_bitmap(sb, desc))) {
+			err = -EIO;
+			goto out;
+		}
+
+		spin_lock(&gi->lock);
+		err = alloc_in_group(sb, group, gi, desc, bitmap_bh, goal_bit, count, &bit, &spare);
+		spin_unlock(&gi->lock);
+
+		if (!err) {
+			testfs_trans_dirty_bh(sb, bitmap_bh, TESTFS_TRANS_BITMAP);
+			testfs_trans_dirty_bh(sb, TESTFS_GROUP_DESC_BH(sb, group), TESTFS_TRANS_BITMAP);
+			brelse(bitmap_bh);
+
+			*block = first + bit;
+			goto out;
+		}
+
+		brelse(bitmap_bh);
+	}
+
+	err = -ENOSPC;
+out:
+	kfree(spare);
+	if (!(flags & TESTFS_ALLOC_RESERVED))
+		percpu_counter_sub(&testfs_i->dirty_blocks, want);
+	return err;
+}
+
+
+/*
+ * clears the bits of count blocks starting at block in the block bitmap and
+ * returns them to the free runs. The run must not cross a group
+ */
+int testfs_balloc_free(struct super_block *sb, unsigned long block, unsigned long count)
+{
+	struct testfs_info *testfs_i		= TESTFS_GET_SB_INFO(sb);
+	struct testfs_group_info *gi		= NULL;
+	struct testfs_group_desc *desc		= NULL;
+	struct buffer_head *bitmap_bh		= NULL;
+	struct free_extent *spare		= NULL;
+	unsigned long group, bit, i;
+
+	group 	= block / TESTFS_BLOCKS_PER_GROUP(sb);
+	gi	= &testfs_i->group_info[group];
+	desc 	= TESTFS_GROUP_DESC(sb, group);
+	bit 	= block - le32_to_cpu(desc->first_data_block);
+
+	if (block < le32_to_cpu(desc->first_data_block) ||
+	    bit + count > group_data_blocks(sb, group, desc)) {
+		printk(KERN_ERR "testfs: freeing blocks outside the data area: %lu, count: %lu\n", block, count);
+		return -EIO;
+	}
+
+	if (!(bitmap_bh = get_block_bitmap(sb, desc)))
+		return -EIO;
+
+	spare = kmalloc(sizeof(*spare), GFP_NOFS);
+
+	spin_lock(&gi->lock);
+
+	for (i = 0; i < count; i++)
+		__clear_bit_le(bit + i, bitmap_bh->b_data);
+
+	testfs_group_update(sb, group, count, 0, 0);
+	gi->free_gen++;
+
+	/* if the runs cannot take the blocks, rebuild them from the bitmap later */
+	if (gi->free_loaded && add_blocks(&gi->free_extents, bit, count, &spare)) {
+		destroy_extents(&gi->free_extents);
+		gi->free_loaded = 0;
+		gi->tree_gen++;
+	}
+
+	spin_unlock(&gi->lock);
+
+	testfs_trans_dirty_bh(sb, bitmap_bh, TESTFS_TRANS_BITMAP);
+	testfs_trans_dirty_bh(sb, TESTFS_GROUP_DESC_BH(sb, group), TESTFS_TRANS_BITMAP);
+	brelse(bitmap_bh);
+	kfree(spare);
+
+	return 0;
+}
+
+
+/*
+ * sets up to *count free blocks close to goal aside for the allocations of
+ * one file, see aops.c. They are only taken out of the free runs: nothing
+ * is written, and the bitmap on disk still has them free should the window
+ * never be used. The window stays in the group of goal
+ */
+int testfs_balloc_window(struct super_block *sb, unsigned long goal, unsigned long *count,
+	struct testfs_window *win)
+{
+	struct testfs_info *testfs_i		= TESTFS_GET_SB_INFO(sb);
+	struct testfs_group_info *gi		= NULL;
+	struct testfs_group_desc *desc		= NULL;
+	struct free_extent *spare		= NULL;
+	struct free_extent *fe			= NULL;
+	unsigned long group, first, nbits;
+	u32 goal_bit, start;
+	s64 free;
+	int err;
+
+	/* close to full, the blocks are better left to the reservations */
+	free = percpu_counter_read_positive(&testfs_i->free_blocks) -
+	       percpu_counter_read_positive(&testfs_i->dirty_blocks) -
+	       percpu_counter_read_positive(&testfs_i->window_blocks);
+	if (free < WINDOW_MIN_FREE)
+		return -ENOSPC;
+
+	group 	= goal / TESTFS_BLOCKS_PER_GROUP(sb);
+	if (group >= testfs_i->sb->group_count)
+		return -ENOSPC;
+
+	gi 	= &testfs_i->group_info[group];
+	desc 	= TESTFS_GROUP_DESC(sb, group);
+	first 	= le32_to_cpu(desc->first_data_block);
+	nbits 	= group_data_blocks(sb, group, desc);
+
+	if (!le32_to_cpu(desc->free_blocks_count))
+		return -ENOSPC;
+
+	goal_bit = NO_GOAL;
+	if (goal >= first && goal - first < nbits)
+		goal_bit = goal - first;
+
+	err = load_group(sb, group, gi);
+	if (err)
+		return err;
+
+	spare = kmalloc(sizeof(*spare), GFP_NOFS);
+
+	spin_lock(&gi->lock);
+	fe = pick_blocks(&gi->free_extents, goal_bit, count, &start, spare);
+	if (fe) {
+		take_blocks(&gi->free_extents, fe, start, *count, &spare);
+
+		win->start 	= first + start;
+		win->len 	= *count;
+		win->gen 	= gi->tree_gen;
+	}
+	spin_unlock(&gi->lock);
+
+	if (fe)
+		percpu_counter_add(&testfs_i->window_blocks, *count);
+
+	kfree(spare);
+
+	return fe ? 0 : -ENOSPC;
+}
+
+
+/*
+ * allocates the first count blocks of a window. Once the free runs of its
+ * group were dropped and rebuilt from the bitmap, the window is stale: its
+ * blocks are free for anybody again, and -ESTALE tells the caller to
+ * forget about it
+ */
+int testfs_balloc_claim(struct super_block *sb, struct testfs_window *win, unsigned long count,
+	unsigned long *block)
+{
+	struct testfs_info *testfs_i		= TESTFS_GET_SB_INFO(sb);
+	struct testfs_group_info *gi		= NULL;
+	struct testfs_group_desc *desc		= NULL;
+	struct buffer_head *bitmap_bh		= NULL;
+	unsigned long group, bit, i;
+
+	group 	= win->start / TESTFS_BLOCKS_PER_GROUP(sb);
+	gi	= &testfs_i->group_info[group];
+	desc 	= TESTFS_GROUP_DESC(sb, group);
+	bit 	= win->start - le32_to_cpu(desc->first_data_block);
+
+	if (!(bitmap_bh = get_block_bitmap(sb, desc)))
+		return -EIO;
+
+	spin_lock(&gi->lock);
+
+	if (!gi->free_loaded || gi->tree_gen != win->gen) {
+		spin_unlock(&gi->lock);
+		brelse(bitmap_bh);
+		percpu_counter_sub(&testfs_i->window_blocks, win->len);
+		win->len = 0;
+		return -ESTALE;
+	}
+
+	init_block_bitmap(sb, desc, bitmap_bh);
+
+	for (i = 0; i < count; i++)
+		__set_bit_le(bit + i, bitmap_bh->b_data);
+
+	testfs_group_update(sb, group, -(int)count, 0, 0);
+
+	spin_unlock(&gi->lock);
+
+	percpu_counter_sub(&testfs_i->window_blocks, count);
+
+	testfs_trans_dirty_bh(sb, bitmap_bh, TESTFS_TRANS_BITMAP);
+	testfs_trans_dirty_bh(sb, TESTFS_GROUP_DESC_BH(sb, group), TESTFS_TRANS_BITMAP);
+	brelse(bitmap_bh);
+
+	*block 		= win->start;
+	win->start 	+= count;
+	win->len 	-= count;
+
+	return 0;
+}
+
+
+/*
+ * returns what is left of a window to the free runs
+ */
+void testfs_balloc_window_release(struct super_block *sb, struct testfs_window *win)
+{
+	struct testfs_info *testfs_i		= TESTFS_GET_SB_INFO(sb);
+	struct testfs_group_info *gi		= NULL;
+	struct testfs_group_desc *desc		= NULL;
+	struct free_extent *spare		= NULL;
+	unsigned long group;
+
+	if (!win->len)
+		return;
+
+	group 	= win->start / TESTFS_BLOCKS_PER_GROUP(sb);
+	gi	= &testfs_i->group_info[group];
+	desc 	= TESTFS_GROUP_DESC(sb, group);
+
+	spare = kmalloc(sizeof(*spare), GFP_NOFS);
+
+	spin_lock(&gi->lock);
+
+	/* a stale window's blocks are back in the runs already */
+	if (gi->free_loaded && gi->tree_gen == win->gen &&
+	    add_blocks(&gi->free_extents, win->start - le32_to_cpu(desc->first_data_block), win->len, &spare)) {
+		destroy_extents(&gi->free_extents);
+		gi->free_loaded = 0;
+		gi->tree_gen++;
+	}
+
+	spin_unlock(&gi->lock);
+
+	kfree(spare);
+	percpu_counter_sub(&testfs_i->window_blocks, win->len);
+	win->len = 0;
+}
+
+
+/*
+ * sets count blocks aside for data whose blocks are only allocated at
+ * writeback, see aops.c. A few blocks always stay free for the extent
+ * blocks writeback may need on top of the data. Blocks in windows are out
+ * of the free runs, writeback of other files cannot get them
+ */
+int testfs_balloc_reserve(struct super_block *sb, unsigned long count)
+{
+	return reserve_blocks(TESTFS_GET_SB_INFO(sb), count, RESERVED_META_BLOCKS);
+}
+
+
+/*
+ * gives back a reservation, either because the blocks were allocated or
+ * because the data went away before writeback
+ */
+void testfs_balloc_release(struct super_block *sb, unsigned long count)
+{
+	percpu_counter_sub(&TESTFS_GET_SB_INFO(sb)->dirty_blocks, count);
+}
+
+
+/*
+ * a descriptor must keep the metadata of its group inside the filesystem,
+ * the data area inside the group, and counts the group can hold
+ */
+static int check_group(struct super_block *sb, unsigned long group, struct testfs_group_desc *desc)
+{
+	unsigned long blocks	= (unsigned long)TESTFS_GET_SB(sb)->group_count * TESTFS_BLOCKS_PER_GROUP(sb);
+	unsigned long start	= group * TESTFS_BLOCKS_PER_GROUP(sb);
+	unsigned long itable	= DIV_ROUND_UP(TESTFS_INODES_PER_GROUP(sb) * TESTFS_INODE_SIZE(sb),
+					       sb->s_blocksize);
+	unsigned long first	= le32_to_cpu(desc->first_data_block);
+	const char *error	= NULL;
+
+	if (le32_to_cpu(desc->block_bitmap) >= blocks || le32_to_cpu(desc->inode_bitmap) >= blocks ||
+	    le32_to_cpu(desc->inode_table) + itable > blocks)
+		error = "metadata outside the filesystem";
+	else if (first < start || first >= start + TESTFS_BLOCKS_PER_GROUP(sb))
+		error = "data blocks outside the group";
+	else if (le32_to_cpu(desc->free_blocks_count) > group_data_blocks(sb, group, desc))
+		error = "more free blocks than the group has";
+	else if (le32_to_cpu(desc->free_inodes_count) >= TESTFS_INODES_PER_GROUP(sb))
+		error = "more free inodes than the group has";
+	else if (le16_to_cpu(desc->used_dirs_count) >= TESTFS_INODES_PER_GROUP(sb))
+		error = "more directories than the group has inodes";
+	else if (le16_to_cpu(desc->flags) & ~(TESTFS_BG_BLOCK_UNINIT | TESTFS_BG_INODE_UNINIT |
+					      TESTFS_BG_ITABLE_UNINIT))
+		error = "unknown flags";
+
+	if (error) {
+		printk(KERN_ERR "testfs: corrupt descriptor of group %lu: %s\n", group, error);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+
+static void scan_groups_work(struct work_struct *work)
+{
+	struct group_scan *scan		= container_of(work, struct group_scan, work);
+	struct testfs_group_desc *desc	= NULL;
+	unsigned long group;
+
+	for (group = scan->start; group < scan->end; group++) {
+		desc = TESTFS_GROUP_DESC(scan->sb, group);
+
+		if (check_group(scan->sb, group, desc)) {
+			scan->err = -EIO;
+			return;
+		}
+
+		scan->free_blocks += le32_to_cpu(desc->free_blocks_count);
+		scan->free_inodes += le32_to_cpu(desc->free_inodes_count);
+		scan->dirs 	  += le16_to_cpu(desc->used_dirs_count);
+	}
+}
+
+
+/*
+ * checks the descriptors and sums up their counts. On a large filesystem
+ * the groups are split in ranges checked by unbound workers, the mounting
+ * task taking the first range itself
+ */
+static int scan_groups(struct super_block *sb, s64 *free_blocks, s64 *free_inodes, s64 *dirs)
+{
+	unsigned long groups		= TESTFS_GET_SB(sb)->group_count;
+	unsigned long i, nr		= DIV_ROUND_UP(groups, SCAN_GROUPS);
+	struct group_scan *scans	= NULL;
+	int err				= 0;
+
+	scans = kcalloc(nr, sizeof(*scans), GFP_KERNEL);
+	if (!scans)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		INIT_WORK(&scans[i].work, scan_groups_work);
+		scans[i].sb 	= sb;
+		scans[i].start 	= i * SCAN_GROUPS;
+		scans[i].end 	= min(groups, (i + 1) * SCAN_GROUPS);
+
+		if (i)
+			queue_work(system_unbound_wq, &scans[i].work);
+	}
+
+	scan_groups_work(&scans[0].work);
+
+	for (i = 0; i < nr; i++) {
+		if (i)
+			flush_work(&scans[i].work);
+
+		if (scans[i].err)
+			err = scans[i].err;
+
+		*free_blocks += scans[i].free_blocks;
+		*free_inodes += scans[i].free_inodes;
+		*dirs 	     += scans[i].dirs;
+	}
+
+	kfree(scans);
+
+	return err;
+}
+
+
+/*
+ * starts reading the bitmaps of the groups that have them, without
+ * waiting. They are only needed once a group is used (see load_group()),
+ * but then they are already in memory. With flex groups the bitmaps sit
+ * next to each other and go in a few large reads
+ */
+static void readahead_bitmaps(struct super_block *sb)
+{
+	struct testfs_group_desc *desc	= NULL;
+	unsigned long group;
+
+	for (group = 0; group < TESTFS_GET_SB(sb)->group_count; group++) {
+		desc = TESTFS_GROUP_DESC(sb, group);
+
+		if (!(le16_to_cpu(desc->flags) & TESTFS_BG_BLOCK_UNINIT))
+			sb_breadahead(sb, le32_to_cpu(desc->block_bitmap));
+		if (!(le16_to_cpu(desc->flags) & TESTFS_BG_INODE_UNINIT))
+			sb_breadahead(sb, le32_to_cpu(desc->inode_bitmap));
+	}
+}
+
+
+/*
+ * sets up the in-memory group state. The descriptors are checked and the
+ * free counts of the whole filesystem summed up from them once, and kept
+ * up to date from then on. Bitmaps are read ahead meanwhile
+ */
+int testfs_balloc_init(struct super_block *sb)
+{
+	struct testfs_info *testfs_i 	= TESTFS_GET_SB_INFO(sb);
+	int i, cpu, err, groups		= testfs_i->sb->group_count;
+	s64 free_blocks			= 0;
+	s64 free_inodes			= 0;
+	s64 dirs			= 0;
+
+	readahead_bitmaps(sb);
+
+	err = scan_groups(sb, &free_blocks, &free_inodes, &dirs);
+	if (err)
+		return err;
+
+	if (percpu_counter_init(&testfs_i->free_blocks, free_blocks))
+		return -ENOMEM;
+	if (percpu_counter_init(&testfs_i->free_inodes, free_inodes))
+		goto err_blocks;
+	if (percpu_counter_init(&testfs_i->dirs, dirs))
+		goto err_inodes;
+	if (percpu_counter_init(&testfs_i->dirty_blocks, 0))
+		goto err_dirs;
+	if (percpu_counter_init(&testfs_i->window_blocks, 0))
+		goto err_dirty;
+
+	testfs_i->alloc_group = alloc_percpu(int);
+	if (!testfs_i->alloc_group)
+		goto err_window;
+
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(testfs_i->alloc_group, cpu) = cpu % groups;
+
+	testfs_i->group_info = kmalloc(groups * sizeof(struct testfs_group_info), GFP_KERNEL);
+	if (!testfs_i->group_info) {
+		printk(KERN_ERR "testfs: error allocating memory for group info!\n");
+		goto err_percpu;
+	}
+
+	for (i = 0; i < groups; i++) {
+		spin_lock_init(&testfs_i->group_info[i].lock);
+		testfs_i->group_info[i].free_extents 	= RB_ROOT;
+		testfs_i->group_info[i].free_loaded 	= 0;
+		testfs_i->group_info[i].free_gen 	= 0;
+		testfs_i->group_info[i].tree_gen 	= 0;
+		mutex_init(&testfs_i->group_info[i].itable_mutex);
+	}
+
+	return 0;
+
+err_percpu:
+	free_percpu(testfs_i->alloc_group);
+err_window:
+	percpu_counter_destroy(&testfs_i->window_blocks);
+err_dirty:
+	percpu_counter_destroy(&testfs_i->dirty_blocks);
+err_dirs:
+	percpu_counter_destroy(&testfs_i->dirs);
+err_inodes:
+	percpu_counter_destroy(&testfs_i->free_inodes);
+err_blocks:
+	percpu_counter_destroy(&testfs_i->free_blocks);
+	return -ENOMEM;
+}
+
+
+void testfs_balloc_destroy(struct super_block *sb)
+{
+	struct testfs_info *testfs_i = TESTFS_GET_SB_INFO(sb);
+	int i;
+
+	if (!testfs_i->group_info)
+		return;
+
+	for (i = 0; i < testfs_i->sb->group_count; i++)
+		destroy_extents(&testfs_i->group_info[i].free_extents);
+
+	kfree(testfs_i->group_info);
+	testfs_i->group_info = NULL;
+
+	free_percpu(testfs_i->alloc_group);
+	percpu_counter_destroy(&testfs_i->window_blocks);
+	percpu_counter_destroy(&testfs_i->dirty_blocks);
+	percpu_counter_destroy(&testfs_i->dirs);
+	percpu_counter_destroy(&testfs_i->free_inodes);
+	percpu_counter_destroy(&testfs_i->free_blocks);
+}
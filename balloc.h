@@ -0,0 +1,51 @@
+#ifndef BALLOC_H
+#define BALLOC_H
+
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+
+/* In-memory state of a block group */
+struct testfs_group_info {
+	spinlock_t lock;		/* Protects the bitmaps, the descriptor counters and the free extents */
+	struct rb_root free_extents;	/* Free runs of the block bitmap, by start */
+	int free_loaded;		/* free_extents was built from the bitmap */
+	unsigned long free_gen;		/* Bumped by every free, see load_group() */
+	unsigned long tree_gen;		/* Bumped whenever free_extents is dropped */
+	struct mutex itable_mutex;	/* Serializes zeroing the inode table */
+};
+
+/*
+ * Free blocks set aside for the next allocations of a file. They are out
+ * of the free runs, but still free in the bitmap
+ */
+struct testfs_window {
+	unsigned long start;		/* First block */
+	unsigned long len;		/* Blocks left */
+	unsigned long gen;		/* tree_gen of the group when the window was set aside */
+};
+
+void testfs_group_update(struct super_block *sb, unsigned long group, int blocks, int inodes, int dirs);
+
+int testfs_balloc_init(struct super_block *sb);
+void testfs_balloc_destroy(struct super_block *sb);
+
+/* testfs_balloc_alloc() flags */
+#define TESTFS_ALLOC_RESERVED	0x0001	/* The blocks were reserved by the caller */
+#define TESTFS_ALLOC_META	0x0002	/* Extent block, may take the blocks kept for them */
+
+int testfs_balloc_alloc(struct super_block *sb, unsigned long group, unsigned long goal,
+	unsigned long *count, unsigned long *block, int flags);
+int testfs_balloc_free(struct super_block *sb, unsigned long block, unsigned long count);
+
+int testfs_balloc_window(struct super_block *sb, unsigned long goal, unsigned long *count,
+	struct testfs_window *win);
+int testfs_balloc_claim(struct super_block *sb, struct testfs_window *win, unsigned long count,
+	unsigned long *block);
+void testfs_balloc_window_release(struct super_block *sb, struct testfs_window *win);
+
+int testfs_balloc_reserve(struct super_block *sb, unsigned long count);
+void testfs_balloc_release(struct super_block *sb, unsigned long count);
+
+#endif /* BALLOC_H */
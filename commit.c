@@ -0,0 +1,450 @@
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+
+#include "testfs.h"
+#include "super.h"
+#include "inode.h"
+#include "commit.h"
+#include "journal.h"
+
+/*
+ * Metadata buffers are not written back when they are modified. They join
+ * the running transaction instead, and a per filesystem thread commits it
+ * every few seconds, or as soon as somebody waits for it (fsync, sync).
+ * Everything that piled up in the meantime goes to disk with a single
+ * round of writes, so a burst of creates costs a handful of flushes
+ * instead of one per operation, and concurrent fsync calls share a commit.
+ *
+ * With a journal, a commit is logged there (see journal.c). Without one,
+ * or when a transaction is too large for the log, the buffers are written
+ * in place, class by class, and new handles wait until that is done.
+ */
+
+/* Set while a buffer sits on the running transaction */
+enum {
+	BH_Trans = BH_PrivateStart,
+};
+
+BUFFER_FNS(Trans, trans)
+TAS_BUFFER_FNS(Trans, trans)
+
+struct trans_free {
+	struct list_head list;
+	int type;
+	unsigned long start;
+	unsigned long count;
+};
+
+
+static inline int tid_geq(u32 x, u32 y)
+{
+	return (s32)(x - y) >= 0;
+}
+
+
+static void init_transaction(struct testfs_transaction *t, u32 tid)
+{
+	int i;
+
+	for (i = 0; i < TESTFS_TRANS_TYPES; i++)
+		INIT_LIST_HEAD(&t->bufs[i]);
+	INIT_LIST_HEAD(&t->frees);
+
+	t->tid 		= tid;
+	t->nr_bufs 	= 0;
+}
+
+
+void testfs_trans_start(struct super_block *sb, struct testfs_handle *handle)
+{
+	struct testfs_commit *c = &TESTFS_GET_SB_INFO(sb)->commit;
+
+	handle->sb = sb;
+
+	if (current->journal_info) {
+		handle->nested = 1;
+		return;
+	}
+
+	handle->nested = 0;
+	down_read(&c->trans_sem);
+	current->journal_info = handle;
+}
+
+
+void testfs_trans_stop(struct testfs_handle *handle)
+{
+	struct testfs_commit *c = &TESTFS_GET_SB_INFO(handle->sb)->commit;
+
+	if (handle->nested)
+		return;
+
+	current->journal_info = NULL;
+	up_read(&c->trans_sem);
+}
+
+
+/*
+ * adds a modified metadata buffer to the running transaction, in place of
+ * mark_buffer_dirty()
+ */
+void testfs_trans_dirty_bh(struct super_block *sb, struct buffer_head *bh, int type)
+{
+	struct testfs_commit *c = &TESTFS_GET_SB_INFO(sb)->commit;
+	struct testfs_trans_buf *tb 	= NULL;
+
+	if (buffer_trans(bh))
+		return;
+
+	tb = kmalloc(sizeof(*tb), GFP_NOFS);
+	if (!tb) {
+		/* no ordering guarantee for this one, but the change is not lost */
+		mark_buffer_dirty(bh);
+		return;
+	}
+
+	spin_lock(&c->lock);
+	if (test_set_buffer_trans(bh)) {
+		spin_unlock(&c->lock);
+		kfree(tb);
+		return;
+	}
+
+	get_bh(bh);
+	tb->bh 	= bh;
+	tb->jbh = NULL;
+	list_add_tail(&tb->list, &c->running.bufs[type]);
+	c->running.nr_bufs++;
+
+	/* do not let a transaction outgrow the journal */
+	if (c->running.nr_bufs == c->max_bufs) {
+		if (!tid_geq(c->request_tid, c->running.tid))
+			c->request_tid = c->running.tid;
+		wake_up(&c->wait_commit);
+	}
+	spin_unlock(&c->lock);
+}
+
+
+/*
+ * frees count inodes or blocks once the running transaction is on disk.
+ * Until then nothing on disk can still reference them, and they cannot be
+ * handed out again either
+ */
+void testfs_trans_free(struct super_block *sb, int type, unsigned long start, unsigned long count)
+{
+	struct testfs_commit *c = &TESTFS_GET_SB_INFO(sb)->commit;
+	struct trans_free *tf	= NULL;
+
+	tf = kmalloc(sizeof(*tf), GFP_NOFS);
+	if (!tf) {
+		if (type == TESTFS_FREE_BLOCKS)
+			inode_release_data_blocks(sb, start, count);
+		else
+			inode_release_inode(sb, start);
+		return;
+	}
+
+	tf->type 	= type;
+	tf->start 	= start;
+	tf->count 	= count;
+
+	spin_lock(&c->lock);
+	list_add_tail(&tf->list, &c->running.frees);
+	spin_unlock(&c->lock);
+}
+
+
+/*
+ * returns 1 if t frees block once it is on disk
+ */
+int testfs_trans_frees_block(struct testfs_transaction *t, sector_t block)
+{
+	struct trans_free *tf;
+
+	list_for_each_entry(tf, &t->frees, list) {
+		if (tf->type == TESTFS_FREE_BLOCKS && block >= tf->start && block < tf->start + tf->count)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * writes one class of buffers in place and waits for all of them
+ */
+static int write_buffers(struct list_head *bufs)
+{
+	struct testfs_trans_buf *tb, *next;
+	int err = 0;
+
+	list_for_each_entry(tb, bufs, list) {
+		mark_buffer_dirty(tb->bh);
+		write_dirty_buffer(tb->bh, WRITE);
+	}
+
+	list_for_each_entry_safe(tb, next, bufs, list) {
+		wait_on_buffer(tb->bh);
+		if (!buffer_uptodate(tb->bh)) {
+			printk(KERN_ERR "testfs: error writing metadata block %llu\n",
+				(unsigned long long)tb->bh->b_blocknr);
+			err = -EIO;
+		}
+
+		list_del(&tb->list);
+		put_bh(tb->bh);
+		kfree(tb);
+	}
+
+	return err;
+}
+
+
+static void release_frees(struct super_block *sb, struct list_head *frees)
+{
+	struct testfs_handle handle;
+	struct trans_free *tf, *next;
+
+	if (list_empty(frees))
+		return;
+
+	testfs_trans_start(sb, &handle);
+
+	list_for_each_entry_safe(tf, next, frees, list) {
+		if (tf->type == TESTFS_FREE_BLOCKS)
+			inode_release_data_blocks(sb, tf->start, tf->count);
+		else
+			inode_release_inode(sb, tf->start);
+
+		list_del(&tf->list);
+		kfree(tf);
+	}
+
+	testfs_trans_stop(&handle);
+}
+
+
+/*
+ * closes the running transaction and writes it back. With flush set the
+ * disk cache is flushed even if the transaction turns out to be empty,
+ * which is what fsync needs for the file data it wrote itself
+ */
+static int do_commit(struct super_block *sb, int flush)
+{
+	struct testfs_commit *c 	= &TESTFS_GET_SB_INFO(sb)->commit;
+	struct testfs_journal *journal	= TESTFS_GET_SB_INFO(sb)->journal;
+	struct testfs_transaction t;
+	struct testfs_trans_buf *tb;
+	int i, ret, err 		= 0;
+	int logged			= 0;
+	int copied			= -ENODATA;
+
+	/* make room in the log before blocking handles */
+	testfs_journal_checkpoint(sb, 1);
+
+	down_write(&c->trans_sem);
+
+	spin_lock(&c->lock);
+	init_transaction(&t, c->running.tid);
+	for (i = 0; i < TESTFS_TRANS_TYPES; i++)
+		list_splice_init(&c->running.bufs[i], &t.bufs[i]);
+	list_splice_init(&c->running.frees, &t.frees);
+	t.nr_bufs = c->running.nr_bufs;
+	init_transaction(&c->running, t.tid + 1);
+	spin_unlock(&c->lock);
+
+	/* no handle is running, later changes go to the next transaction */
+	for (i = 0; i < TESTFS_TRANS_TYPES; i++)
+		list_for_each_entry(tb, &t.bufs[i], list)
+			clear_buffer_trans(tb->bh);
+
+	/* blocks freed by t may be in the log, and need revoking even if nothing else changed */
+	if (journal && (t.nr_bufs || !list_empty(&t.frees))) {
+		copied 	= testfs_journal_copy(sb, &t);
+		logged 	= (copied == 0);
+	}
+
+	/*
+	 * the log got copies of the buffers. Written in place, the live buffers
+	 * themselves go to disk, and handles of the next transaction must be
+	 * kept out until they are: a change of theirs could otherwise reach
+	 * the disk ahead of what it depends on
+	 */
+	if (logged)
+		up_write(&c->trans_sem);
+
+	if (logged) {
+		err 	= testfs_journal_write(sb, &t);
+		flush 	= 0;
+
+		/* the revokes may not be on disk, empty the log before the frees */
+		if (err)
+			testfs_journal_checkpoint(sb, 0);
+	}
+	else if (copied != -ENODATA) {
+		/*
+		 * older copies in the log must not overwrite what goes in place,
+		 * nor the blocks t frees once they are reused
+		 */
+		testfs_journal_checkpoint(sb, 0);
+	}
+
+	for (i = 0; i < TESTFS_TRANS_TYPES; i++) {
+		if (list_empty(&t.bufs[i]))
+			continue;
+
+		ret = write_buffers(&t.bufs[i]);
+		if (ret)
+			err = ret;
+
+		/* the next class must not reach the platter before this one */
+		blkdev_issue_flush(sb->s_bdev, GFP_NOFS, NULL);
+		flush = 0;
+	}
+
+	if (flush)
+		blkdev_issue_flush(sb->s_bdev, GFP_NOFS, NULL);
+
+	if (!logged)
+		up_write(&c->trans_sem);
+
+	release_frees(sb, &t.frees);
+
+	spin_lock(&c->lock);
+	c->commit_tid = t.tid;
+	if (err)
+		c->error = err;
+	spin_unlock(&c->lock);
+
+	wake_up_all(&c->wait_done);
+
+	return err;
+}
+
+
+static int commit_thread(void *data)
+{
+	struct super_block *sb 	= data;
+	struct testfs_commit *c = &TESTFS_GET_SB_INFO(sb)->commit;
+	int requested;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible_timeout(c->wait_commit,
+			!tid_geq(c->commit_tid, c->request_tid) || kthread_should_stop(),
+			c->interval);
+
+		spin_lock(&c->lock);
+		requested = !tid_geq(c->commit_tid, c->request_tid);
+		spin_unlock(&c->lock);
+
+		do_commit(sb, requested);
+	}
+
+	return 0;
+}
+
+
+/*
+ * commits everything changed so far and waits until it is on disk.
+ * Callers arriving while a commit is in flight are all served by the next
+ * one
+ */
+int testfs_commit_wait(struct super_block *sb)
+{
+	struct testfs_commit *c = &TESTFS_GET_SB_INFO(sb)->commit;
+	u32 tid;
+	int err;
+
+	spin_lock(&c->lock);
+	tid = c->running.tid;
+	if (!tid_geq(c->request_tid, tid))
+		c->request_tid = tid;
+	spin_unlock(&c->lock);
+
+	/* read-only, nothing is ever committed */
+	if (!c->task)
+		return 0;
+
+	wake_up(&c->wait_commit);
+	wait_event(c->wait_done, tid_geq(c->commit_tid, tid));
+
+	spin_lock(&c->lock);
+	err = c->error;
+	c->error = 0;
+	spin_unlock(&c->lock);
+
+	return err;
+}
+
+
+int testfs_commit_init(struct super_block *sb, unsigned int interval)
+{
+	struct testfs_commit *c 	= &TESTFS_GET_SB_INFO(sb)->commit;
+	struct testfs_journal *journal	= TESTFS_GET_SB_INFO(sb)->journal;
+
+	init_rwsem(&c->trans_sem);
+	spin_lock_init(&c->lock);
+	init_waitqueue_head(&c->wait_commit);
+	init_waitqueue_head(&c->wait_done);
+	init_transaction(&c->running, 1);
+
+	c->max_bufs	= journal ? journal->blocks / 4 : INT_MAX;
+	c->commit_tid 	= 0;
+	c->request_tid 	= 0;
+	c->error 	= 0;
+	c->interval 	= interval * HZ;
+
+	if (sb->s_flags & MS_RDONLY)
+		return 0;
+
+	return testfs_commit_start(sb);
+}
+
+
+/*
+ * starts the commit thread, on a read-write mount or remount
+ */
+int testfs_commit_start(struct super_block *sb)
+{
+	struct testfs_commit *c = &TESTFS_GET_SB_INFO(sb)->commit;
+
+	c->task = kthread_run(commit_thread, sb, "testfs_commit");
+	if (IS_ERR(c->task)) {
+		int err = PTR_ERR(c->task);
+
+		printk(KERN_ERR "testfs: error starting the commit thread\n");
+		c->task = NULL;
+		return err;
+	}
+
+	return 0;
+}
+
+
+void testfs_commit_destroy(struct super_block *sb)
+{
+	struct testfs_commit *c = &TESTFS_GET_SB_INFO(sb)->commit;
+	int i, pending;
+
+	if (!c->task)
+		return;
+
+	kthread_stop(c->task);
+	c->task = NULL;
+
+	/* releasing deferred frees dirties bitmaps, which need one more round */
+	do {
+		do_commit(sb, 1);
+
+		spin_lock(&c->lock);
+		pending = !list_empty(&c->running.frees);
+		for (i = 0; i < TESTFS_TRANS_TYPES; i++)
+			pending |= !list_empty(&c->running.bufs[i]);
+		spin_unlock(&c->lock);
+	} while (pending);
+}
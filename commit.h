@@ -0,0 +1,80 @@
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/list.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+#define TESTFS_DEFAULT_COMMIT_INTERVAL	5	/* Seconds between two commits */
+
+/*
+ * Classes of metadata buffers. A commit writes them back in this order, so
+ * that the disk never references an inode or a block before the bitmap
+ * allocating it, nor a directory entry before the inode it points to.
+ */
+enum {
+	TESTFS_TRANS_BITMAP = 0,	/* Block and inode bitmaps */
+	TESTFS_TRANS_INODE,		/* Inode table and extent blocks */
+	TESTFS_TRANS_DIR,		/* Directory blocks */
+	TESTFS_TRANS_TYPES
+};
+
+/* What a deferred free releases */
+enum {
+	TESTFS_FREE_BLOCKS = 0,
+	TESTFS_FREE_INODE
+};
+
+/* Buffer on a transaction */
+struct testfs_trans_buf {
+	struct list_head list;
+	struct buffer_head *bh;		/* Metadata buffer */
+	struct buffer_head *jbh;	/* Its copy in the journal */
+};
+
+/* Metadata changes collected since the last commit */
+struct testfs_transaction {
+	u32 tid;
+	struct list_head bufs[TESTFS_TRANS_TYPES];	/* Buffers to write back */
+	struct list_head frees;				/* Released once the transaction is on disk */
+	int nr_bufs;
+};
+
+struct testfs_commit {
+	struct rw_semaphore trans_sem;		/* Shared by handles, exclusive to close a transaction */
+	spinlock_t lock;			/* Protects the running transaction */
+	struct testfs_transaction running;	/* Transaction collecting changes */
+	u32 commit_tid;				/* Last transaction on disk */
+	u32 request_tid;			/* Highest transaction someone waits for */
+	wait_queue_head_t wait_commit;		/* Commit thread sleeps here */
+	wait_queue_head_t wait_done;		/* Waiters for commit_tid to move on */
+	struct task_struct *task;		/* Commit thread */
+	unsigned long interval;			/* Jiffies between two commits */
+	int max_bufs;				/* Transaction size that triggers a commit */
+	int error;				/* Last write error */
+};
+
+/*
+ * Keeps the metadata changes of one operation in a single transaction.
+ * Handles nest: only the outermost one holds the transaction open.
+ */
+struct testfs_handle {
+	struct super_block *sb;
+	int nested;
+};
+
+int testfs_commit_init(struct super_block *sb, unsigned int interval);
+int testfs_commit_start(struct super_block *sb);
+void testfs_commit_destroy(struct super_block *sb);
+int testfs_commit_wait(struct super_block *sb);
+
+void testfs_trans_start(struct super_block *sb, struct testfs_handle *handle);
+void testfs_trans_stop(struct testfs_handle *handle);
+void testfs_trans_dirty_bh(struct super_block *sb, struct buffer_head *bh, int type);
+void testfs_trans_free(struct super_block *sb, int type, unsigned long start, unsigned long count);
+int testfs_trans_frees_block(struct testfs_transaction *t, sector_t block);
+
+#endif /* COMMIT_H */
@@ -6,48 +6,22 @@
 #include "dir.h"
 #include "super.h"
 #include "inode.h"
+#include "file.h"
+#include "commit.h"
+#include "htree.h"
 
 
 static int add_link(struct inode *parent_inode, struct inode *child_inode, struct dentry *dentry, int type)
 {
-	struct testfs_dir_entry *raw_dentry 	= NULL;
-	struct buffer_head *bh 			= NULL;
-	int free_inode_found			= 0;
-	int data_block_num			= TESTFS_GET_INODE(parent_inode)->block_ptr;
-		
-	d_instantiate(dentry, child_inode);
-	
-	if (!(bh = sb_bread(parent_inode->i_sb, data_block_num))) {
-                printk(KERN_INFO "testfs: error reading data block number %d from disk\n", data_block_num);
-                return -EIO;
-        }
-	
-	raw_dentry = (struct testfs_dir_entry *)bh->b_data;
-        for ( ; ((char*)raw_dentry) < ((char*)bh->b_data) + TESTFS_GET_BLOCK_SIZE(parent_inode->i_sb); raw_dentry++) {
-		if (raw_dentry->inode_number == 0) {
-			//we found an empty inode
-			free_inode_found = 1;
-			break;
-		}
-        }
-		
-	if (!free_inode_found) {
-		brelse(bh);
-		return -ENOSPC;
-	}
-
-	raw_dentry->inode_number = cpu_to_le32(child_inode->i_ino);
-	raw_dentry->type	 = type;
+	int err = 0;
 
-	raw_dentry->name_len	= dentry->d_name.len;
-	memcpy(raw_dentry->name, dentry->d_name.name, dentry->d_name.len);
+	err = testfs_dir_add_entry(parent_inode, &dentry->d_name, child_inode->i_ino, type);
+	if (err)
+		return err;
 
-	((struct testfs_inode *)parent_inode->i_private)->i_size += sizeof(struct testfs_dir_entry);
-		
-	mark_buffer_dirty(bh);
+	d_instantiate(dentry, child_inode);
 	mark_inode_dirty(parent_inode);
-	
-	brelse(bh);
+
 	return 0;
 }
 
@@ -56,32 +30,33 @@ static int testfs_create(struct inode *parent_dir, struct dentry *dentry,
 		umode_t mode, bool excl)
 {
 	struct inode *new_ino = NULL;
+	struct testfs_handle handle;
 	int err = 0;
 
 	dquot_initialize(parent_dir);
+
+	testfs_trans_start(parent_dir->i_sb, &handle);
 	
 	new_ino = inode_get_new_inode(parent_dir, mode, 0);
 
-	if (!new_ino)
-		return -ENOSPC;
+	if (IS_ERR(new_ino)) {
+		err = PTR_ERR(new_ino);
+		goto out;
+	}
 
 	err = add_link(parent_dir, new_ino, dentry, DT_REG);	
 	
 	if (err != 0) {
+		inode_delete_inode(new_ino);
 		iput(new_ino);
-		return err;
+		goto out;
 	}
-	
-	((struct testfs_inode *)new_ino->i_private)->i_size = 0;
-	new_ino->i_size = 0;
 
 	mark_inode_dirty(new_ino);
-	unlock_new_inode(new_ino);
-
 
-	fsync_bdev(parent_dir->i_sb->s_bdev);
-
-	return 0;
+out:
+	testfs_trans_stop(&handle);
+	return err;
 }
 
 static struct dentry *testfs_lookup(struct inode *dir, struct dentry *dentry,
@@ -90,35 +65,32 @@ static struct dentry *testfs_lookup(struct inode *dir, struct dentry *dentry,
 	struct testfs_dir_entry *raw_dentry 	= NULL;
 	struct buffer_head *bh			= NULL;
 	struct inode *found_inode		= NULL;
-	int data_block_num			= TESTFS_GET_INODE(dir)->block_ptr;
-
-	if (!(bh = sb_bread(dir->i_sb, data_block_num))) {
-		printk(KERN_INFO "testfs: error reading data block number %d from disk\n", data_block_num);
-		return ERR_PTR(-EIO);
-	}	
-
-	raw_dentry = (struct testfs_dir_entry *)bh->b_data;	
-	for ( ; ((char*)raw_dentry) < ((char*)bh->b_data) + TESTFS_GET_BLOCK_SIZE(dir->i_sb); raw_dentry++) 
-	{
-		/* if the two lengths are not equal, it means the current dentry
-		 * is not the one we are looking for, we can go to the next one
-		 */
-		if (raw_dentry->name_len != dentry->d_name.len) 
-			continue;
-		
-		if (memcmp(raw_dentry->name, dentry->d_name.name, dentry->d_name.len) != 0)
-			continue;
-				
+	u32 ino;
+
+	if (dentry->d_name.len > TESTFS_NAME_LEN)
+		return ERR_PTR(-ENAMETOOLONG);
+
+	bh = testfs_dir_find_entry(dir, &dentry->d_name, &raw_dentry);
+	if (IS_ERR(bh))
+		return ERR_CAST(bh);
+
+	if (bh) {
+		ino = le32_to_cpu(raw_dentry->inode_number);
+
+		/* on a miss, the other inodes of the block are likely next */
+		found_inode = ilookup(dir->i_sb, ino);
+		if (!found_inode) {
+			testfs_dir_readahead_inodes(dir, bh);
+			found_inode = inode_iget(dir->i_sb, ino);
+		}
 		brelse(bh);
-		
-		found_inode = inode_iget(dir->i_sb, le32_to_cpu(raw_dentry->inode_number));
-		
-		d_add(dentry, found_inode);
-		return 0;
+
+		if (IS_ERR(found_inode))
+			return ERR_CAST(found_inode);
 	}
 
-	brelse(bh);
-	return 0;
+	d_add(dentry, found_inode);
+	return NULL;
 }
 
 static int testfs_link(struct dentry *old_dentry, struct inode *dir,
@@ -128,10 +100,35 @@ static int testfs_link(struct dentry *old_dentry, struct inode *dir,
 	return 0;
 }
 
+/*
+ * removes the entry of dentry from dir and frees its inode. Shared by unlink
+ * and rmdir
+ */
+static int delete_link(struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = dentry->d_inode;
+	struct testfs_handle handle;
+	int err = 0;
+
+	testfs_trans_start(dir->i_sb, &handle);
+
+	err = testfs_dir_delete_entry(dir, &dentry->d_name);
+	if (err)
+		goto out;
+
+	inode_delete_inode(inode);
+
+	dir->i_ctime = dir->i_mtime = CURRENT_TIME_SEC;
+	mark_inode_dirty(dir);
+
+out:
+	testfs_trans_stop(&handle);
+	return err;
+}
+
 static int testfs_unlink(struct inode *dir, struct dentry *dentry)
 {
-	printk(KERN_INFO "testfs: %s\n", __FUNCTION__);
-	return 0;
+	return delete_link(dir, dentry);
 }
 
 static int testfs_symlink(struct inode *dir, struct dentry *dentry,
@@ -144,105 +141,51 @@ static int testfs_symlink(struct inode *dir, struct dentry *dentry,
 static int testfs_mkdir(struct inode *parent_dir, struct dentry *dentry, umode_t mode)
 {
 	struct inode *new_dir 			= NULL;
-	struct buffer_head *new_dir_bh 		= NULL;
-	struct testfs_dir_entry *raw_dentry 	= NULL;
 	int err			= 0;
-	struct testfs_inode *new_testfs_ino 	= NULL;	
+	struct testfs_handle handle;
+
+	testfs_trans_start(parent_dir->i_sb, &handle);
 
 	// request new inode
 	new_dir = inode_get_new_inode(parent_dir, S_IFDIR | mode, 1);
 
-	if (!new_dir) 
-		return -ENOSPC;
-
-	new_testfs_ino = TESTFS_GET_INODE(new_dir);
-	
-	err = add_link(parent_dir, new_dir, dentry, DT_DIR);
-		
-	if (err != 0) {
-		iput(new_dir);
-		return err;
+	if (IS_ERR(new_dir)) {
+		err = PTR_ERR(new_dir);
+		goto out;
 	}
-	
-	if (!(new_dir_bh = sb_bread(new_dir->i_sb, new_testfs_ino->block_ptr))) {
-                printk(KERN_INFO "testfs: error reading data block number %d from disk\n", new_testfs_ino->block_ptr);
-                return -EIO;
-        }
 
 	/*
 	 * we add the two . and .. directory entries to the inode`s datablock.
 	 */
-	new_testfs_ino->i_size 		= sizeof(struct testfs_dir_entry) * 2;
-	
-	raw_dentry = (struct testfs_dir_entry *)new_dir_bh->b_data;
-	memcpy(raw_dentry->name, ".", 1);
-	raw_dentry->name_len 	= 1;
-	raw_dentry->type	= 1;
-	raw_dentry->inode_number = new_dir->i_ino;
-	raw_dentry++;
-	
-	memcpy(raw_dentry->name, "..", 2);
-	raw_dentry->name_len 		= 2;
-	raw_dentry->type		= 1;
-	raw_dentry->inode_number 	= parent_dir->i_ino;
+	err = testfs_dir_make_empty(new_dir, parent_dir->i_ino);
+	if (err)
+		goto out_free;
 
-	mark_buffer_dirty(new_dir_bh);
-	mark_inode_dirty(new_dir);
+	err = add_link(parent_dir, new_dir, dentry, DT_DIR);
+	if (err)
+		goto out_free;
 
-	fsync_bdev(parent_dir->i_sb->s_bdev);
+	goto out;
 
-	brelse(new_dir_bh);
-	return 0;
+out_free:
+	inode_delete_inode(new_dir);
+	iput(new_dir);
+out:
+	testfs_trans_stop(&handle);
+	return err;
 }
 
 static int testfs_rmdir(struct inode *dir, struct dentry *dentry)
 {
-	struct testfs_dir_entry *raw_dentry 	= NULL;
-	struct buffer_head *bh			= NULL;
-	struct inode *child_dir			= dentry->d_inode;
-	int data_block_num                      = TESTFS_GET_INODE(dir)->block_ptr;
-	int ret					= 0;
-	
-	if (!(bh = sb_bread(dir->i_sb, data_block_num))) {
-		printk(KERN_INFO "testfs: error reading data block number %d from disk\n", data_block_num);
-		return -EIO;
-	}
-
-	raw_dentry = (struct testfs_dir_entry *)bh->b_data;
-	for ( ; ((char*)raw_dentry) < ((char*)bh->b_data) + TESTFS_GET_BLOCK_SIZE(dir->i_sb); raw_dentry++) {
-		if (strcmp(dentry->d_name.name, raw_dentry->name) == 0) {
-			d_delete(dentry);
-			
-			//bitmap_free_inode_num(dir->i_sb, raw_dentry->inode_number);
-			ret = inode_delete_inode(child_dir);			
+	int ret = 0;
 
-			if (ret) {
-				brelse(bh);
-				return ret;
-			}
+	ret = testfs_dir_is_empty(dentry->d_inode);
+	if (ret < 0)
+		return ret;
+	if (!ret)
+		return -ENOTEMPTY;
 
-			raw_dentry->inode_number = 0;
-			memset(raw_dentry->name,0x00,raw_dentry->name_len);
-			raw_dentry->name_len = 0;
-
-			((struct testfs_inode *)dir->i_private)->i_size -= sizeof(struct testfs_dir_entry);             
-			dir->i_size = ((struct testfs_inode *)dir->i_private)->i_size;
-			
-			((struct testfs_inode *)child_dir->i_private)->i_size = 0;
-                        child_dir->i_size = 0;
-
-	                mark_inode_dirty(dir);
-			mark_inode_dirty(child_dir);
-
-        	        mark_buffer_dirty(bh);
-			iput(child_dir);
-        	        fsync_bdev(dir->i_sb->s_bdev);
-			break;
-		}
-	}
-
-	brelse(bh);
-	return 0;
+	return delete_link(dir, dentry);
 }
 
 static int testfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
@@ -259,49 +202,75 @@ static int testfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 }
 
 /*
- * for the moment it only lists entries within one block. 
- * if a directory contains so many entries, that multiple data blocks are needed
- * only the contents of the first block will be read
+ * lists the entries block by block. The cursor of an open directory is
+ * f_pos, the byte offset of the next entry, and f_version, the i_version
+ * of the directory when f_pos was set. As long as the directory has not
+ * changed since, f_pos is the start of an entry and the listing resumes
+ * right there. Otherwise f_pos may point into an entry that was merged
+ * away, and the block is walked from its start up to f_pos once. A
+ * directory with a hash index is listed in hash order instead, see
+ * testfs_dx_readdir()
  */
 static int testfs_readdir(struct file * fp, void * dirent, filldir_t filldir)
 {
 	struct buffer_head *bh  		= NULL;
 	struct inode *dir 			= fp->f_dentry->d_inode;
 	struct super_block* sb 			= dir->i_sb;
-	int isize				= 0;
 	struct testfs_dir_entry *raw_dentry 	= NULL;
-	int data_block_num                      = TESTFS_GET_INODE(dir)->block_ptr;
-
-	/*
-	 * data block number containing entries for the current directory 
-	 */
-	isize = inode_get_size(dir);
-
-	if (fp->f_pos >= isize) {
-		return 0;
-	}
-        
-	if (!(bh = sb_bread(sb, data_block_num))) {
-                printk(KERN_INFO "testfs: error reading data block number %d from disk\n", data_block_num);
-                return -EIO;
-        }
+	u32 lblk, blocks			= testfs_dir_blocks(dir);
+	unsigned offset;
+	loff_t base;
+	int indexed, over;
+
+	indexed = testfs_dir_is_indexed(dir);
+	if (indexed < 0)
+		return indexed;
+	if (indexed)
+		return testfs_dx_readdir(fp, dirent, filldir);
+
+	while ((lblk = fp->f_pos >> sb->s_blocksize_bits) < blocks) {
+		bh = testfs_dir_bread(dir, lblk);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+
+		base 	= (loff_t)lblk << sb->s_blocksize_bits;
+		offset 	= 0;
+
+		if (fp->f_version == dir->i_version)
+			offset = fp->f_pos & (sb->s_blocksize - 1);
+
+		/* ls -l and find stat every entry listed, get their inodes coming */
+		if (!offset)
+			testfs_dir_readahead_inodes(dir, bh);
+
+		for ( ; offset < testfs_dir_data_size(dir); offset += le16_to_cpu(raw_dentry->rec_len)) {
+			raw_dentry = (struct testfs_dir_entry *)(testfs_dir_data(dir, bh) + offset);
+			if (testfs_dir_check_entry(dir, bh, raw_dentry)) {
+				brelse(bh);
+				return -EIO;
+			}
 
-	/*
-	 * because the first two entries (. and ..) are not kept on the disk
-	 * we have to decrement fp->f_pos by 2. After we start listing entries from 
-	 * the disk, fp->f_pos will be incremented by sizeof(struct testfs_dir_entry);
-	 */
-	raw_dentry = (struct testfs_dir_entry *)bh->b_data;
+			if (base + offset < fp->f_pos)
+				continue;
+
+			if (raw_dentry->inode_number) {
+				over = filldir(dirent, raw_dentry->name, raw_dentry->name_len,
+					       base + offset, le32_to_cpu(raw_dentry->inode_number), raw_dentry->type);
+				if (over) {
+					brelse(bh);
+					fp->f_version = dir->i_version;
+					return 0;
+				}
+			}
 
-	while (fp->f_pos < isize) {
-		if (raw_dentry->inode_number > 0)
-		{
-			filldir(dirent, raw_dentry->name, raw_dentry->name_len, fp->f_pos, raw_dentry->inode_number, raw_dentry->type);
-			fp->f_pos += sizeof(struct testfs_dir_entry);
+			fp->f_pos = base + offset + le16_to_cpu(raw_dentry->rec_len);
 		}
-		raw_dentry++;
+
+		brelse(bh);
+		fp->f_pos = base + sb->s_blocksize;
 	}
 
+	fp->f_version = dir->i_version;
 	return 0;
 }
 
@@ -315,8 +284,10 @@ static int testfs_release(struct inode *inode, struct file *filp)
 
 /* dir file opertions */
 const struct file_operations testfs_dir_fops = {
+	.llseek		= generic_file_llseek,
 	.read		= generic_read_dir,
 	.readdir	= testfs_readdir,
+	.fsync		= testfs_fsync,
 	.release	= testfs_release,
 };
 
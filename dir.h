@@ -1,19 +1,28 @@
 #ifndef DIR_H
 #define DIR_H
 
+#define TESTFS_NAME_LEN		255
+
+/* Directory entries start, and take up, a multiple of this */
+#define TESTFS_DIR_PAD		4
+
+/* Bytes taken by an entry with a name of len bytes */
+#define TESTFS_DIR_REC_LEN(len)	ALIGN(8 + (len), TESTFS_DIR_PAD)
+
 /**
- * Entry for each file in the fs, the entire table resides in the itable which
- * is at block number 2 and 3
+ * Entry for each file in a directory block. Entries follow each other,
+ * rec_len bytes apart, and the last one of a block stretches to its end.
+ * An entry with inode number 0 is unused
  */
 struct testfs_dir_entry {
 	__le32 inode_number;	/* Inode number */
-	__le32 name_len;	/* File name length */
-	char name[20];		/* File name */
+	__le16 rec_len;		/* Distance to the next entry */
+	__u8 name_len;		/* File name length */
 	__u8 type;		/* DT_DIR or DT_REG */
+	char name[0];		/* File name, not NUL terminated */
 };
 
 extern const struct file_operations testfs_dir_fops;
 extern const struct inode_operations testfs_dir_iops;
 
 #endif
-
@@ -0,0 +1,623 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+
+#include "testfs.h"
+#include "inode.h"
+#include "extent.h"
+#include "balloc.h"
+#include "commit.h"
+
+/*
+ * A file is described by a list of extents sorted by logical block. Up to
+ * TESTFS_INODE_EXTENTS extents live in the inode; once a file needs more,
+ * the whole list moves to a single extent block pointed to by
+ * i_extent_block and the in-inode slots are no longer used.
+ *
+ * Changes to the list are made with i_alloc_mutex held, and i_extent_sem
+ * held for writing around them. Lookups only take i_extent_sem for reading,
+ * so they never see an extent list halfway through a change. The inode is
+ * marked dirty once i_extent_sem is released, as copying it out to the
+ * inode table reads the list too.
+ */
+/* Extents reported to FIEMAP per look at the extent list */
+#define FIEMAP_BATCH	16
+
+struct extent_list {
+	struct testfs_extent *ext;	/* First extent of the list */
+	struct buffer_head *bh;		/* Extent block, NULL if in the inode */
+	int count;			/* Extents in use */
+	int max;			/* Extents that fit */
+};
+
+
+static int get_extent_list(struct inode *inode, struct extent_list *list)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct testfs_extent_header *eh		= NULL;
+	u32 block				= le32_to_cpu(testfs_inode->i_extent_block);
+
+	list->count = le16_to_cpu(testfs_inode->i_extent_count);
+
+	if (!block) {
+		list->ext = testfs_inode->i_extents;
+		list->bh  = NULL;
+		list->max = TESTFS_INODE_EXTENTS;
+		return 0;
+	}
+
+	if (!(list->bh = sb_bread(inode->i_sb, block))) {
+		printk(KERN_ERR "testfs: error reading extent block %u of inode %lu\n", block, inode->i_ino);
+		return -EIO;
+	}
+
+	eh = (struct testfs_extent_header *)list->bh->b_data;
+	if (le16_to_cpu(eh->eh_magic) != TESTFS_EXTENT_MAGIC) {
+		printk(KERN_ERR "testfs: bad extent block %u in inode %lu\n", block, inode->i_ino);
+		brelse(list->bh);
+		return -EIO;
+	}
+
+	list->ext = (struct testfs_extent *)(eh + 1);
+	list->max = le16_to_cpu(eh->eh_max);
+
+	return 0;
+}
+
+
+static void put_extent_list(struct extent_list *list)
+{
+	if (list->bh)
+		brelse(list->bh);
+}
+
+
+/*
+ * index of the last extent starting at or before lblk, -1 if there is none
+ */
+static int search_extent(struct extent_list *list, u32 lblk)
+{
+	int lo = 0, hi = list->count - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (le32_to_cpu(list->ext[mid].ee_block) <= lblk)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return hi;
+}
+
+
+/*
+ * physical block where lblk should preferably go, see testfs_extent_goal()
+ */
+static u32 list_goal(struct extent_list *list, u32 lblk)
+{
+	struct testfs_extent *ext	= NULL;
+	int i				= search_extent(list, lblk);
+
+	if (i < 0)
+		return 0;
+
+	ext = &list->ext[i];
+	return le32_to_cpu(ext->ee_start) + (lblk - le32_to_cpu(ext->ee_block));
+}
+
+
+/*
+ * moves the in-inode extents to a newly allocated extent block
+ */
+static int spill_extents(struct inode *inode, struct extent_list *list)
+{
+	struct super_block *sb			= inode->i_sb;
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct testfs_extent_header *eh		= NULL;
+	struct buffer_head *bh			= NULL;
+	unsigned long block			= 0;
+	unsigned long count			= 1;
+	int err					= 0;
+
+	err = inode_alloc_data_blocks(sb, inode, list_goal(list, 0), &count, &block, TESTFS_ALLOC_META);
+	if (err)
+		return err;
+
+	if (!(bh = sb_getblk(sb, block))) {
+		inode_delete_data_blocks(sb, block, 1);
+		return -EIO;
+	}
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0x00, sb->s_blocksize);
+
+	eh = (struct testfs_extent_header *)bh->b_data;
+	eh->eh_magic	= cpu_to_le16(TESTFS_EXTENT_MAGIC);
+	eh->eh_max	= cpu_to_le16((sb->s_blocksize - sizeof(*eh)) / sizeof(struct testfs_extent));
+	memcpy(eh + 1, list->ext, list->count * sizeof(struct testfs_extent));
+
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	testfs_trans_dirty_bh(sb, bh, TESTFS_TRANS_INODE);
+
+	memset(testfs_inode->i_extents, 0x00, sizeof(testfs_inode->i_extents));
+	testfs_inode->i_extent_block = cpu_to_le32(block);
+	inode->i_blocks += 1 << (inode->i_blkbits - 9);
+
+	list->ext = (struct testfs_extent *)(eh + 1);
+	list->bh  = bh;
+	list->max = le16_to_cpu(eh->eh_max);
+
+	return 0;
+}
+
+
+/*
+ * replaces the old extents (0 or 1) at index i with the n extents of new,
+ * making room for them first. The caller dirties the list
+ */
+static int replace_extents(struct inode *inode, struct extent_list *list, int i, int old,
+	struct testfs_extent *new, int n)
+{
+	int err;
+
+	if (list->count - old + n > list->max) {
+		if (list->bh) {
+			printk(KERN_INFO "testfs: extent block of inode %lu is full\n", inode->i_ino);
+			return -EFBIG;
+		}
+
+		err = spill_extents(inode, list);
+		if (err)
+			return err;
+	}
+
+	memmove(&list->ext[i + n], &list->ext[i + old], (list->count - i - old) * sizeof(struct testfs_extent));
+	memcpy(&list->ext[i], new, n * sizeof(struct testfs_extent));
+
+	list->count += n - old;
+	TESTFS_GET_INODE(inode)->i_extent_count = cpu_to_le16(list->count);
+
+	return 0;
+}
+
+
+/*
+ * merges the extent at index i into the one before it, if they are
+ * contiguous both logically and physically and of the same kind.
+ * returns 1 if they were merged
+ */
+static int merge_prev(struct inode *inode, struct extent_list *list, int i)
+{
+	struct testfs_extent *prev, *ext;
+	u32 prev_len, ext_len;
+
+	if (i <= 0 || i >= list->count)
+		return 0;
+
+	prev 		= &list->ext[i - 1];
+	ext 		= &list->ext[i];
+	prev_len 	= le16_to_cpu(prev->ee_len);
+	ext_len 	= le16_to_cpu(ext->ee_len);
+
+	if (le32_to_cpu(prev->ee_block) + prev_len != le32_to_cpu(ext->ee_block) ||
+	    le32_to_cpu(prev->ee_start) + prev_len != le32_to_cpu(ext->ee_start) ||
+	    prev->ee_flags != ext->ee_flags ||
+	    prev_len + ext_len > TESTFS_EXTENT_MAX_LEN)
+		return 0;
+
+	prev->ee_len = cpu_to_le16(prev_len + ext_len);
+	replace_extents(inode, list, i, 1, NULL, 0);
+
+	return 1;
+}
+
+
+static inline void fill_extent(struct testfs_extent *ext, u32 lblk, u32 pblk, u32 len, u16 flags)
+{
+	ext->ee_block 	= cpu_to_le32(lblk);
+	ext->ee_start 	= cpu_to_le32(pblk);
+	ext->ee_len 	= cpu_to_le16(len);
+	ext->ee_flags 	= cpu_to_le16(flags);
+}
+
+
+/*
+ * maps lblk to a physical block. On entry *len is the maximum number of
+ * blocks the caller is interested in, on return it is the length of the
+ * mapped run (or of the hole) starting at lblk.
+ * returns TESTFS_MAP_MAPPED or TESTFS_MAP_UNWRITTEN if lblk has a block,
+ * TESTFS_MAP_HOLE if it does not
+ */
+int testfs_extent_map(struct inode *inode, u32 lblk, u32 *len, u32 *pblk)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct extent_list list;
+	struct testfs_extent *ext		= NULL;
+	u32 start, ext_len;
+	int i, err;
+	int mapped				= TESTFS_MAP_HOLE;
+
+	down_read(&testfs_inode->i_extent_sem);
+
+	err = get_extent_list(inode, &list);
+	if (err) {
+		up_read(&testfs_inode->i_extent_sem);
+		return err;
+	}
+
+	i = search_extent(&list, lblk);
+	if (i >= 0) {
+		ext 	= &list.ext[i];
+		start 	= le32_to_cpu(ext->ee_block);
+		ext_len = le16_to_cpu(ext->ee_len);
+
+		if (lblk < start + ext_len) {
+			*pblk 	= le32_to_cpu(ext->ee_start) + (lblk - start);
+			*len 	= min(*len, start + ext_len - lblk);
+			mapped 	= (le16_to_cpu(ext->ee_flags) & TESTFS_EXTENT_UNWRITTEN) ?
+				  TESTFS_MAP_UNWRITTEN : TESTFS_MAP_MAPPED;
+		}
+	}
+
+	if (!mapped) {
+		/* the hole runs up to the next extent */
+		if (i + 1 < list.count)
+			*len = min(*len, le32_to_cpu(list.ext[i + 1].ee_block) - lblk);
+		*pblk = 0;
+	}
+
+	put_extent_list(&list);
+	up_read(&testfs_inode->i_extent_sem);
+	return mapped;
+}
+
+
+/*
+ * physical block where lblk should preferably go: right behind the extent
+ * preceding it, so that files which grow sequentially stay contiguous.
+ * 0 means no preference
+ */
+u32 testfs_extent_goal(struct inode *inode, u32 lblk)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct extent_list list;
+	u32 goal				= 0;
+
+	down_read(&testfs_inode->i_extent_sem);
+
+	if (!get_extent_list(inode, &list)) {
+		goal = list_goal(&list, lblk);
+		put_extent_list(&list);
+	}
+
+	up_read(&testfs_inode->i_extent_sem);
+	return goal;
+}
+
+
+/*
+ * records that the len blocks starting at lblk live at pblk. The range must
+ * be a hole. Merges with the neighbouring extents whenever they are
+ * contiguous both logically and physically, and of the same kind.
+ */
+int testfs_extent_insert(struct inode *inode, u32 lblk, u32 pblk, u32 len, u16 flags)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct extent_list list;
+	struct testfs_extent *ext		= NULL;
+	struct testfs_extent new;
+	u32 ext_len;
+	int i, err;
+	int changed				= 0;
+
+	down_write(&testfs_inode->i_extent_sem);
+
+	err = get_extent_list(inode, &list);
+	if (err)
+		goto unlock;
+
+	i = search_extent(&list, lblk);
+
+	if (i >= 0) {
+		ext 	= &list.ext[i];
+		ext_len = le16_to_cpu(ext->ee_len);
+
+		if (le32_to_cpu(ext->ee_block) + ext_len == lblk &&
+		    le32_to_cpu(ext->ee_start) + ext_len == pblk &&
+		    le16_to_cpu(ext->ee_flags) == flags &&
+		    ext_len + len <= TESTFS_EXTENT_MAX_LEN) {
+			ext->ee_len = cpu_to_le16(ext_len + len);
+			goto dirty;
+		}
+	}
+
+	if (i + 1 < list.count) {
+		ext 	= &list.ext[i + 1];
+		ext_len = le16_to_cpu(ext->ee_len);
+
+		if (lblk + len == le32_to_cpu(ext->ee_block) &&
+		    pblk + len == le32_to_cpu(ext->ee_start) &&
+		    le16_to_cpu(ext->ee_flags) == flags &&
+		    ext_len + len <= TESTFS_EXTENT_MAX_LEN) {
+			ext->ee_block 	= cpu_to_le32(lblk);
+			ext->ee_start 	= cpu_to_le32(pblk);
+			ext->ee_len 	= cpu_to_le16(ext_len + len);
+			goto dirty;
+		}
+	}
+
+	fill_extent(&new, lblk, pblk, len, flags);
+
+	err = replace_extents(inode, &list, i + 1, 0, &new, 1);
+	if (err)
+		goto out;
+
+dirty:
+	if (list.bh)
+		testfs_trans_dirty_bh(inode->i_sb, list.bh, TESTFS_TRANS_INODE);
+	changed = 1;
+
+out:
+	put_extent_list(&list);
+unlock:
+	up_write(&testfs_inode->i_extent_sem);
+
+	if (changed)
+		mark_inode_dirty(inode);
+	return err;
+}
+
+
+/*
+ * sets the flags of the blocks from lblk to lblk + len, splitting the
+ * extents that only partly lie in the range. Holes are left alone. This
+ * is how unwritten blocks become regular ones once their data is written
+ */
+int testfs_extent_set_flags(struct inode *inode, u32 lblk, u32 len, u16 flags)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct extent_list list;
+	struct testfs_extent *ext		= NULL;
+	struct testfs_extent new[3];
+	u32 start, ext_len, pblk, from, to;
+	u32 end					= lblk + len;
+	int i, n, err				= 0;
+	int changed				= 0;
+
+	down_write(&testfs_inode->i_extent_sem);
+
+	err = get_extent_list(inode, &list);
+	if (err) {
+		up_write(&testfs_inode->i_extent_sem);
+		return err;
+	}
+
+	i = max(search_extent(&list, lblk), 0);
+
+	for (; i < list.count; i++) {
+		ext 	= &list.ext[i];
+		start 	= le32_to_cpu(ext->ee_block);
+		ext_len = le16_to_cpu(ext->ee_len);
+		pblk 	= le32_to_cpu(ext->ee_start);
+
+		if (start >= end)
+			break;
+		if (start + ext_len <= lblk || le16_to_cpu(ext->ee_flags) == flags)
+			continue;
+
+		from 	= max(lblk, start);
+		to 	= min(end, start + ext_len);
+		n 	= 0;
+
+		if (from > start)
+			fill_extent(&new[n++], start, pblk, from - start, le16_to_cpu(ext->ee_flags));
+		fill_extent(&new[n++], from, pblk + (from - start), to - from, flags);
+		if (to < start + ext_len)
+			fill_extent(&new[n++], to, pblk + (to - start), start + ext_len - to,
+				    le16_to_cpu(ext->ee_flags));
+
+		err = replace_extents(inode, &list, i, 1, new, n);
+		if (err)
+			break;
+		changed = 1;
+
+		/* the changed part may now join the extents around it */
+		i += (from > start);
+		if (to == start + ext_len)
+			merge_prev(inode, &list, i + 1);
+		if (from == start && merge_prev(inode, &list, i))
+			i--;
+	}
+
+	if (changed && list.bh)
+		testfs_trans_dirty_bh(inode->i_sb, list.bh, TESTFS_TRANS_INODE);
+
+	put_extent_list(&list);
+	up_write(&testfs_inode->i_extent_sem);
+
+	if (changed)
+		mark_inode_dirty(inode);
+	return err;
+}
+
+
+/*
+ * frees the blocks from lblk to lblk + len, once the running transaction
+ * is on disk, and turns them into a hole
+ */
+int testfs_extent_remove(struct inode *inode, u32 lblk, u32 len)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct extent_list list;
+	struct testfs_extent *ext		= NULL;
+	struct testfs_extent new[2];
+	u32 start, ext_len, pblk, from, to;
+	u32 end					= lblk + len;
+	int i, n, err				= 0;
+	int changed				= 0;
+	u16 flags;
+
+	/* up to the last block */
+	if (end < lblk)
+		end = (u32)-1;
+
+	down_write(&testfs_inode->i_extent_sem);
+
+	err = get_extent_list(inode, &list);
+	if (err) {
+		up_write(&testfs_inode->i_extent_sem);
+		return err;
+	}
+
+	i = max(search_extent(&list, lblk), 0);
+
+	while (i < list.count) {
+		ext 	= &list.ext[i];
+		start 	= le32_to_cpu(ext->ee_block);
+		ext_len = le16_to_cpu(ext->ee_len);
+		pblk 	= le32_to_cpu(ext->ee_start);
+		flags 	= le16_to_cpu(ext->ee_flags);
+
+		if (start >= end)
+			break;
+		if (start + ext_len <= lblk) {
+			i++;
+			continue;
+		}
+
+		from 	= max(lblk, start);
+		to 	= min(end, start + ext_len);
+		n 	= 0;
+
+		if (from > start)
+			fill_extent(&new[n++], start, pblk, from - start, flags);
+		if (to < start + ext_len)
+			fill_extent(&new[n++], to, pblk + (to - start), start + ext_len - to, flags);
+
+		/* cutting a hole in the middle needs room for one more extent */
+		err = replace_extents(inode, &list, i, 1, new, n);
+		if (err)
+			break;
+		changed = 1;
+
+		inode_delete_data_blocks(inode->i_sb, pblk + (from - start), to - from);
+		inode->i_blocks -= (u64)(to - from) << (inode->i_blkbits - 9);
+
+		i += n;
+	}
+
+	if (changed && list.bh)
+		testfs_trans_dirty_bh(inode->i_sb, list.bh, TESTFS_TRANS_INODE);
+
+	put_extent_list(&list);
+	up_write(&testfs_inode->i_extent_sem);
+
+	if (changed)
+		mark_inode_dirty(inode);
+	return err;
+}
+
+
+/*
+ * reports the extents from lblk up to end to FIEMAP. They are copied out a
+ * batch at a time, so that user memory is never written to with
+ * i_extent_sem held
+ */
+int testfs_extent_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u32 lblk, u32 end)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct testfs_extent batch[FIEMAP_BATCH];
+	struct extent_list list;
+	u32 start, len, flags;
+	int i, n, more, err;
+
+	while (lblk < end) {
+		down_read(&testfs_inode->i_extent_sem);
+
+		err = get_extent_list(inode, &list);
+		if (err) {
+			up_read(&testfs_inode->i_extent_sem);
+			return err;
+		}
+
+		i = max(search_extent(&list, lblk), 0);
+		if (i < list.count &&
+		    le32_to_cpu(list.ext[i].ee_block) + le16_to_cpu(list.ext[i].ee_len) <= lblk)
+			i++;
+
+		n 	= min(list.count - i, FIEMAP_BATCH);
+		more 	= (i + n < list.count);
+		memcpy(batch, &list.ext[i], n * sizeof(struct testfs_extent));
+
+		put_extent_list(&list);
+		up_read(&testfs_inode->i_extent_sem);
+
+		for (i = 0; i < n; i++) {
+			start 	= le32_to_cpu(batch[i].ee_block);
+			len 	= le16_to_cpu(batch[i].ee_len);
+
+			if (start >= end)
+				return 0;
+
+			flags = 0;
+			if (le16_to_cpu(batch[i].ee_flags) & TESTFS_EXTENT_UNWRITTEN)
+				flags |= FIEMAP_EXTENT_UNWRITTEN;
+			if (!more && i == n - 1)
+				flags |= FIEMAP_EXTENT_LAST;
+
+			err = fiemap_fill_next_extent(fieinfo, (u64)start << inode->i_blkbits,
+						      (u64)le32_to_cpu(batch[i].ee_start) << inode->i_blkbits,
+						      (u64)len << inode->i_blkbits, flags);
+			if (err)
+				return err < 0 ? err : 0;
+
+			lblk = start + len;
+		}
+
+		if (!more)
+			break;
+	}
+
+	return 0;
+}
+
+
+/*
+ * releases every data block of the inode, including the extent block
+ */
+int testfs_extent_free_all(struct inode *inode)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct extent_list list;
+	u32 block;
+	int i, err;
+
+	down_write(&testfs_inode->i_extent_sem);
+
+	err = get_extent_list(inode, &list);
+	if (err) {
+		up_write(&testfs_inode->i_extent_sem);
+		return err;
+	}
+
+	for (i = 0; i < list.count; i++)
+		inode_delete_data_blocks(inode->i_sb, le32_to_cpu(list.ext[i].ee_start),
+					 le16_to_cpu(list.ext[i].ee_len));
+
+	put_extent_list(&list);
+
+	block = le32_to_cpu(testfs_inode->i_extent_block);
+	if (block)
+		inode_delete_data_blocks(inode->i_sb, block, 1);
+
+	memset(testfs_inode->i_extents, 0x00, sizeof(testfs_inode->i_extents));
+	testfs_inode->i_extent_count = 0;
+	testfs_inode->i_extent_block = 0;
+	inode->i_blocks = 0;
+
+	up_write(&testfs_inode->i_extent_sem);
+
+	mark_inode_dirty(inode);
+	return 0;
+}
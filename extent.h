@@ -0,0 +1,41 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <linux/fs.h>
+
+#define TESTFS_INODE_EXTENTS	3		/* Extents kept in the inode itself */
+#define TESTFS_EXTENT_MAGIC	0x7E57
+#define TESTFS_EXTENT_MAX_LEN	0xFFFF		/* Longest run a single extent can describe */
+
+/* Run of physically contiguous blocks */
+struct testfs_extent {
+	__le32 ee_block;	/* First logical block */
+	__le32 ee_start;	/* First physical block */
+	__le16 ee_len;		/* Number of blocks */
+	__le16 ee_flags;	/* TESTFS_EXTENT_* */
+};
+
+/* Allocated, but never written: reads return zeros without any I/O */
+#define TESTFS_EXTENT_UNWRITTEN	0x0001
+
+/* Header of the extent block, followed by the extents themselves */
+struct testfs_extent_header {
+	__le16 eh_magic;	/* TESTFS_EXTENT_MAGIC */
+	__le16 eh_max;		/* Number of extents the block can hold */
+	__le32 eh_reserved;
+};
+
+/* Results of testfs_extent_map() */
+#define TESTFS_MAP_HOLE		0
+#define TESTFS_MAP_MAPPED	1
+#define TESTFS_MAP_UNWRITTEN	2
+
+int testfs_extent_map(struct inode *inode, u32 lblk, u32 *len, u32 *pblk);
+int testfs_extent_insert(struct inode *inode, u32 lblk, u32 pblk, u32 len, u16 flags);
+int testfs_extent_set_flags(struct inode *inode, u32 lblk, u32 len, u16 flags);
+int testfs_extent_remove(struct inode *inode, u32 lblk, u32 len);
+u32 testfs_extent_goal(struct inode *inode, u32 lblk);
+int testfs_extent_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u32 lblk, u32 end);
+int testfs_extent_free_all(struct inode *inode);
+
+#endif /* EXTENT_H */
@@ -1,68 +1,521 @@
 #include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/falloc.h>
+#include <linux/pagemap.h>
+#include <linux/pagevec.h>
 #include <linux/quotaops.h>
 
+#include "testfs.h"
+#include "super.h"
+#include "inode.h"
 #include "file.h"
+#include "aops.h"
+#include "balloc.h"
+#include "commit.h"
+#include "inline.h"
 
+/*
+ * writes the data back, then joins the next commit: fsync calls arriving
+ * together share a single metadata write and cache flush
+ */
 int testfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 {
-	return generic_file_fsync(file, start, end, datasync);	
+	struct inode *inode = file->f_mapping->host;
+	int err = 0;
+
+	err = filemap_write_and_wait_range(inode->i_mapping, start, end);
+	if (err)
+		return err;
+
+	return testfs_commit_wait(inode->i_sb);
 }
 
 
-loff_t testfs_llseek(struct file *file, loff_t offset, int whence)
+/*
+ * reads the extent block ahead, so that the first reads and AIO submissions
+ * on a large file do not stop to wait for it while mapping their blocks
+ */
+int testfs_file_open(struct inode *inode, struct file *file)
+{
+	u32 block = le32_to_cpu(TESTFS_GET_INODE(inode)->i_extent_block);
+
+	if (block)
+		sb_breadahead(inode->i_sb, block);
+
+	return dquot_file_open(inode, file);
+}
+
+
+/*
+ * the last writer gives back the blocks set aside for the file to grow into
+ */
+int testfs_release(struct inode *inode, struct file *file)
+{
+	if ((file->f_mode & FMODE_WRITE) && atomic_read(&inode->i_writecount) == 1)
+		testfs_release_window(inode);
+
+	return 0;
+}
+
+
+/*
+ * zeroes the bytes from..to, which lie in a single page, through the page
+ * cache so that the zeros reach the disk with the next writeback. Blocks
+ * that read as zeros anyway are left alone unless their page is cached
+ */
+static int zero_partial_page(struct inode *inode, loff_t from, loff_t to)
+{
+	struct address_space *mapping	= inode->i_mapping;
+	struct page *page		= NULL;
+	void *fsdata			= NULL;
+	u32 lblk			= from >> inode->i_blkbits;
+	u32 len				= ((to - 1) >> inode->i_blkbits) - lblk + 1;
+	struct testfs_map map;
+	int err;
+
+	if (from >= to)
+		return 0;
+
+	page = find_get_page(mapping, from >> PAGE_CACHE_SHIFT);
+	if (page)
+		page_cache_release(page);
+	else if (!testfs_map_blocks(inode, lblk, len, 0, &map) &&
+		 map.m_type != TESTFS_MAP_MAPPED && map.m_len == len)
+		return 0;
+
+	err = pagecache_write_begin(NULL, mapping, from, to - from, 0, &page, &fsdata);
+	if (err)
+		return err;
+
+	zero_user(page, from & (PAGE_CACHE_SIZE - 1), to - from);
+
+	err = pagecache_write_end(NULL, mapping, from, to - from, to - from, page, fsdata);
+	return err < 0 ? err : 0;
+}
+
+
+/*
+ * gives every hole from lblk to end unwritten blocks, a few contiguous runs
+ * at a time. The blocks must not eat into what delayed allocation reserved
+ */
+static int alloc_range(struct inode *inode, u32 lblk, u32 end)
+{
+	struct super_block *sb			= inode->i_sb;
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct testfs_handle handle;
+	unsigned long block, count;
+	u32 len, pblk;
+	int err					= 0;
+
+	while (lblk < end) {
+		len = end - lblk;
+
+		testfs_trans_start(sb, &handle);
+		mutex_lock(&testfs_inode->i_alloc_mutex);
+
+		err = testfs_extent_map(inode, lblk, &len, &pblk);
+		if (err == TESTFS_MAP_HOLE) {
+			count 	= min_t(u32, len, TESTFS_EXTENT_MAX_LEN);
+			err 	= inode_alloc_data_blocks(sb, inode, testfs_extent_goal(inode, lblk), &count, &block, 0);
+			if (!err) {
+				inode->i_blocks += count << (inode->i_blkbits - 9);
+
+				err = testfs_extent_insert(inode, lblk, block, count, TESTFS_EXTENT_UNWRITTEN);
+				if (err) {
+					inode->i_blocks -= count << (inode->i_blkbits - 9);
+					inode_delete_data_blocks(sb, block, count);
+				}
+			}
+
+			len = count;
+		}
+
+		mutex_unlock(&testfs_inode->i_alloc_mutex);
+		testfs_trans_stop(&handle);
+
+		if (err < 0)
+			return err;
+
+		lblk 	+= len;
+		err 	= 0;
+
+		cond_resched();
+	}
+
+	return 0;
+}
+
+
+/*
+ * returns the blocks from offset to offset + len to the free space. Only
+ * whole pages lose their blocks, the rest of the range is zeroed in place.
+ * Past the end of the file nothing is zeroed, the blocks go up to the end
+ * of the range
+ */
+static int punch_hole(struct inode *inode, loff_t offset, loff_t len)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct testfs_handle handle;
+	loff_t size 				= i_size_read(inode);
+	loff_t end 				= offset + len;
+	loff_t first, last, stop;
+	int err;
+
+	if (offset >= size)
+		return 0;
+
+	/* direct I/O in flight must not write to blocks freed under it */
+	inode_dio_wait(inode);
+
+	first 	= round_up(offset, PAGE_CACHE_SIZE);
+	last 	= round_down(end, PAGE_CACHE_SIZE);
+	stop 	= last;
+	if (end >= size) {
+		stop 	= round_up(end, inode->i_sb->s_blocksize);
+		last 	= round_up(end, PAGE_CACHE_SIZE);
+		end 	= size;
+	}
+
+	/* within a single page */
+	if (first > last)
+		return zero_partial_page(inode, offset, end);
+
+	err = zero_partial_page(inode, offset, min(first, end));
+	if (!err && end > last)
+		err = zero_partial_page(inode, last, end);
+	if (err || first == last)
+		return err;
+
+	truncate_pagecache_range(inode, first, last - 1);
+	testfs_convert_written(inode);
+
+	testfs_trans_start(inode->i_sb, &handle);
+	mutex_lock(&testfs_inode->i_alloc_mutex);
+	err = testfs_extent_remove(inode, first >> inode->i_blkbits, (stop - first) >> inode->i_blkbits);
+	mutex_unlock(&testfs_inode->i_alloc_mutex);
+	testfs_trans_stop(&handle);
+
+	return err;
+}
+
+
+#ifdef FALLOC_FL_ZERO_RANGE
+/*
+ * makes the range read as zeros while keeping it allocated: whole pages
+ * turn unwritten without writing a single block, the edges are zeroed in
+ * place
+ */
+static int zero_range(struct inode *inode, loff_t offset, loff_t len)
+{
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(inode);
+	struct testfs_handle handle;
+	loff_t size 				= i_size_read(inode);
+	loff_t end 				= offset + len;
+	loff_t first, last;
+	int err;
+
+	/* direct I/O in flight must not write to blocks turned unwritten under it */
+	inode_dio_wait(inode);
+
+	first 	= round_up(offset, PAGE_CACHE_SIZE);
+	last 	= round_down(end, PAGE_CACHE_SIZE);
+
+	/* past the end of the file the blocks are allocated unwritten anyway */
+	if (first > last) {
+		err = zero_partial_page(inode, offset, min(end, size));
+	}
+	else {
+		err = zero_partial_page(inode, offset, min(first, size));
+		if (!err)
+			err = zero_partial_page(inode, last, min(end, size));
+	}
+	if (err)
+		return err;
+
+	if (first < last) {
+		truncate_pagecache_range(inode, first, last - 1);
+		testfs_convert_written(inode);
+
+		testfs_trans_start(inode->i_sb, &handle);
+		mutex_lock(&testfs_inode->i_alloc_mutex);
+		err = testfs_extent_set_flags(inode, first >> inode->i_blkbits,
+					      (last - first) >> inode->i_blkbits, TESTFS_EXTENT_UNWRITTEN);
+		mutex_unlock(&testfs_inode->i_alloc_mutex);
+		testfs_trans_stop(&handle);
+		if (err)
+			return err;
+	}
+
+	return alloc_range(inode, offset >> inode->i_blkbits,
+			   (end + inode->i_sb->s_blocksize - 1) >> inode->i_blkbits);
+}
+#endif
+
+
+/*
+ * preallocates the range as unwritten blocks, or with FALLOC_FL_PUNCH_HOLE
+ * frees it. Unwritten blocks need a filesystem formatted for them
+ */
+long testfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	struct inode *inode 	= file->f_mapping->host;
+	int supported 		= FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE;
+	loff_t end 		= offset + len;
+	int err;
+
+#ifdef FALLOC_FL_ZERO_RANGE
+	supported |= FALLOC_FL_ZERO_RANGE;
+#endif
+
+	if (mode & ~supported)
+		return -EOPNOTSUPP;
+
+	if (!(mode & FALLOC_FL_PUNCH_HOLE) &&
+	    !(TESTFS_GET_SB(inode->i_sb)->feature_incompat & TESTFS_FEATURE_INCOMPAT_UNWRITTEN))
+		return -EOPNOTSUPP;
+
+	if (end > inode->i_sb->s_maxbytes || end < offset)
+		return -EFBIG;
+
+	mutex_lock(&inode->i_mutex);
+
+	/* blocks, holes and unwritten extents are for files with blocks */
+	if (testfs_has_inline(inode)) {
+		err = testfs_inline_convert(inode);
+		if (err)
+			goto out;
+	}
+
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		err = punch_hole(inode, offset, len);
+		goto out;
+	}
+
+#ifdef FALLOC_FL_ZERO_RANGE
+	if (mode & FALLOC_FL_ZERO_RANGE)
+		err = zero_range(inode, offset, len);
+	else
+#endif
+		err = alloc_range(inode, offset >> inode->i_blkbits,
+				  (end + inode->i_sb->s_blocksize - 1) >> inode->i_blkbits);
+
+	if (!err && !(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode))
+		i_size_write(inode, end);
+
+out:
+	if (!err) {
+		inode->i_ctime = inode->i_mtime = CURRENT_TIME_SEC;
+		mark_inode_dirty(inode);
+	}
+
+	mutex_unlock(&inode->i_mutex);
+	return err;
+}
+
+
+/*
+ * a file cut short gives back every block past its new end, preallocated
+ * ones included
+ */
+int testfs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode	= dentry->d_inode;
+	int err;
+
+	err = inode_change_ok(inode, attr);
+	if (err)
+		return err;
+
+	/* direct I/O in flight must not write to blocks freed under it */
+	if (attr->ia_valid & ATTR_SIZE)
+		inode_dio_wait(inode);
+
+	/* an inline file grows out of its inode, or loses the tail of its data */
+	if ((attr->ia_valid & ATTR_SIZE) && testfs_has_inline(inode)) {
+		if (attr->ia_size > TESTFS_INLINE_SIZE(inode->i_sb))
+			err = testfs_inline_convert(inode);
+		else if (attr->ia_size < i_size_read(inode))
+			err = testfs_inline_truncate(inode, attr->ia_size);
+		if (err)
+			return err;
+	}
+
+	if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size < i_size_read(inode)) {
+		/* the tail of the last block must read as zeros once the file grows again */
+		err = block_truncate_page(inode->i_mapping, attr->ia_size, testfs_get_block);
+		if (err)
+			return err;
+
+		truncate_setsize(inode, attr->ia_size);
+
+		err = testfs_truncate_blocks(inode, attr->ia_size);
+		if (err)
+			return err;
+
+		inode->i_ctime = inode->i_mtime = CURRENT_TIME_SEC;
+	}
+	else if (attr->ia_valid & ATTR_SIZE) {
+		truncate_setsize(inode, attr->ia_size);
+	}
+
+	setattr_copy(inode, attr);
+	mark_inode_dirty(inode);
+
+	return 0;
+}
+
+
+/*
+ * first block from lblk on, before end, whose page holds data not written
+ * back yet. Such data may sit on a hole or on unwritten blocks, which only
+ * get their blocks at writeback. end if there is none
+ */
+static u32 cached_data(struct inode *inode, u32 lblk, u32 end)
 {
-	int ret = 0;
-	ret = generic_file_llseek(file, offset, whence);
+	unsigned int shift	= PAGE_CACHE_SHIFT - inode->i_blkbits;
+	pgoff_t index		= lblk >> shift;
+	struct pagevec pvec;
+	u32 block		= end;
+
+	pagevec_init(&pvec, 0);
 
-	printk(KERN_INFO "testfs: testfs_llseek called...\n");
+	if (pagevec_lookup_tag(&pvec, inode->i_mapping, &index, PAGECACHE_TAG_DIRTY, 1)) {
+		if (pvec.pages[0]->index < ((pgoff_t)end + (1 << shift) - 1) >> shift)
+			block = max_t(u32, pvec.pages[0]->index << shift, lblk);
+		pagevec_release(&pvec);
+	}
 
-	return ret;
+	return block;
 }
 
 
-ssize_t testfs_aio_read(struct kiocb *iocb, const struct iovec *iov, unsigned long nr_segs, loff_t pos)
+/*
+ * SEEK_DATA and SEEK_HOLE, from the extents and the dirty pages alone. No
+ * data block is read: holes and unwritten blocks count as holes, unless
+ * their page is dirty. The end of the file is a hole
+ */
+static loff_t seek_data_hole(struct file *file, loff_t offset, int whence)
 {
-	int ret = 0;
-	printk(KERN_INFO "testfs: testfs_aio_read\n");
-	ret = generic_file_aio_read(iocb, iov, nr_segs, pos);
+	struct inode *inode 	= file->f_mapping->host;
+	loff_t size 		= i_size_read(inode);
+	loff_t pos 		= size;
+	struct testfs_map map;
+	u32 lblk, last, len, data;
+	int ret;
+
+	if (offset < 0 || offset >= size)
+		return -ENXIO;
+
+	/* inline data has no holes */
+	if (testfs_has_inline(inode))
+		return whence == SEEK_DATA ? offset : size;
+
+	lblk 	= offset >> inode->i_blkbits;
+	last 	= (size + inode->i_sb->s_blocksize - 1) >> inode->i_blkbits;
+
+	while (lblk < last) {
+		ret = testfs_map_blocks(inode, lblk, last - lblk, 0, &map);
+		if (ret)
+			return ret;
+
+		len = map.m_len;
+		if (map.m_type == TESTFS_MAP_MAPPED) {
+			ret = 1;
+		}
+		else {
+			data 	= cached_data(inode, lblk, lblk + len);
+			ret 	= (data == lblk);
+
+			/* a hole up to the data, or data up to the end of its page */
+			if (!ret)
+				len = data - lblk;
+			else
+				len = min_t(u32, len, (PAGE_CACHE_SIZE >> inode->i_blkbits) -
+					  (lblk & ((PAGE_CACHE_SIZE >> inode->i_blkbits) - 1)));
+		}
+
+		if (ret == (whence == SEEK_DATA)) {
+			pos = max_t(loff_t, offset, (loff_t)lblk << inode->i_blkbits);
+			break;
+		}
 
-	return ret;
+		lblk += len;
+		cond_resched();
+	}
+
+	if (lblk >= last && whence == SEEK_DATA)
+		return -ENXIO;
+
+	return min(pos, size);
 }
 
 
-ssize_t testfs_sync_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos)
+/*
+ * the whole layout of the file in one call. FIEMAP_FLAG_SYNC has the VFS
+ * write the file back first, so that delayed blocks show up too
+ */
+int testfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len)
 {
-	int ret = 0;
-	printk(KERN_INFO "testfs: testfs_sync_read\n");
-	ret = do_sync_read(filp, buf, len, ppos);
+	u64 end;
+	int err;
+
+	err = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC);
+	if (err)
+		return err;
+
+	end = (len > ~0ULL - start) ? ~0ULL : start + len;
+	end = min_t(u64, (end >> inode->i_blkbits) + !!(end & (inode->i_sb->s_blocksize - 1)), (u32)-1);
 
-	return ret;
+	if ((start >> inode->i_blkbits) >= end)
+		return 0;
+
+	if (testfs_has_inline(inode))
+		return testfs_inline_fiemap(inode, fieinfo);
+
+	return testfs_extent_fiemap(inode, fieinfo, start >> inode->i_blkbits, end);
 }
 
 
-ssize_t testfs_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+loff_t testfs_llseek(struct file *file, loff_t offset, int whence)
 {
-	int ret = 0;
-	printk(KERN_INFO "testfs: testfs_splice_read\n");
-	ret = generic_file_splice_read(in, ppos, pipe, len, flags);
+	struct inode *inode = file->f_mapping->host;
 
-	return ret;
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return generic_file_llseek(file, offset, whence);
+
+	mutex_lock(&inode->i_mutex);
+
+	offset = seek_data_hole(file, offset, whence);
+	if (offset >= 0 && offset != file->f_pos) {
+		file->f_pos 	= offset;
+		file->f_version = 0;
+	}
+
+	mutex_unlock(&inode->i_mutex);
+
+	return offset;
 }
 
+
 /* file operations */
 
 const struct file_operations testfs_file_fops = {
 	.llseek 	= testfs_llseek,
-	.aio_read 	= testfs_aio_read,
+	.aio_read 	= generic_file_aio_read,
 	.aio_write 	= generic_file_aio_write,
-	.read		= testfs_sync_read,
+	.read		= do_sync_read,
 	.write		= do_sync_write,
-	.splice_read	= testfs_splice_read,
+	.splice_read	= generic_file_splice_read,
 	.splice_write	= generic_file_splice_write,
 	.mmap		= generic_file_mmap,
-	.open		= dquot_file_open,
-	.fsync 		= testfs_fsync
+	.open		= testfs_file_open,
+	.release	= testfs_release,
+	.fsync 		= testfs_fsync,
+	.fallocate	= testfs_fallocate
 };
 
 /* file inode operations */
-const struct inode_operations testfs_file_iops;
+const struct inode_operations testfs_file_iops = {
+	.setattr	= testfs_setattr,
+	.fiemap		= testfs_fiemap
+};
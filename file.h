@@ -2,6 +2,13 @@
 #define FILE_H
 
 
+int testfs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+int testfs_file_open(struct inode *inode, struct file *file);
+int testfs_release(struct inode *inode, struct file *file);
+long testfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len);
+int testfs_setattr(struct dentry *dentry, struct iattr *attr);
+int testfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len);
+
 extern const struct file_operations testfs_file_fops;
 extern const struct inode_operations testfs_file_iops;
 
@@ -0,0 +1,1213 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+
+#include "testfs.h"
+#include "inode.h"
+#include "dir.h"
+#include "htree.h"
+#include "commit.h"
+
+/*
+ * A directory starts out as a single block of entries. Once that block is
+ * full, its entries move to a new block and block 0 becomes the root of a
+ * hash index: every name hashes to a 32 bit value, and the root maps hash
+ * ranges to leaf blocks. A full leaf is split in two at a hash boundary.
+ * When the root runs out of slots, its entries move to an index node and
+ * the root points to nodes instead, which gives two levels and room for
+ * millions of entries. Lookups and inserts read at most three blocks.
+ *
+ * Entries have variable length and chain through rec_len. A new entry
+ * takes the unused tail of an existing one, and a deleted entry is merged
+ * into the one before it.
+ */
+
+#define DX_MAX_LEVELS	2
+
+/* In block 0 of an indexed directory, after "." and ".." */
+#define DX_MARKER_OFFSET	(2 * TESTFS_DIR_REC_LEN(2))
+
+/* Upper bound of the entries in a block */
+#define DIR_MAX_ENTRIES(sb)	((sb)->s_blocksize / TESTFS_DIR_REC_LEN(1))
+
+/*
+ * Positions in an indexed directory: "." and ".." keep their offsets in
+ * block 0, names follow in hash order. Bit 0 of a name hash is clear
+ */
+#define DX_POS_BASE		((loff_t)TESTFS_MAX_BLOCK_SIZE + 1)
+#define DX_POS(hash)		(DX_POS_BASE + ((hash) >> 1))
+#define DX_POS_EOF		(DX_POS_BASE + (1LL << 31))
+
+struct dx_frame {
+	struct buffer_head *bh;		/* Block holding the node */
+	struct testfs_dx_node *node;
+	int at;				/* Entry followed on the way down */
+};
+
+struct dx_map {
+	u32 hash;
+	u32 offset;		/* Of the entry in its block */
+};
+
+static const struct qstr dot 	= QSTR_INIT(".", 1);
+static const struct qstr dotdot	= QSTR_INIT("..", 2);
+
+
+/*
+ * FNV-1a of the name. It ends up on disk, so it must not depend on the
+ * kernel version or the architecture. Bit 0 is reserved for continuations
+ */
+static u32 dx_hash(const char *name, int len)
+{
+	u32 hash = 0x811c9dc5;
+
+	while (len--) {
+		hash ^= (u8)*name++;
+		hash *= 0x01000193;
+	}
+
+	return hash & ~1;
+}
+
+
+static inline struct testfs_dir_entry *dir_entry(struct buffer_head *bh, unsigned offset)
+{
+	return (struct testfs_dir_entry *)(bh->b_data + offset);
+}
+
+
+static inline struct testfs_dx_root *dx_root(struct buffer_head *bh)
+{
+	return (struct testfs_dx_root *)(bh->b_data + DX_MARKER_OFFSET + TESTFS_DIR_REC_LEN(0));
+}
+
+
+static inline struct testfs_dx_node *dx_node(struct buffer_head *bh)
+{
+	return (struct testfs_dx_node *)(bh->b_data + TESTFS_DIR_REC_LEN(0));
+}
+
+
+static inline unsigned dx_count(struct testfs_dx_node *node)
+{
+	return le16_to_cpu(node->count);
+}
+
+
+static inline u32 dx_get_hash(struct testfs_dx_node *node, int at)
+{
+	return le32_to_cpu(node->entries[at].hash);
+}
+
+
+static inline u32 dx_get_block(struct testfs_dx_node *node, int at)
+{
+	return le32_to_cpu(node->entries[at].block);
+}
+
+
+static inline int dir_indexed(struct inode *dir, struct buffer_head *bh)
+{
+	if (testfs_has_inline(dir))
+		return 0;
+
+	return le16_to_cpu(dir_entry(bh, 0)->rec_len) == TESTFS_DIR_REC_LEN(1) &&
+	       le16_to_cpu(dir_entry(bh, TESTFS_DIR_REC_LEN(1))->rec_len) == TESTFS_DIR_REC_LEN(2) &&
+	       testfs_dir_is_marker(dir_entry(bh, DX_MARKER_OFFSET));
+}
+
+
+/*
+ * fills in everything but rec_len
+ */
+static void fill_entry(struct testfs_dir_entry *de, const struct qstr *name, u32 ino, int type)
+{
+	de->inode_number 	= cpu_to_le32(ino);
+	de->name_len 		= name->len;
+	de->type 		= type;
+	memcpy(de->name, name->name, name->len);
+}
+
+
+/*
+ * makes sure de, found in the block of bh, does not point outside of it
+ */
+int testfs_dir_check_entry(struct inode *dir, struct buffer_head *bh, struct testfs_dir_entry *de)
+{
+	unsigned offset 	= (char *)de - testfs_dir_data(dir, bh);
+	unsigned rec_len	= le16_to_cpu(de->rec_len);
+	const char *error	= NULL;
+
+	if (rec_len < TESTFS_DIR_REC_LEN(0))
+		error = "rec_len is too small";
+	else if (rec_len & (TESTFS_DIR_PAD - 1))
+		error = "rec_len is not aligned";
+	else if (rec_len < TESTFS_DIR_REC_LEN(de->name_len))
+		error = "rec_len is too small for the name";
+	else if (offset + rec_len > testfs_dir_data_size(dir))
+		error = "entry crosses the block end";
+
+	if (error) {
+		printk(KERN_ERR "testfs: bad entry in directory inode %lu, block %llu, offset %u: %s\n",
+			dir->i_ino, (unsigned long long)bh->b_blocknr, offset, error);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+
+/*
+ * reads logical block lblk of the directory. Block 0 of an inline
+ * directory is its inode table block
+ */
+struct buffer_head *testfs_dir_bread(struct inode *dir, u32 lblk)
+{
+	struct buffer_head *bh 	= NULL;
+	u32 len			= 1;
+	u32 block		= 0;
+	int ret;
+
+	if (testfs_has_inline(dir)) {
+		if (!lblk)
+			return testfs_inline_bread(dir);
+
+		printk(KERN_ERR "testfs: inline directory inode %lu has no block %u\n", dir->i_ino, lblk);
+		return ERR_PTR(-EIO);
+	}
+
+	ret = testfs_extent_map(dir, lblk, &len, &block);
+	if (ret < 0)
+		return ERR_PTR(ret);
+
+	if (ret == 0) {
+		printk(KERN_ERR "testfs: directory inode %lu has a hole at block %u\n", dir->i_ino, lblk);
+		return ERR_PTR(-EIO);
+	}
+
+	if (!(bh = sb_bread(dir->i_sb, block))) {
+		printk(KERN_INFO "testfs: error reading data block number %u from disk\n", block);
+		return ERR_PTR(-EIO);
+	}
+
+	return bh;
+}
+
+
+/*
+ * allocates a block at the end of the directory, holding one unused entry
+ */
+static struct buffer_head *dir_append_block(struct inode *dir, u32 *lblk)
+{
+	struct super_block *sb 	= dir->i_sb;
+	struct buffer_head *bh 	= NULL;
+	unsigned long block	= 0;
+	unsigned long count	= 1;
+	int err;
+
+	*lblk = testfs_dir_blocks(dir);
+
+	err = inode_alloc_data_blocks(sb, dir, testfs_extent_goal(dir, *lblk), &count, &block, 0);
+	if (err)
+		return ERR_PTR(err);
+
+	err = testfs_extent_insert(dir, *lblk, block, 1, 0);
+	if (err) {
+		inode_delete_data_blocks(sb, block, 1);
+		return ERR_PTR(err);
+	}
+	dir->i_blocks += 1 << (sb->s_blocksize_bits - 9);
+
+	if (!(bh = sb_getblk(sb, block)))
+		return ERR_PTR(-EIO);
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0x00, sb->s_blocksize);
+	dir_entry(bh, 0)->rec_len = cpu_to_le16(sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+
+	i_size_write(dir, (loff_t)(*lblk + 1) << sb->s_blocksize_bits);
+	mark_inode_dirty(dir);
+	testfs_trans_dirty_bh(sb, bh, TESTFS_TRANS_DIR);
+
+	return bh;
+}
+
+
+/*
+ * entry called name in a block of entries. NULL if there is none, an
+ * ERR_PTR if the block is corrupt
+ */
+static struct testfs_dir_entry *search_block(struct inode *dir, struct buffer_head *bh,
+	const struct qstr *name)
+{
+	struct testfs_dir_entry *de 	= (struct testfs_dir_entry *)testfs_dir_data(dir, bh);
+	char *end			= (char *)de + testfs_dir_data_size(dir);
+
+	for ( ; (char *)de < end; de = testfs_dir_next(de)) {
+		if (testfs_dir_check_entry(dir, bh, de))
+			return ERR_PTR(-EIO);
+
+		if (!de->inode_number || de->name_len != name->len)
+			continue;
+
+		if (!memcmp(de->name, name->name, name->len))
+			return de;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * puts the entry in the first gap of the block large enough for it.
+ * Returns -ENOSPC if there is none
+ */
+static int add_to_block(struct inode *dir, struct buffer_head *bh, const struct qstr *name,
+	u32 ino, int type)
+{
+	struct testfs_dir_entry *de 	= (struct testfs_dir_entry *)testfs_dir_data(dir, bh);
+	struct testfs_dir_entry *new_de	= NULL;
+	char *end			= (char *)de + testfs_dir_data_size(dir);
+	unsigned need			= TESTFS_DIR_REC_LEN(name->len);
+	unsigned used, rec_len;
+
+	for ( ; (char *)de < end; de = testfs_dir_next(de)) {
+		if (testfs_dir_check_entry(dir, bh, de))
+			return -EIO;
+
+		/* the space of a marker belongs to the index */
+		if (testfs_dir_is_marker(de))
+			break;
+
+		rec_len = le16_to_cpu(de->rec_len);
+		used 	= de->inode_number ? TESTFS_DIR_REC_LEN(de->name_len) : 0;
+		if (rec_len - used < need)
+			continue;
+
+		if (used) {
+			new_de 		= (struct testfs_dir_entry *)((char *)de + used);
+			new_de->rec_len = cpu_to_le16(rec_len - used);
+			de->rec_len 	= cpu_to_le16(used);
+			de 		= new_de;
+		}
+
+		fill_entry(de, name, ino, type);
+		testfs_trans_dirty_bh(dir->i_sb, bh, TESTFS_TRANS_DIR);
+		dir->i_version++;
+		return 0;
+	}
+
+	return -ENOSPC;
+}
+
+
+/*
+ * writes the entries of src listed in map, one after the other, to the
+ * block dst. The last one takes what is left of the block
+ */
+static void pack_entries(struct super_block *sb, char *dst, char *src, struct dx_map *map, int count)
+{
+	struct testfs_dir_entry *de 	= NULL;
+	struct testfs_dir_entry *last	= NULL;
+	unsigned offset			= 0;
+	int i;
+
+	memset(dst, 0x00, sb->s_blocksize);
+
+	for (i = 0; i < count; i++) {
+		de 		= (struct testfs_dir_entry *)(src + map[i].offset);
+		last 		= (struct testfs_dir_entry *)(dst + offset);
+		memcpy(last, de, TESTFS_DIR_REC_LEN(de->name_len));
+		last->rec_len 	= cpu_to_le16(TESTFS_DIR_REC_LEN(de->name_len));
+		offset 		+= TESTFS_DIR_REC_LEN(de->name_len);
+	}
+
+	if (!last)
+		last = (struct testfs_dir_entry *)dst;
+	last->rec_len = cpu_to_le16(dst + sb->s_blocksize - (char *)last);
+}
+
+
+/*
+ * last entry of node covering hash
+ */
+static int dx_search(struct testfs_dx_node *node, u32 hash)
+{
+	int lo = 1, hi = dx_count(node) - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (dx_get_hash(node, mid) > hash)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+
+	return lo - 1;
+}
+
+
+static void dx_release(struct dx_frame *frames, int levels)
+{
+	int i;
+
+	for (i = 0; i < levels; i++)
+		brelse(frames[i].bh);
+}
+
+
+/*
+ * walks the index of dir down to the leaf covering hash. Returns the number
+ * of frames filled in, the last of which points to the leaf
+ */
+static int dx_probe(struct inode *dir, u32 hash, struct dx_frame *frames)
+{
+	struct buffer_head *bh		= NULL;
+	struct testfs_dx_root *root	= NULL;
+	int levels;
+
+	bh = testfs_dir_bread(dir, 0);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	root 	= dx_root(bh);
+	levels 	= root->levels + 1;
+
+	if (levels > DX_MAX_LEVELS || !dx_count(&root->node)) {
+		printk(KERN_ERR "testfs: corrupt index in directory inode %lu\n", dir->i_ino);
+		brelse(bh);
+		return -EIO;
+	}
+
+	frames[0].bh 	= bh;
+	frames[0].node 	= &root->node;
+	frames[0].at 	= dx_search(frames[0].node, hash);
+
+	if (levels == 1)
+		return 1;
+
+	bh = testfs_dir_bread(dir, dx_get_block(frames[0].node, frames[0].at));
+	if (IS_ERR(bh)) {
+		brelse(frames[0].bh);
+		return PTR_ERR(bh);
+	}
+
+	if (!testfs_dir_is_marker(dir_entry(bh, 0)) || !dx_count(dx_node(bh))) {
+		printk(KERN_ERR "testfs: corrupt index node in directory inode %lu\n", dir->i_ino);
+		brelse(bh);
+		brelse(frames[0].bh);
+		return -EIO;
+	}
+
+	frames[1].bh 	= bh;
+	frames[1].node 	= dx_node(bh);
+	frames[1].at 	= dx_search(frames[1].node, hash);
+
+	return 2;
+}
+
+
+/*
+ * moves frames[i] to its next entry, and the frames below to the first leaf
+ * under it. Returns 1, or an error reading an index node
+ */
+static int dx_step(struct inode *dir, struct dx_frame *frames, int levels, int i)
+{
+	struct buffer_head *bh = NULL;
+
+	frames[i].at++;
+
+	for (; i < levels - 1; i++) {
+		bh = testfs_dir_bread(dir, dx_get_block(frames[i].node, frames[i].at));
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+
+		brelse(frames[i + 1].bh);
+		frames[i + 1].bh 	= bh;
+		frames[i + 1].node 	= dx_node(bh);
+		frames[i + 1].at 	= 0;
+	}
+
+	return 1;
+}
+
+
+/*
+ * names sharing a hash may spill over into the following leaves, which are
+ * flagged in the index. Moves the frames to the next such leaf; returns 1
+ * if there is one, 0 if not
+ */
+static int dx_next_leaf(struct inode *dir, u32 hash, struct dx_frame *frames, int levels)
+{
+	int i = levels - 1;
+	u32 next;
+
+	while (i >= 0 && frames[i].at + 1 >= dx_count(frames[i].node))
+		i--;
+	if (i < 0)
+		return 0;
+
+	next = dx_get_hash(frames[i].node, frames[i].at + 1);
+	if (!(next & 1) || (next & ~1) != hash)
+		return 0;
+
+	return dx_step(dir, frames, levels, i);
+}
+
+
+/*
+ * moves the frames to the leaf following the current one, whatever its
+ * hash. Returns 1 if there is one, 0 at the end of the index
+ */
+static int dx_next_block(struct inode *dir, struct dx_frame *frames, int levels)
+{
+	int i = levels - 1;
+
+	while (i >= 0 && frames[i].at + 1 >= dx_count(frames[i].node))
+		i--;
+	if (i < 0)
+		return 0;
+
+	return dx_step(dir, frames, levels, i);
+}
+
+
+/*
+ * looks name up in dir. Returns the block holding the entry, which the
+ * caller has to release, and the entry itself in *res. NULL if there is no
+ * such entry
+ */
+struct buffer_head *testfs_dir_find_entry(struct inode *dir, const struct qstr *name,
+	struct testfs_dir_entry **res)
+{
+	struct buffer_head *bh		= NULL;
+	struct dx_frame frames[DX_MAX_LEVELS];
+	u32 hash;
+	int levels, ret			= 0;
+
+	if (name->len > TESTFS_NAME_LEN)
+		return NULL;
+
+	bh = testfs_dir_bread(dir, 0);
+	if (IS_ERR(bh))
+		return bh;
+
+	if (!dir_indexed(dir, bh)) {
+		*res = search_block(dir, bh, name);
+		if (IS_ERR_OR_NULL(*res)) {
+			brelse(bh);
+			return ERR_CAST(*res);
+		}
+		return bh;
+	}
+	brelse(bh);
+
+	hash 	= dx_hash(name->name, name->len);
+	levels 	= dx_probe(dir, hash, frames);
+	if (levels < 0)
+		return ERR_PTR(levels);
+
+	do {
+		bh = testfs_dir_bread(dir, dx_get_block(frames[levels - 1].node, frames[levels - 1].at));
+		if (IS_ERR(bh))
+			break;
+
+		*res = search_block(dir, bh, name);
+		if (IS_ERR(*res)) {
+			brelse(bh);
+			bh = ERR_CAST(*res);
+			break;
+		}
+		if (*res)
+			break;
+
+		brelse(bh);
+		bh = NULL;
+	} while ((ret = dx_next_leaf(dir, hash, frames, levels)) > 0);
+
+	if (!bh && ret < 0)
+		bh = ERR_PTR(ret);
+
+	dx_release(frames, levels);
+	return bh;
+}
+
+
+/*
+ * turns a directory whose only block is full into an indexed one: the
+ * entries move to a new leaf and block 0 becomes the index root
+ */
+static int make_indexed(struct inode *dir, struct buffer_head *bh)
+{
+	struct super_block *sb		= dir->i_sb;
+	struct buffer_head *leaf_bh	= NULL;
+	struct testfs_dir_entry *de	= dir_entry(bh, 0);
+	struct testfs_dx_root *root	= NULL;
+	struct dx_map *map		= NULL;
+	char *end			= bh->b_data + sb->s_blocksize;
+	u32 dot_ino, dotdot_ino;
+	int i, count;
+	u32 lblk;
+
+	map = kmalloc(DIR_MAX_ENTRIES(sb) * sizeof(*map), GFP_NOFS);
+	if (!map)
+		return -ENOMEM;
+
+	/* everything but . and .. */
+	dot_ino 	= le32_to_cpu(de->inode_number);
+	de 		= testfs_dir_next(de);
+	dotdot_ino 	= le32_to_cpu(de->inode_number);
+
+	for (i = 0, count = 0; (char *)de < end; de = testfs_dir_next(de), i++) {
+		if (testfs_dir_check_entry(dir, bh, de)) {
+			kfree(map);
+			return -EIO;
+		}
+		if (i == 0 || !de->inode_number)
+			continue;
+		map[count++].offset = (char *)de - bh->b_data;
+	}
+
+	leaf_bh = dir_append_block(dir, &lblk);
+	if (IS_ERR(leaf_bh)) {
+		kfree(map);
+		return PTR_ERR(leaf_bh);
+	}
+
+	pack_entries(sb, leaf_bh->b_data, bh->b_data, map, count);
+	memset(bh->b_data, 0x00, sb->s_blocksize);
+
+	de = dir_entry(bh, 0);
+	fill_entry(de, &dot, dot_ino, DT_DIR);
+	de->rec_len 	= cpu_to_le16(TESTFS_DIR_REC_LEN(1));
+	de 		= testfs_dir_next(de);
+	fill_entry(de, &dotdot, dotdot_ino, DT_DIR);
+	de->rec_len 	= cpu_to_le16(TESTFS_DIR_REC_LEN(2));
+	de 		= testfs_dir_next(de);
+	de->type 	= TESTFS_DX_MARKER;
+	de->rec_len 	= cpu_to_le16(sb->s_blocksize - DX_MARKER_OFFSET);
+
+	root 			= dx_root(bh);
+	root->levels 		= 0;
+	root->node.limit 	= cpu_to_le16((sb->s_blocksize - ((char *)root->node.entries - bh->b_data))
+					      / sizeof(struct testfs_dx_entry));
+	root->node.count 	= cpu_to_le16(1);
+	root->node.entries[0].hash 	= 0;
+	root->node.entries[0].block 	= cpu_to_le32(lblk);
+
+	testfs_trans_dirty_bh(sb, leaf_bh, TESTFS_TRANS_DIR);
+	testfs_trans_dirty_bh(sb, bh, TESTFS_TRANS_DIR);
+	dir->i_version++;
+	brelse(leaf_bh);
+	kfree(map);
+
+	return 0;
+}
+
+
+static void dx_insert(struct testfs_dx_node *node, int at, u32 hash, u32 block)
+{
+	int count = dx_count(node);
+
+	memmove(&node->entries[at + 2], &node->entries[at + 1],
+		(count - at - 1) * sizeof(struct testfs_dx_entry));
+
+	node->entries[at + 1].hash 	= cpu_to_le32(hash);
+	node->entries[at + 1].block 	= cpu_to_le32(block);
+	node->count 			= cpu_to_le16(count + 1);
+}
+
+
+/*
+ * new index node at the end of the directory, holding count entries
+ */
+static struct buffer_head *dx_new_node(struct inode *dir, struct testfs_dx_entry *entries, int count, u32 *lblk)
+{
+	struct super_block *sb 		= dir->i_sb;
+	struct buffer_head *bh		= NULL;
+	struct testfs_dx_node *node	= NULL;
+
+	bh = dir_append_block(dir, lblk);
+	if (IS_ERR(bh))
+		return bh;
+
+	dir_entry(bh, 0)->type = TESTFS_DX_MARKER;
+
+	node 		= dx_node(bh);
+	node->limit 	= cpu_to_le16((sb->s_blocksize - ((char *)node->entries - bh->b_data))
+				      / sizeof(struct testfs_dx_entry));
+	node->count 	= cpu_to_le16(count);
+	memcpy(node->entries, entries, count * sizeof(struct testfs_dx_entry));
+
+	return bh;
+}
+
+
+/*
+ * makes sure the node pointing to the leaf has room for one more entry,
+ * adding an index level or splitting the node
+ */
+static int dx_make_room(struct inode *dir, struct dx_frame *frames, int *levels)
+{
+	struct super_block *sb		= dir->i_sb;
+	struct dx_frame *frame		= &frames[*levels - 1];
+	struct testfs_dx_root *root	= NULL;
+	struct testfs_dx_node *node	= NULL;
+	struct buffer_head *bh		= NULL;
+	int half;
+	u32 lblk;
+
+	if (dx_count(frame->node) < le16_to_cpu(frame->node->limit))
+		return 0;
+
+	if (*levels == 1) {
+		/* the root is full, its entries move one level down */
+		bh = dx_new_node(dir, frame->node->entries, dx_count(frame->node), &lblk);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+
+		root 				= dx_root(frame->bh);
+		root->levels 			= 1;
+		root->node.count 		= cpu_to_le16(1);
+		root->node.entries[0].hash 	= 0;
+		root->node.entries[0].block 	= cpu_to_le32(lblk);
+		testfs_trans_dirty_bh(sb, frame->bh, TESTFS_TRANS_DIR);
+
+		frames[1].bh 	= bh;
+		frames[1].node 	= dx_node(bh);
+		frames[1].at 	= frames[0].at;
+		frames[0].at 	= 0;
+		*levels 	= 2;
+
+		return 0;
+	}
+
+	if (dx_count(frames[0].node) >= le16_to_cpu(frames[0].node->limit)) {
+		printk(KERN_WARNING "testfs: index of directory inode %lu is full\n", dir->i_ino);
+		return -ENOSPC;
+	}
+
+	/* split the node, the upper half moves to a new one */
+	half 	= dx_count(frame->node) / 2;
+	bh 	= dx_new_node(dir, &frame->node->entries[half], dx_count(frame->node) - half, &lblk);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	node 			= dx_node(bh);
+	frame->node->count 	= cpu_to_le16(half);
+	dx_insert(frames[0].node, frames[0].at, dx_get_hash(node, 0), lblk);
+
+	testfs_trans_dirty_bh(sb, frames[0].bh, TESTFS_TRANS_DIR);
+	testfs_trans_dirty_bh(sb, frame->bh, TESTFS_TRANS_DIR);
+
+	if (frame->at >= half) {
+		brelse(frame->bh);
+		frame->bh 	= bh;
+		frame->node 	= node;
+		frame->at 	-= half;
+		frames[0].at++;
+	}
+	else {
+		brelse(bh);
+	}
+
+	return 0;
+}
+
+
+static int dx_map_cmp(const void *a, const void *b)
+{
+	const struct dx_map *x = a, *y = b;
+
+	if (x->hash == y->hash)
+		return 0;
+	return x->hash < y->hash ? -1 : 1;
+}
+
+
+/*
+ * moves the upper half of the full leaf *bh, by hash, to a new block and
+ * points the index at it. The halves are about the same size in bytes;
+ * names sharing a hash stay together unless the whole leaf shares it. On
+ * return *bh is the leaf where hash belongs
+ */
+static int split_leaf(struct inode *dir, struct dx_frame *frame, struct buffer_head **bh, u32 hash)
+{
+	struct super_block *sb		= dir->i_sb;
+	struct testfs_dir_entry *de	= dir_entry(*bh, 0);
+	struct buffer_head *new_bh	= NULL;
+	struct dx_map *map		= NULL;
+	char *end			= (*bh)->b_data + sb->s_blocksize;
+	char *copy			= NULL;
+	unsigned size, half;
+	int i, count, split, err	= 0;
+	u32 split_hash, continued	= 0;
+	u32 lblk;
+
+	map 	= kmalloc(DIR_MAX_ENTRIES(sb) * sizeof(*map), GFP_NOFS);
+	copy 	= kmalloc(sb->s_blocksize, GFP_NOFS);
+	if (!map || !copy) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (count = 0, size = 0; (char *)de < end; de = testfs_dir_next(de)) {
+		if (testfs_dir_check_entry(dir, *bh, de)) {
+			err = -EIO;
+			goto out;
+		}
+		if (!de->inode_number)
+			continue;
+		map[count].hash 	= dx_hash(de->name, de->name_len);
+		map[count].offset 	= (char *)de - (*bh)->b_data;
+		size 			+= TESTFS_DIR_REC_LEN(de->name_len);
+		count++;
+	}
+
+	if (count < 2) {
+		err = -ENOSPC;
+		goto out;
+	}
+
+	sort(map, count, sizeof(*map), dx_map_cmp, NULL);
+
+	/* first entry of the upper half, by size */
+	for (i = 0, half = 0; i < count - 1 && half < size / 2; i++)
+		half += TESTFS_DIR_REC_LEN(dir_entry(*bh, map[i].offset)->name_len);
+	if (i == 0)
+		i = 1;
+
+	split = i;
+	while (split < count && map[split].hash == map[split - 1].hash)
+		split++;
+	if (split == count) {
+		split = i;
+		while (split > 0 && map[split].hash == map[split - 1].hash)
+			split--;
+	}
+	if (split == 0) {
+		split 		= i;
+		continued 	= 1;
+	}
+	split_hash = map[split].hash | continued;
+
+	new_bh = dir_append_block(dir, &lblk);
+	if (IS_ERR(new_bh)) {
+		err = PTR_ERR(new_bh);
+		goto out;
+	}
+
+	memcpy(copy, (*bh)->b_data, sb->s_blocksize);
+	pack_entries(sb, (*bh)->b_data, copy, map, split);
+	pack_entries(sb, new_bh->b_data, copy, map + split, count - split);
+
+	dx_insert(frame->node, frame->at, split_hash, lblk);
+
+	testfs_trans_dirty_bh(sb, frame->bh, TESTFS_TRANS_DIR);
+	testfs_trans_dirty_bh(sb, *bh, TESTFS_TRANS_DIR);
+	dir->i_version++;
+
+	if (hash >= split_hash) {
+		brelse(*bh);
+		*bh = new_bh;
+	}
+	else {
+		brelse(new_bh);
+	}
+
+out:
+	kfree(copy);
+	kfree(map);
+	return err;
+}
+
+
+static int dx_add_entry(struct inode *dir, const struct qstr *name, u32 ino, int type)
+{
+	struct buffer_head *bh		= NULL;
+	struct dx_frame frames[DX_MAX_LEVELS];
+	u32 hash			= dx_hash(name->name, name->len);
+	int levels, err			= 0;
+
+	levels = dx_probe(dir, hash, frames);
+	if (levels < 0)
+		return levels;
+
+	bh = testfs_dir_bread(dir, dx_get_block(frames[levels - 1].node, frames[levels - 1].at));
+	if (IS_ERR(bh)) {
+		err = PTR_ERR(bh);
+		bh  = NULL;
+		goto out;
+	}
+
+	err = add_to_block(dir, bh, name, ino, type);
+	if (err == -ENOSPC) {
+		/* room in the index first, so the split cannot fail half way */
+		err = dx_make_room(dir, frames, &levels);
+		if (err)
+			goto out;
+
+		err = split_leaf(dir, &frames[levels - 1], &bh, hash);
+		if (err)
+			goto out;
+
+		err = add_to_block(dir, bh, name, ino, type);
+	}
+
+out:
+	brelse(bh);
+	dx_release(frames, levels);
+	return err;
+}
+
+
+/*
+ * moves the entries of a full inline directory to a block of its own. They
+ * keep their offsets, which keeps readdir cursors valid, and the last one
+ * stretches to the end of the block
+ */
+static int inline_to_block(struct inode *dir, struct buffer_head *ibh)
+{
+	struct super_block *sb			= dir->i_sb;
+	struct testfs_inode_info *testfs_inode	= TESTFS_GET_INODE(dir);
+	struct buffer_head *bh			= NULL;
+	struct testfs_dir_entry *de		= NULL;
+	struct testfs_dir_entry *last		= NULL;
+	char *data				= testfs_dir_data(dir, ibh);
+	unsigned size				= testfs_dir_data_size(dir);
+	u32 lblk;
+
+	/* the new block becomes block 0 */
+	testfs_inode->i_flags &= ~TESTFS_INODE_INLINE;
+	i_size_write(dir, 0);
+
+	bh = dir_append_block(dir, &lblk);
+	if (IS_ERR(bh)) {
+		testfs_inode->i_flags |= TESTFS_INODE_INLINE;
+		i_size_write(dir, size);
+		return PTR_ERR(bh);
+	}
+
+	/* add_to_block() checked every entry on its way to -ENOSPC */
+	memcpy(bh->b_data, data, size);
+	for (de = dir_entry(bh, 0); (char *)de < bh->b_data + size; de = testfs_dir_next(de))
+		last = de;
+	last->rec_len = cpu_to_le16(bh->b_data + sb->s_blocksize - (char *)last);
+
+	lock_buffer(ibh);
+	memset(data, 0x00, size);
+	unlock_buffer(ibh);
+
+	testfs_trans_dirty_bh(sb, ibh, TESTFS_TRANS_INODE);
+	testfs_trans_dirty_bh(sb, bh, TESTFS_TRANS_DIR);
+	dir->i_version++;
+	brelse(bh);
+
+	return 0;
+}
+
+
+/*
+ * adds an entry called name pointing to inode ino
+ */
+int testfs_dir_add_entry(struct inode *dir, const struct qstr *name, u32 ino, int type)
+{
+	struct buffer_head *bh		= NULL;
+	int err;
+
+	if (name->len > TESTFS_NAME_LEN)
+		return -ENAMETOOLONG;
+
+	bh = testfs_dir_bread(dir, 0);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	if (!dir_indexed(dir, bh)) {
+		err = add_to_block(dir, bh, name, ino, type);
+		if (err != -ENOSPC) {
+			brelse(bh);
+			return err;
+		}
+
+		if (testfs_has_inline(dir)) {
+			err = inline_to_block(dir, bh);
+			brelse(bh);
+			if (err)
+				return err;
+
+			return testfs_dir_add_entry(dir, name, ino, type);
+		}
+
+		err = make_indexed(dir, bh);
+		if (err) {
+			brelse(bh);
+			return err;
+		}
+	}
+	brelse(bh);
+
+	return dx_add_entry(dir, name, ino, type);
+}
+
+
+/*
+ * removes the entry called name. Its space goes to the entry before it, or
+ * it is just marked unused if it is the first one of the block
+ */
+int testfs_dir_delete_entry(struct inode *dir, const struct qstr *name)
+{
+	struct buffer_head *bh		= NULL;
+	struct testfs_dir_entry *de	= NULL;
+	struct testfs_dir_entry *prev	= NULL;
+	struct testfs_dir_entry *cur	= NULL;
+
+	bh = testfs_dir_find_entry(dir, name, &de);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	if (!bh)
+		return -ENOENT;
+
+	/* the block was checked on the way to de */
+	for (cur = (struct testfs_dir_entry *)testfs_dir_data(dir, bh); cur != de; cur = testfs_dir_next(cur))
+		prev = cur;
+
+	if (prev)
+		prev->rec_len = cpu_to_le16(le16_to_cpu(prev->rec_len) + le16_to_cpu(de->rec_len));
+	else
+		de->inode_number = 0;
+
+	testfs_trans_dirty_bh(dir->i_sb, bh, TESTFS_TRANS_DIR);
+	dir->i_version++;
+	brelse(bh);
+
+	return 0;
+}
+
+
+/*
+ * returns 1 if dir holds nothing but . and ..
+ */
+int testfs_dir_is_empty(struct inode *dir)
+{
+	struct buffer_head *bh		= NULL;
+	struct testfs_dir_entry *de	= NULL;
+	u32 lblk, blocks		= testfs_dir_blocks(dir);
+	char *end;
+	int i;
+
+	for (lblk = 0; lblk < blocks; lblk++) {
+		bh = testfs_dir_bread(dir, lblk);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+
+		de 	= (struct testfs_dir_entry *)testfs_dir_data(dir, bh);
+		end 	= (char *)de + testfs_dir_data_size(dir);
+		for (i = 0; (char *)de < end; de = testfs_dir_next(de), i++) {
+			if (testfs_dir_check_entry(dir, bh, de)) {
+				brelse(bh);
+				return -EIO;
+			}
+			if (de->inode_number && (lblk || i >= 2)) {
+				brelse(bh);
+				return 0;
+			}
+		}
+
+		brelse(bh);
+	}
+
+	return 1;
+}
+
+
+/*
+ * writes the first block of a new directory, or its inline area: "." and
+ * "..", the latter taking the rest of it
+ */
+int testfs_dir_make_empty(struct inode *dir, u32 parent_ino)
+{
+	struct super_block *sb		= dir->i_sb;
+	struct buffer_head *bh		= NULL;
+	struct testfs_dir_entry *de	= NULL;
+	unsigned size			= testfs_dir_data_size(dir);
+
+	bh = testfs_dir_bread(dir, 0);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	de = (struct testfs_dir_entry *)testfs_dir_data(dir, bh);
+	memset(de, 0x00, size);
+
+	fill_entry(de, &dot, dir->i_ino, DT_DIR);
+	de->rec_len 	= cpu_to_le16(TESTFS_DIR_REC_LEN(1));
+	de 		= testfs_dir_next(de);
+	fill_entry(de, &dotdot, parent_ino, DT_DIR);
+	de->rec_len 	= cpu_to_le16(size - TESTFS_DIR_REC_LEN(1));
+
+	i_size_write(dir, size);
+	mark_inode_dirty(dir);
+	testfs_trans_dirty_bh(sb, bh, TESTFS_TRANS_DIR);
+	brelse(bh);
+
+	return 0;
+}
+
+
+/*
+ * starts reading the inode table blocks of the entries in the directory
+ * block bh, so the inodes are in the buffer cache by the time a listing
+ * or a lookup gets to them
+ */
+void testfs_dir_readahead_inodes(struct inode *dir, struct buffer_head *bh)
+{
+	struct super_block *sb		= dir->i_sb;
+	struct testfs_dir_entry *de	= (struct testfs_dir_entry *)testfs_dir_data(dir, bh);
+	char *end			= (char *)de + testfs_dir_data_size(dir);
+	sector_t block, last		= 0;
+
+	/* a bad entry ends the walk, whoever uses the block reports it */
+	for ( ; (char *)de < end; de = testfs_dir_next(de)) {
+		if (testfs_dir_check_entry(dir, bh, de))
+			return;
+
+		block = inode_table_block(sb, le32_to_cpu(de->inode_number));
+		if (block && block != last) {
+			sb_breadahead(sb, block);
+			last = block;
+		}
+	}
+}
+
+
+/*
+ * lists an indexed directory in hash order. A leaf split moves entries
+ * within and across blocks, a hash never changes: an open listing neither
+ * misses them nor shows them twice. f_pos is the position of the next name
+ * to list; names sharing a hash show again if a listing stops among them
+ */
+int testfs_dx_readdir(struct file *fp, void *dirent, filldir_t filldir)
+{
+	struct inode *dir		= fp->f_dentry->d_inode;
+	struct super_block *sb		= dir->i_sb;
+	struct buffer_head *bh		= NULL;
+	struct testfs_dir_entry *de	= NULL;
+	struct dx_frame frames[DX_MAX_LEVELS];
+	struct dx_map *map		= NULL;
+	char *end			= NULL;
+	unsigned offset;
+	u32 hash;
+	int i, count, levels, ret, err	= 0;
+
+	if (fp->f_pos >= DX_POS_EOF)
+		return 0;
+
+	/*
+	 * a position past ".." but short of the hash positions comes from a
+	 * listing of the directory before it got indexed. Its names are spread
+	 * over the leaves now and there is no telling which were listed, so
+	 * the cursor fails until the caller seeks back to the start
+	 */
+	if (fp->f_pos > DX_MARKER_OFFSET && fp->f_pos < DX_POS_BASE)
+		return -ESTALE;
+
+	map = kmalloc(DIR_MAX_ENTRIES(sb) * sizeof(*map), GFP_NOFS);
+	if (!map)
+		return -ENOMEM;
+
+	hash 	= fp->f_pos < DX_POS_BASE ? 0 : (u32)(fp->f_pos - DX_POS_BASE) << 1;
+	levels 	= dx_probe(dir, hash, frames);
+	if (levels < 0) {
+		kfree(map);
+		return levels;
+	}
+
+	for (offset = 0; offset < DX_MARKER_OFFSET; offset += le16_to_cpu(de->rec_len)) {
+		de = dir_entry(frames[0].bh, offset);
+		if (offset < fp->f_pos)
+			continue;
+
+		if (filldir(dirent, de->name, de->name_len, offset, le32_to_cpu(de->inode_number), de->type))
+			goto out;
+
+		fp->f_pos = offset + le16_to_cpu(de->rec_len);
+	}
+
+	if (fp->f_pos < DX_POS_BASE)
+		fp->f_pos = DX_POS_BASE;
+
+	while (1) {
+		bh = testfs_dir_bread(dir, dx_get_block(frames[levels - 1].node, frames[levels - 1].at));
+		if (IS_ERR(bh)) {
+			err = PTR_ERR(bh);
+			goto out;
+		}
+
+		/* ls -l and find stat every entry listed, get their inodes coming */
+		testfs_dir_readahead_inodes(dir, bh);
+
+		end = bh->b_data + sb->s_blocksize;
+		for (count = 0, de = dir_entry(bh, 0); (char *)de < end; de = testfs_dir_next(de)) {
+			if (testfs_dir_check_entry(dir, bh, de)) {
+				brelse(bh);
+				err = -EIO;
+				goto out;
+			}
+			if (!de->inode_number)
+				continue;
+			map[count].hash 	= dx_hash(de->name, de->name_len);
+			map[count].offset 	= (char *)de - bh->b_data;
+			if (map[count].hash >= hash)
+				count++;
+		}
+
+		sort(map, count, sizeof(*map), dx_map_cmp, NULL);
+
+		for (i = 0; i < count; i++) {
+			de = dir_entry(bh, map[i].offset);
+			if (filldir(dirent, de->name, de->name_len, DX_POS(map[i].hash),
+				    le32_to_cpu(de->inode_number), de->type)) {
+				fp->f_pos = DX_POS(map[i].hash);
+				brelse(bh);
+				goto out;
+			}
+			fp->f_pos = DX_POS(map[i].hash) + 1;
+		}
+
+		brelse(bh);
+
+		ret = dx_next_block(dir, frames, levels);
+		if (ret <= 0) {
+			err = ret;
+			break;
+		}
+	}
+
+	if (!err)
+		fp->f_pos = DX_POS_EOF;
+
+out:
+	dx_release(frames, levels);
+	kfree(map);
+	return err;
+}
+
+
+/*
+ * returns 1 if dir has a hash index, 0 if it is a plain list of entries
+ */
+int testfs_dir_is_indexed(struct inode *dir)
+{
+	struct buffer_head *bh = testfs_dir_bread(dir, 0);
+	int indexed;
+
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	indexed = dir_indexed(dir, bh);
+	brelse(bh);
+
+	return indexed;
+}
@@ -0,0 +1,77 @@
+#ifndef HTREE_H
+#define HTREE_H
+
+#include <linux/fs.h>
+
+#include "dir.h"
+#include "inline.h"
+
+/*
+ * Type of the empty entry hiding index data in a directory block. In block
+ * 0 it follows "." and "..", and the index root follows it; an index node
+ * is a block starting with it. Either way it stretches to the block end.
+ */
+#define TESTFS_DX_MARKER	0xff
+
+/* Maps the names hashing to hash and above to a directory block */
+struct testfs_dx_entry {
+	__le32 hash;		/* Lowest hash of the block, bit 0 set if it continues the previous one */
+	__le32 block;		/* Logical block of the directory */
+};
+
+struct testfs_dx_node {
+	__le16 limit;		/* Entries that fit */
+	__le16 count;		/* Entries in use */
+	struct testfs_dx_entry entries[0];
+};
+
+/* Index root, in block 0 right after the marker entry */
+struct testfs_dx_root {
+	__u8 levels;		/* Levels of index nodes below the root, 0 or 1 */
+	__u8 reserved[3];
+	struct testfs_dx_node node;
+};
+
+static inline int testfs_dir_is_marker(struct testfs_dir_entry *de)
+{
+	return !de->inode_number && de->type == TESTFS_DX_MARKER;
+}
+
+static inline struct testfs_dir_entry *testfs_dir_next(struct testfs_dir_entry *de)
+{
+	return (struct testfs_dir_entry *)((char *)de + le16_to_cpu(de->rec_len));
+}
+
+/*
+ * start of the entries in bh, as returned by testfs_dir_bread(). An inline
+ * directory keeps them in its inode (see inline.c), as if it were block 0
+ */
+static inline char *testfs_dir_data(struct inode *dir, struct buffer_head *bh)
+{
+	return testfs_has_inline(dir) ? testfs_inline_data(dir, bh) : bh->b_data;
+}
+
+/* Bytes the entries of a block span */
+static inline unsigned testfs_dir_data_size(struct inode *dir)
+{
+	return testfs_has_inline(dir) ? TESTFS_INLINE_SIZE(dir->i_sb) : dir->i_sb->s_blocksize;
+}
+
+static inline u32 testfs_dir_blocks(struct inode *dir)
+{
+	return DIV_ROUND_UP(i_size_read(dir), dir->i_sb->s_blocksize);
+}
+
+struct buffer_head *testfs_dir_bread(struct inode *dir, u32 lblk);
+int testfs_dir_check_entry(struct inode *dir, struct buffer_head *bh, struct testfs_dir_entry *de);
+struct buffer_head *testfs_dir_find_entry(struct inode *dir, const struct qstr *name,
+	struct testfs_dir_entry **res);
+int testfs_dir_add_entry(struct inode *dir, const struct qstr *name, u32 ino, int type);
+int testfs_dir_delete_entry(struct inode *dir, const struct qstr *name);
+int testfs_dir_is_empty(struct inode *dir);
+int testfs_dir_make_empty(struct inode *dir, u32 parent_ino);
+void testfs_dir_readahead_inodes(struct inode *dir, struct buffer_head *bh);
+int testfs_dir_is_indexed(struct inode *dir);
+int testfs_dx_readdir(struct file *fp, void *dirent, filldir_t filldir);
+
+#endif /* HTREE_H */
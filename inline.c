@@ -0,0 +1,163 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+
+#include "testfs.h"
+#include "inode.h"
+#include "commit.h"
+#include "inline.h"
+
+/*
+ * With TESTFS_FEATURE_INCOMPAT_INLINE_DATA, the inode table slots are
+ * larger than struct testfs_inode, and the rest of the slot holds the data
+ * of a file or directory as long as it fits, flagged TESTFS_INODE_INLINE.
+ * Reading the inode brings the data in with it, and such a file takes no
+ * block at all. Past its size the inline area is all zeros.
+ *
+ * Regular files go through the page cache like any other, but page 0 is
+ * filled from the inode and written straight back to it by write_end; the
+ * page is never dirty, except through mmap. A write past the inline area
+ * moves the data to page 0 as delayed data and clears the flag, from then
+ * on the file has blocks (see testfs_inline_convert()). Directories keep
+ * their entries in the inline area as if it were block 0 (see htree.c).
+ */
+
+
+/*
+ * reads the inode table block holding the inline data of inode
+ */
+struct buffer_head *testfs_inline_bread(struct inode *inode)
+{
+	struct buffer_head *bh = NULL;
+
+	if (!(bh = sb_bread(inode->i_sb, inode_table_block(inode->i_sb, inode->i_ino)))) {
+		printk(KERN_INFO "testfs: error reading the inline data of inode %lu\n", inode->i_ino);
+		return ERR_PTR(-EIO);
+	}
+
+	return bh;
+}
+
+
+/*
+ * fills page, locked, with the inline data. Every page past the first one
+ * is past the end of the file
+ */
+int testfs_inline_readpage(struct inode *inode, struct page *page)
+{
+	struct buffer_head *bh	= NULL;
+	unsigned size		= min_t(loff_t, i_size_read(inode), TESTFS_INLINE_SIZE(inode->i_sb));
+	char *kaddr;
+
+	if (page->index) {
+		zero_user(page, 0, PAGE_CACHE_SIZE);
+		SetPageUptodate(page);
+		return 0;
+	}
+
+	bh = testfs_inline_bread(inode);
+	if (IS_ERR(bh)) {
+		SetPageError(page);
+		return PTR_ERR(bh);
+	}
+
+	kaddr = kmap_atomic(page);
+	memcpy(kaddr, testfs_inline_data(inode, bh), size);
+	memset(kaddr + size, 0x00, PAGE_CACHE_SIZE - size);
+	flush_dcache_page(page);
+	kunmap_atomic(kaddr);
+
+	SetPageUptodate(page);
+	brelse(bh);
+
+	return 0;
+}
+
+
+/*
+ * copies the first size bytes of page 0 to the inline area and zeroes the
+ * rest of it. The inode table block joins the running transaction, which
+ * the caller has to be in
+ */
+int testfs_inline_write(struct inode *inode, struct page *page, loff_t size)
+{
+	struct super_block *sb	= inode->i_sb;
+	struct buffer_head *bh	= NULL;
+	char *data, *kaddr;
+
+	size = min_t(loff_t, size, TESTFS_INLINE_SIZE(sb));
+
+	bh = testfs_inline_bread(inode);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	data = testfs_inline_data(inode, bh);
+
+	lock_buffer(bh);
+	kaddr = kmap_atomic(page);
+	memcpy(data, kaddr, size);
+	kunmap_atomic(kaddr);
+	memset(data + size, 0x00, TESTFS_INLINE_SIZE(sb) - size);
+	unlock_buffer(bh);
+
+	testfs_trans_dirty_bh(sb, bh, TESTFS_TRANS_INODE);
+	brelse(bh);
+
+	return 0;
+}
+
+
+/*
+ * zeroes the inline data from size on, so it reads as zeros once the file
+ * grows again
+ */
+int testfs_inline_truncate(struct inode *inode, loff_t size)
+{
+	struct super_block *sb	= inode->i_sb;
+	struct buffer_head *bh	= NULL;
+	struct testfs_handle handle;
+
+	if (size >= TESTFS_INLINE_SIZE(sb))
+		return 0;
+
+	bh = testfs_inline_bread(inode);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	testfs_trans_start(sb, &handle);
+
+	lock_buffer(bh);
+	memset(testfs_inline_data(inode, bh) + size, 0x00, TESTFS_INLINE_SIZE(sb) - size);
+	unlock_buffer(bh);
+
+	testfs_trans_dirty_bh(sb, bh, TESTFS_TRANS_INODE);
+	testfs_trans_stop(&handle);
+	brelse(bh);
+
+	return 0;
+}
+
+
+/*
+ * the data of an inline file is a single extent, at the byte of the inode
+ * table it starts at
+ */
+int testfs_inline_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo)
+{
+	struct super_block *sb	= inode->i_sb;
+	loff_t size		= i_size_read(inode);
+	u64 physical;
+	int err;
+
+	if (!size)
+		return 0;
+
+	physical = ((u64)inode_table_block(sb, inode->i_ino) << sb->s_blocksize_bits) +
+		   inode_table_offset(sb, inode->i_ino) + sizeof(struct testfs_inode);
+
+	err = fiemap_fill_next_extent(fieinfo, 0, physical, size,
+		FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_LAST);
+
+	return err < 0 ? err : 0;
+}
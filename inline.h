@@ -0,0 +1,31 @@
+#ifndef INLINE_H
+#define INLINE_H
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+
+#include "testfs.h"
+#include "super.h"
+#include "inode.h"
+
+/* Bytes of data an inode has room for, 0 without TESTFS_FEATURE_INCOMPAT_INLINE_DATA */
+#define TESTFS_INLINE_SIZE(sb)	(TESTFS_INODE_SIZE(sb) - sizeof(struct testfs_inode))
+
+static inline int testfs_has_inline(struct inode *inode)
+{
+	return TESTFS_GET_INODE(inode)->i_flags & TESTFS_INODE_INLINE;
+}
+
+/* Inline data of inode, in the inode table block bh */
+static inline char *testfs_inline_data(struct inode *inode, struct buffer_head *bh)
+{
+	return bh->b_data + inode_table_offset(inode->i_sb, inode->i_ino) + sizeof(struct testfs_inode);
+}
+
+struct buffer_head *testfs_inline_bread(struct inode *inode);
+int testfs_inline_readpage(struct inode *inode, struct page *page);
+int testfs_inline_write(struct inode *inode, struct page *page, loff_t size);
+int testfs_inline_truncate(struct inode *inode, loff_t size);
+int testfs_inline_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo);
+
+#endif /* INLINE_H */
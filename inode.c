@@ -1,4 +1,5 @@
 #include <linux/buffer_head.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
 #include <linux/quotaops.h>
 #include <linux/security.h>
@@ -9,8 +10,17 @@
 #include "file.h"
 #include "super.h"
 #include "aops.h"
+#include "commit.h"
+#include "balloc.h"
+#include "itable.h"
+#include "inline.h"
 
 
+/* Inode table blocks read ahead after a miss */
+#define ITABLE_READAHEAD	8
+
+static struct kmem_cache *testfs_inode_cachep;
+
 /*
  * reads the inode from the disk by inode number
  */
@@ -23,6 +33,70 @@ static int fill_inode(struct super_block *sb, struct inode *inode, struct testfs
 static int fill_iloc_by_inode_num(struct super_block *sb, u32 ino, struct testfs_iloc *iloc);
 
 
+static void init_once(void *foo)
+{
+	struct testfs_inode_info *testfs_inode = foo;
+
+	mutex_init(&testfs_inode->i_alloc_mutex);
+	init_rwsem(&testfs_inode->i_extent_sem);
+	mutex_init(&testfs_inode->i_convert_mutex);
+	inode_init_once(&testfs_inode->vfs_inode);
+}
+
+
+int inode_cache_init(void)
+{
+	testfs_inode_cachep = kmem_cache_create("testfs_inode_cache", sizeof(struct testfs_inode_info), 0,
+						SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD, init_once);
+	if (!testfs_inode_cachep)
+		return -ENOMEM;
+
+	return 0;
+}
+
+
+void inode_cache_destroy(void)
+{
+	/* inodes are freed after an RCU grace period, wait for the last ones */
+	rcu_barrier();
+	kmem_cache_destroy(testfs_inode_cachep);
+}
+
+
+struct inode *inode_alloc_inode(struct super_block *sb)
+{
+	struct testfs_inode_info *testfs_inode = NULL;
+
+	testfs_inode = kmem_cache_alloc(testfs_inode_cachep, GFP_NOFS);
+	if (!testfs_inode)
+		return NULL;
+
+	testfs_inode->i_window.len 	= 0;
+	testfs_inode->i_window_lblk 	= 0;
+	testfs_inode->i_window_size 	= 0;
+	INIT_LIST_HEAD(&testfs_inode->i_unwritten);
+
+	return &testfs_inode->vfs_inode;
+}
+
+
+static void free_inode_rcu(struct rcu_head *head)
+{
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+
+	kmem_cache_free(testfs_inode_cachep, TESTFS_GET_INODE(inode));
+}
+
+
+void inode_destroy_inode(struct inode *inode)
+{
+	call_rcu(&inode->i_rcu, free_inode_rcu);
+}
+
+
+/*
+ * the raw inode is copied out, its inode table block is not kept around
+ */
 struct inode *inode_iget(struct super_block *sb, u32 ino)
 {
 	struct inode *inode;
@@ -42,87 +116,243 @@ struct inode *inode_iget(struct super_block *sb, u32 ino)
 
 	/* Read raw inode block from disk */
 	raw_inode = read_inode(sb, &iloc);
-	if (!raw_inode) {
+	if (IS_ERR(raw_inode)) {
 		printk(KERN_INFO "testfs: error reading inode number: %d\n", ino);
-		goto err_read_inode;
+		iget_failed(inode);
+		return ERR_CAST(raw_inode);
 	}
 	inode->i_ino = ino;
 	fill_inode(sb, inode, raw_inode);
+	brelse(iloc.bh);
+	/* 0 is what a seek leaves in f_version, see testfs_readdir() */
+	inode->i_version = 1;
 
 	unlock_new_inode(inode);
 
 	return inode;
-
-err_read_inode:
-	brelse(iloc.bh);
-	return NULL;
 }
 
 
 static int get_inode_group(struct super_block *sb, struct inode *inode)
 {
-	struct testfs_inode *testfs_inode = TESTFS_GET_INODE(inode);
-	return testfs_inode->group;
+	return TESTFS_GET_INODE(inode)->i_group;
 }
 
 
-struct inode *inode_get_new_inode(struct inode *dir, umode_t mode, int alloc_data_block)
+/*
+ * returns the inode bitmap of a group. A bitmap that was never written is
+ * not read, see init_inode_bitmap()
+ */
+static struct buffer_head *get_inode_bitmap(struct super_block *sb, struct testfs_group_desc *desc)
+{
+	struct buffer_head *bitmap_bh = NULL;
+
+	if (le16_to_cpu(desc->flags) & TESTFS_BG_INODE_UNINIT)
+		return sb_getblk(sb, le32_to_cpu(desc->inode_bitmap));
+
+	if (!(bitmap_bh = sb_bread(sb, le32_to_cpu(desc->inode_bitmap))))
+		printk(KERN_INFO "testfs: error reading inode bitmap at block: %d\n", le32_to_cpu(desc->inode_bitmap));
+
+	return bitmap_bh;
+}
+
+
+/*
+ * only the reserved inode 0 of a group whose bitmap was never written is in
+ * use. Called with the group lock held, which keeps the flag stable
+ */
+static void init_inode_bitmap(struct super_block *sb, struct testfs_group_desc *desc,
+	struct buffer_head *bitmap_bh)
+{
+	if (!(le16_to_cpu(desc->flags) & TESTFS_BG_INODE_UNINIT))
+		return;
+
+	memset(bitmap_bh->b_data, 0x00, sb->s_blocksize);
+	__set_bit_le(0, bitmap_bh->b_data);
+	set_buffer_uptodate(bitmap_bh);
+}
+
+
+/*
+ * takes a free inode number, starting the search in group. Groups without
+ * free inodes are skipped by their descriptor count alone, and the inode
+ * table of a group is zeroed before its first inode is taken. dir is 1 if
+ * the inode is for a directory
+ */
+static int alloc_inode_num(struct super_block *sb, int group, unsigned long *ino, int dir)
 {
-	int err					= 0;
-	struct inode *new_ino	 		= NULL;
-	int new_inode_num 			= 0;
-	int i, group				= 0;
-	struct buffer_head *bitmap_bh		= NULL;
-	struct testfs_inode *testfs_inode	= NULL;
-	struct testfs_group_desc *desc          = NULL;
-	struct testfs_superblock *testfs_sb     = NULL;
-	struct super_block *sb			= dir->i_sb;
 	struct testfs_info *testfs_i		= TESTFS_GET_SB_INFO(sb);
+	struct testfs_group_info *gi		= NULL;
+	struct testfs_group_desc *desc		= NULL;
+	struct buffer_head *bitmap_bh		= NULL;
+	unsigned long bit;
+	int i;
+
+	for (i = 0; i < testfs_i->sb->group_count; i++, group = (group + 1) % testfs_i->sb->group_count) {
+		desc 	= TESTFS_GROUP_DESC(sb, group);
+		gi 	= &testfs_i->group_info[group];
+
+		if (!le32_to_cpu(desc->free_inodes_count))
+			continue;
+
+		if (testfs_itable_init(sb, group))
+			return -EIO;
+
+		if (!(bitmap_bh = get_inode_bitmap(sb, desc)))
+			return -EIO;
 
+		spin_lock(&gi->lock);
+		init_inode_bitmap(sb, desc, bitmap_bh);
 
-	testfs_sb = testfs_i->sb;
+		bit = find_next_zero_bit_le(bitmap_bh->b_data, TESTFS_INODES_PER_GROUP(sb), 0);
+		if (bit < TESTFS_INODES_PER_GROUP(sb)) {
+			__set_bit_le(bit, bitmap_bh->b_data);
+			testfs_group_update(sb, group, 0, -1, dir);
+			spin_unlock(&gi->lock);
 
-	group = get_inode_group(sb, dir);
+			testfs_trans_dirty_bh(sb, bitmap_bh, TESTFS_TRANS_BITMAP);
+			testfs_trans_dirty_bh(sb, TESTFS_GROUP_DESC_BH(sb, group), TESTFS_TRANS_BITMAP);
+			brelse(bitmap_bh);
 
-	if (group < 0) {
-		printk(KERN_INFO "testfs: invalid group for inode number: %lu\n", dir->i_ino);
-		return ERR_PTR(-ENOSPC);
+			*ino = bit + group * TESTFS_INODES_PER_GROUP(sb);
+			return group;
+		}
+
+		spin_unlock(&gi->lock);
+		brelse(bitmap_bh);
 	}
 
-	for (i=0;i<testfs_sb->group_count;i++)
-	{
-		desc = (struct testfs_group_desc *)testfs_i->group_desc_bh[group]->b_data;
+	return -ENOSPC;
+}
 
-		brelse(bitmap_bh);	
 
-		if (!(bitmap_bh = sb_bread(sb, desc->inode_bitmap))) {
-                	printk(KERN_INFO "testfs: error reading inode bitmap at block: %d\n", desc->inode_bitmap);
-                	return ERR_PTR(-EIO);
-        	}
+static void update_dirs(struct super_block *sb, int group, int dirs)
+{
+	struct testfs_info *testfs_i		= TESTFS_GET_SB_INFO(sb);
+	struct testfs_group_info *gi		= &testfs_i->group_info[group];
 
-		new_inode_num = find_next_zero_bit((unsigned long *)bitmap_bh->b_data,
-					      TESTFS_INODES_PER_GROUP(sb), new_inode_num);		
+	spin_lock(&gi->lock);
+	testfs_group_update(sb, group, 0, 0, dirs);
+	spin_unlock(&gi->lock);
 
-		if (new_inode_num == TESTFS_INODES_PER_GROUP(sb)) {
-			if (group == (testfs_sb->group_count - 1)) {
-				group = 0;
+	testfs_trans_dirty_bh(sb, TESTFS_GROUP_DESC_BH(sb, group), TESTFS_TRANS_BITMAP);
+}
+
+
+/*
+ * Orlov allocator for directories. The ones right below the root are
+ * independent trees: they are spread over the groups with at least the
+ * average of free inodes and blocks, taking the one with the fewest
+ * directories. Deeper ones stay in the group of their parent unless it is
+ * crowded with directories or short on space, so a tree stays together.
+ * Returns the group to start the inode search in
+ */
+static int find_group_dir(struct super_block *sb, struct inode *parent)
+{
+	struct testfs_info *testfs_i		= TESTFS_GET_SB_INFO(sb);
+	struct testfs_group_desc *desc		= NULL;
+	int groups				= testfs_i->sb->group_count;
+	int parent_group			= get_inode_group(sb, parent);
+	u32 avefreei				= percpu_counter_read_positive(&testfs_i->free_inodes) / groups;
+	u32 avefreeb				= percpu_counter_read_positive(&testfs_i->free_blocks) / groups;
+	u32 dirs				= percpu_counter_read_positive(&testfs_i->dirs);
+	u32 max_dirs, min_inodes, min_blocks;
+	u32 best_dirs				= UINT_MAX;
+	int i, group, start, best		= -1;
+
+	if (parent->i_ino == TESTFS_ROOT_INODE_NUM) {
+		/* CPUs start at different groups, so ties do not all go to one */
+		start = this_cpu_read(*testfs_i->alloc_group);
+
+		for (i = 0; i < groups; i++) {
+			group 	= (start + i) % groups;
+			desc 	= TESTFS_GROUP_DESC(sb, group);
+
+			if (le32_to_cpu(desc->free_inodes_count) < avefreei ||
+			    le32_to_cpu(desc->free_blocks_count) < avefreeb)
 				continue;
+
+			if (le16_to_cpu(desc->used_dirs_count) < best_dirs) {
+				best 		= group;
+				best_dirs 	= le16_to_cpu(desc->used_dirs_count);
 			}
-			group++;
 		}
-		else {
-			goto inode_num_found;
+
+		if (best >= 0) {
+			this_cpu_write(*testfs_i->alloc_group, (best + 1) % groups);
+			return best;
 		}
+
+		return parent_group;
 	}
 
-	err = -ENOSPC;
-	goto fail;
+	max_dirs 	= dirs / groups + TESTFS_INODES_PER_GROUP(sb) / 16;
+	min_inodes 	= avefreei - avefreei / 4;
+	min_blocks 	= avefreeb - avefreeb / 4;
 
-inode_num_found:
-	
-	printk(KERN_INFO "testfs: found new inode at pos: %d\n", new_inode_num);
+	for (i = 0; i < groups; i++) {
+		group 	= (parent_group + i) % groups;
+		desc 	= TESTFS_GROUP_DESC(sb, group);
 
-	__test_and_set_bit_le(new_inode_num, bitmap_bh->b_data);
+		if (le16_to_cpu(desc->used_dirs_count) < max_dirs &&
+		    le32_to_cpu(desc->free_inodes_count) >= min_inodes &&
+		    le32_to_cpu(desc->free_blocks_count) >= min_blocks)
+			return group;
+	}
+
+	/* every group is crowded, any free inode will do */
+	return parent_group;
+}
+
+
+/*
+ * files go to the group of their directory. If that one is out of inodes
+ * or blocks, the groups are probed quadratically from there, which sends
+ * the overflow of different directories to different groups
+ */
+static int find_group_other(struct super_block *sb, struct inode *parent)
+{
+	struct testfs_info *testfs_i		= TESTFS_GET_SB_INFO(sb);
+	struct testfs_group_desc *desc		= NULL;
+	int groups				= testfs_i->sb->group_count;
+	int parent_group			= get_inode_group(sb, parent);
+	int i, group				= parent_group;
+
+	for (i = 1; ; i <<= 1) {
+		desc = TESTFS_GROUP_DESC(sb, group);
+
+		if (le32_to_cpu(desc->free_inodes_count) && le32_to_cpu(desc->free_blocks_count))
+			return group;
+
+		if (i >= groups)
+			break;
+		group = (group + i) % groups;
+	}
+
+	return parent_group;
+}
+
+
+struct inode *inode_get_new_inode(struct inode *dir, umode_t mode, int alloc_data_block)
+{
+	int err					= 0;
+	struct inode *new_ino	 		= NULL;
+	unsigned long new_inode_num 		= 0;
+	int group				= 0;
+	struct testfs_inode raw_inode;
+	struct super_block *sb			= dir->i_sb;
+	unsigned long block			= 0;
+	unsigned long count			= 1;
+
+
+	if (S_ISDIR(mode))
+		group = find_group_dir(sb, dir);
+	else
+		group = find_group_other(sb, dir);
+
+	group = alloc_inode_num(sb, group, &new_inode_num, S_ISDIR(mode));
+	if (group < 0)
+		return ERR_PTR(group);
 
 	new_ino = new_inode(sb);
         if (!new_ino) {
@@ -131,7 +361,8 @@ inode_num_found:
 		
 		goto fail_free;
         }
-
+	new_ino->i_ino 		= new_inode_num;
+	new_ino->i_version	= 1;
 
 	if (insert_inode_locked(new_ino) < 0) {
 		printk(KERN_INFO "testfs: inode allocated twice!\n");
@@ -145,40 +376,44 @@ inode_num_found:
 	if (err)
 		goto fail_free_drop;
 
-	testfs_inode = kmalloc(sizeof(*testfs_inode), GFP_KERNEL);
-        if (!testfs_inode) {
-                printk(KERN_INFO "testfs: Error allocating memory testfs_inode object!\n");
-		err = -ENOMEM;		
+	memset(&raw_inode, 0x00, sizeof(raw_inode));
+	raw_inode.i_mode 	= cpu_to_le16(mode);
+	raw_inode.group		= cpu_to_le32(group);
 
-                goto fail_free_drop;
-        }
-
-	testfs_inode->block_ptr = 0;
-	testfs_inode->i_mode 	= mode;	
-	testfs_inode->group	= group;
-	new_ino->i_ino 		= new_inode_num + (group * TESTFS_INODES_PER_GROUP(sb)); 
-
-	fill_inode(sb, new_ino, testfs_inode);
+	fill_inode(sb, new_ino, &raw_inode);
 
 	new_ino->i_atime 	= new_ino->i_ctime = new_ino->i_mtime = CURRENT_TIME_SEC;
-	new_ino->i_size		= 234;
-        new_ino->i_blkbits     	= 12; // hardcode... block size = 1 << blkbits, 4096 = 1 << blkbits, 4096 = 1 << 12
+	new_ino->i_size		= 0;
 	new_ino->i_blocks	= 0;
-	
-		
+
+	/* small files and directories start out in the inode, see inline.c */
+	if (TESTFS_INLINE_SIZE(sb) && (S_ISDIR(mode) || S_ISREG(mode))) {
+		err = testfs_inline_truncate(new_ino, 0);
+		if (err)
+			goto fail_free_drop;
+
+		TESTFS_GET_INODE(new_ino)->i_flags |= TESTFS_INODE_INLINE;
+		alloc_data_block = 0;
+	}
+
         if (alloc_data_block) {
-                err = inode_alloc_data_block(sb, new_ino);
+                err = inode_alloc_data_blocks(sb, new_ino, 0, &count, &block, 0);
                 if (err) 
 			goto fail_free_drop;
+
+		new_ino->i_blocks = count << (new_ino->i_blkbits - 9);
+
+		err = testfs_extent_insert(new_ino, 0, block, count, 0);
+		if (err) {
+			inode_delete_data_blocks(sb, block, count);
+			goto fail_free_drop;
+		}
         }
 
         security_inode_init_security(new_ino, dir, NULL, NULL, NULL);
         inode_init_owner(new_ino, dir, mode);
 
 
-	mark_buffer_dirty(bitmap_bh);
-        brelse(bitmap_bh);
-
         insert_inode_hash(new_ino);
         mark_inode_dirty(new_ino);
 
@@ -191,18 +426,14 @@ fail_free_drop:
         unlock_new_inode(new_ino);
 
 fail_free:
-	__test_and_clear_bit_le(new_inode_num, bitmap_bh);
+	/* nothing refers to the inode yet, it can go back right away */
+	inode_release_inode(sb, new_inode_num);
+	if (S_ISDIR(mode))
+		update_dirs(sb, group, -1);
 
-fail:
 	if (new_ino)
 		iput(new_ino);	
 
-	if (testfs_inode)
-		kfree(testfs_inode);		
-
-	if (bitmap_bh)
-		brelse(bitmap_bh);
-
 	return ERR_PTR(err);
 
 }
@@ -211,10 +442,18 @@ fail:
 
 static int fill_inode(struct super_block *sb, struct inode *inode, struct testfs_inode *raw_inode)
 {
+	struct testfs_inode_info *testfs_inode = TESTFS_GET_INODE(inode);
+
         /* Initialize inode */
         inode->i_mode = le16_to_cpu(raw_inode->i_mode);
-        inode->i_size = le16_to_cpu(raw_inode->i_size);
-        inode->i_private = raw_inode;
+        inode->i_size = le64_to_cpu(raw_inode->i_size);
+        inode->i_blocks = le32_to_cpu(raw_inode->i_blocks) << (sb->s_blocksize_bits - 9);
+
+	testfs_inode->i_group 		= le32_to_cpu(raw_inode->group);
+	testfs_inode->i_flags 		= le32_to_cpu(raw_inode->i_flags);
+	testfs_inode->i_extent_count 	= raw_inode->i_extent_count;
+	testfs_inode->i_extent_block 	= raw_inode->i_extent_block;
+	memcpy(testfs_inode->i_extents, raw_inode->i_extents, sizeof(testfs_inode->i_extents));
 
         i_uid_write(inode, 0);
         i_gid_write(inode, 0);
@@ -243,31 +482,84 @@ static int fill_iloc_by_inode_num(struct super_block *sb, u32 ino, struct testfs
 {
 	unsigned long block_group 	= 0;
 	struct testfs_group_desc *desc	= NULL;  
-	struct testfs_info *testfs_i	= TESTFS_GET_SB_INFO(sb);
 	int local_ino			= 0;
 
 	block_group 	= ino / TESTFS_INODES_PER_GROUP(sb);        
 	local_ino	= ino - (block_group * TESTFS_INODES_PER_GROUP(sb)); 
 
-	desc = (struct testfs_group_desc *)testfs_i->group_desc_bh[block_group]->b_data;
-
-	printk(KERN_INFO "testfs: inodes per group: %d\n", TESTFS_INODES_PER_GROUP(sb));
+	desc = TESTFS_GROUP_DESC(sb, block_group);
 
         iloc->block_num = le32_to_cpu(desc->inode_table) +
-                ((local_ino * sizeof(struct testfs_inode)) / sb->s_blocksize);
-        iloc->offset = (local_ino * sizeof(struct testfs_inode)) % sb->s_blocksize;
+                ((local_ino * TESTFS_INODE_SIZE(sb)) / sb->s_blocksize);
+        iloc->offset = (local_ino * TESTFS_INODE_SIZE(sb)) % sb->s_blocksize;
         iloc->ino = ino;
 
 	return 0;
 }
 
 
+/*
+ * inode table block holding inode ino, 0 if there is no such inode
+ */
+sector_t inode_table_block(struct super_block *sb, u32 ino)
+{
+	struct testfs_iloc iloc;
+
+	if (!ino || ino >= TESTFS_GET_SB(sb)->group_count * TESTFS_INODES_PER_GROUP(sb))
+		return 0;
+
+	fill_iloc_by_inode_num(sb, ino, &iloc);
+	return iloc.block_num;
+}
+
+
+/*
+ * byte offset of inode ino in its inode table block
+ */
+u32 inode_table_offset(struct super_block *sb, u32 ino)
+{
+	struct testfs_iloc iloc;
+
+	fill_iloc_by_inode_num(sb, ino, &iloc);
+	return iloc.offset;
+}
+
+
+/*
+ * starts reading the inode table blocks following the one of iloc, up to
+ * the end of the table. Inodes created together sit next to each other,
+ * and tend to be looked up together as well
+ */
+static void itable_readahead(struct super_block *sb, struct testfs_iloc *iloc)
+{
+	struct testfs_group_desc *desc	= NULL;
+	u32 group			= iloc->ino / TESTFS_INODES_PER_GROUP(sb);
+	u32 block, end;
+
+	desc 	= TESTFS_GROUP_DESC(sb, group);
+	end 	= le32_to_cpu(desc->inode_table) +
+		  DIV_ROUND_UP(TESTFS_INODES_PER_GROUP(sb) * TESTFS_INODE_SIZE(sb), sb->s_blocksize);
+
+	for (block = iloc->block_num + 1; block < end && block <= iloc->block_num + ITABLE_READAHEAD; block++)
+		sb_breadahead(sb, block);
+}
+
+
 static struct testfs_inode *read_inode(struct super_block *sb, struct testfs_iloc *iloc)
 {
-	/* Read block from disk */
-	if (!(iloc->bh = sb_bread(sb, iloc->block_num))) {
-		printk(KERN_INFO "testfs: error reading inode number %d from disk\n", iloc->ino);
+	if (!(iloc->bh = sb_getblk(sb, iloc->block_num)))
 		return ERR_PTR(-EIO);
+
+	/* Read block from disk */
+	if (!buffer_uptodate(iloc->bh)) {
+		itable_readahead(sb, iloc);
+
+		lock_buffer(iloc->bh);
+		if (bh_submit_read(iloc->bh) < 0) {
+			printk(KERN_INFO "testfs: error reading inode number %d from disk\n", iloc->ino);
+			brelse(iloc->bh);
+			return ERR_PTR(-EIO);
+		}
 	}
 
 	/* Copy inode structure from disk */
@@ -275,177 +567,212 @@ static struct testfs_inode *read_inode(struct super_block *sb, struct testfs_ilo
 }
 
 
-int inode_write_inode(struct inode *inode, struct writeback_control *wbc)
+/*
+ * copies the in-memory inode to its inode table block, which joins the
+ * running transaction. Called whenever the inode is marked dirty, so the
+ * inode always commits together with the operation that changed it
+ */
+void inode_dirty_inode(struct inode *inode, int flags)
 {
+	struct testfs_handle handle;
 	struct testfs_iloc iloc;
         struct testfs_inode *raw_inode = NULL;
 
+        struct testfs_inode_info *testfs_inode = TESTFS_GET_INODE(inode);
+
 	fill_iloc_by_inode_num(inode->i_sb, inode->i_ino, &iloc);
 	raw_inode = read_inode(inode->i_sb, &iloc);
 
-	if (!raw_inode) {
-		return -EIO;
+	if (IS_ERR(raw_inode)) {
+		return;
 	}
 
-	raw_inode->i_size 	= inode_get_size(inode);
-	raw_inode->i_mode 	= inode->i_mode;
-	raw_inode->block_ptr 	= ((struct testfs_inode *)inode->i_private)->block_ptr;
+	testfs_trans_start(inode->i_sb, &handle);
+
+	raw_inode->i_size 	= cpu_to_le64(inode_get_size(inode));
+	raw_inode->i_mode 	= cpu_to_le16(inode->i_mode);
+	raw_inode->i_blocks	= cpu_to_le32(inode->i_blocks >> (inode->i_blkbits - 9));
+	raw_inode->group		= cpu_to_le32(testfs_inode->i_group);
+	raw_inode->i_flags		= cpu_to_le32(testfs_inode->i_flags);
 
-	printk(KERN_INFO "testfs: writing inode: %lu, mode: %d, type: %s\n", inode->i_ino, raw_inode->i_mode, S_ISREG(inode->i_mode) ? "file" : "dir");
+	down_read(&testfs_inode->i_extent_sem);
+	raw_inode->i_extent_count	= testfs_inode->i_extent_count;
+	raw_inode->i_extent_block	= testfs_inode->i_extent_block;
+	memcpy(raw_inode->i_extents, testfs_inode->i_extents, sizeof(raw_inode->i_extents));
+	up_read(&testfs_inode->i_extent_sem);
 
-	mark_buffer_dirty(iloc.bh);
+	testfs_trans_dirty_bh(inode->i_sb, iloc.bh, TESTFS_TRANS_INODE);
+	testfs_trans_stop(&handle);
 
-        return 0;
+	brelse(iloc.bh);
 }
 
 
+/*
+ * the inode already is in a transaction, all that is left is waiting for
+ * the commit when the caller needs the inode on disk
+ */
+int inode_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+	if (wbc->sync_mode != WB_SYNC_ALL || current->journal_info)
+		return 0;
+
+	return testfs_commit_wait(inode->i_sb);
+}
+
 
-int inode_alloc_data_block(struct super_block *sb, struct inode *inode)
+
+/*
+ * where the first block of an inode goes: the spot of its group matching its
+ * place in the inode table, so inodes created together have their data
+ * together and in the same order. 0 if the inode has no valid group
+ */
+unsigned long inode_data_goal(struct super_block *sb, struct inode *inode)
 {
-	int err					= 0;
-	int i, group 				= 0;
-	struct buffer_head *bitmap_bh     	= NULL;
-	struct testfs_inode *testfs_inode 	= TESTFS_GET_INODE(inode);
-	struct testfs_group_desc *desc    	= NULL;
-	struct testfs_superblock *testfs_sb     = NULL;
-	struct testfs_info *testfs_i            = TESTFS_GET_SB_INFO(sb);
-	int new_data_block_num			= 0;
-
-	testfs_sb 	= testfs_i->sb;
-	group 		= get_inode_group(sb, inode);
-
-        if (group < 0) {
+	struct testfs_group_desc *desc		= NULL;
+	int group 				= get_inode_group(sb, inode);
+	unsigned long first, end;
+
+        if (group < 0 || group >= TESTFS_GET_SB(sb)->group_count) {
                 printk(KERN_INFO "testfs: invalid group for inode number: %lu\n", inode->i_ino);
-                err = -ENOSPC;
-		goto fail;
+                return 0;
         }
 
-        for (i=0;i<testfs_sb->group_count;i++)
-        {
-                desc = (struct testfs_group_desc *)testfs_i->group_desc_bh[group]->b_data;
-
-                brelse(bitmap_bh);
-
-                if (!(bitmap_bh = sb_bread(sb, desc->block_bitmap))) {
-                        printk(KERN_INFO "testfs: error reading data block bitmap at block: %d\n", desc->block_bitmap);
-                        err = -EIO;
-			goto fail;
-                }
-
-                new_data_block_num = find_next_zero_bit((unsigned long *)bitmap_bh->b_data,
-                                              TESTFS_INODES_PER_GROUP(sb), new_data_block_num);
-
-		printk(KERN_INFO "testfs: data block num from bitmap: %d, group nr: %d\n", new_data_block_num, group);
-                if (new_data_block_num == TESTFS_INODES_PER_GROUP(sb)) {
-                        if (group == (testfs_sb->group_count - 1)) {
-                                group = 0;
-                                continue;
-                        }
-                        group++;
-                }
-                else {
-                        goto block_num_found;
-                }
-        }	
-	
-block_num_found:
-	__test_and_set_bit_le(new_data_block_num, bitmap_bh->b_data);
-
-	testfs_inode->block_ptr = new_data_block_num + desc->first_data_block;
-
-	mark_buffer_dirty(bitmap_bh);
-	mark_inode_dirty(inode);
-	brelse(bitmap_bh);
+	desc 	= TESTFS_GROUP_DESC(sb, group);
+	first 	= le32_to_cpu(desc->first_data_block);
+	end 	= (unsigned long)(group + 1) * TESTFS_BLOCKS_PER_GROUP(sb);
 
-	return 0;
-fail:
-	if (bitmap_bh)
-		brelse(bitmap_bh);
-
-	return err;
+	/* the data area is shorter in a group holding the metadata of others */
+	return first + (u64)(inode->i_ino % TESTFS_INODES_PER_GROUP(sb)) * (end - first) /
+	       TESTFS_INODES_PER_GROUP(sb);
 }
 
 
-int inode_delete_inode(struct inode *inode)
+/*
+ * allocates up to *count physically contiguous data blocks, as close to goal
+ * as possible (goal 0 means anywhere in the inode`s group). On success *block
+ * is the first allocated block and *count the number of blocks allocated,
+ * which is at least one. flags are those of testfs_balloc_alloc()
+ */
+int inode_alloc_data_blocks(struct super_block *sb, struct inode *inode, unsigned long goal,
+	unsigned long *count, unsigned long *block, int flags)
 {
-	unsigned long inode_group       = 0;
-        struct testfs_group_desc *desc  = NULL;
-        struct testfs_info *testfs_i    	= TESTFS_GET_SB_INFO(inode->i_sb);
-        struct testfs_inode *testfs_inode 	= TESTFS_GET_INODE(inode);
-	int local_ino                   = 0;
-	struct buffer_head *bitmap_bh	= NULL;
+	if (!goal)
+		goal = inode_data_goal(sb, inode);
 
-        inode_group     = inode->i_ino / TESTFS_INODES_PER_GROUP(inode->i_sb);
-        local_ino       = inode->i_ino - (inode_group * TESTFS_INODES_PER_GROUP(inode->i_sb));
+	if (!goal || goal / TESTFS_BLOCKS_PER_GROUP(sb) >= TESTFS_GET_SB(sb)->group_count)
+		return -ENOSPC;
 
-        desc = (struct testfs_group_desc *)testfs_i->group_desc_bh[inode_group]->b_data;
+	return testfs_balloc_alloc(sb, goal / TESTFS_BLOCKS_PER_GROUP(sb), goal, count, block, flags);
+}
 
-        if (desc) {
-		if (!(bitmap_bh = sb_bread(inode->i_sb, desc->inode_bitmap))) {
-                        printk(KERN_INFO "testfs: error reading inode bitmap at block: %d\n", desc->inode_bitmap);
-                        return -EIO;
-                }	
-		__test_and_clear_bit_le(local_ino, bitmap_bh);
 
-		if (testfs_inode->block_ptr) {
-			inode_delete_data_block(inode->i_sb, testfs_inode->block_ptr);
-		}
-	}
+/*
+ * drops the last link of inode. Its number and data blocks are freed when
+ * the last reference goes, see inode_evict_inode()
+ */
+int inode_delete_inode(struct inode *inode)
+{
+	if (S_ISDIR(inode->i_mode))
+		update_dirs(inode->i_sb, get_inode_group(inode->i_sb, inode), -1);
 
+	clear_nlink(inode);
 	mark_inode_dirty(inode);
-	mark_buffer_dirty(bitmap_bh);
-	
-	iput(inode);
-	brelse(bitmap_bh);
 
 	return 0;
 }
 
 
-int inode_delete_data_block(struct super_block *sb, unsigned long block)
+/*
+ * the inode leaves the cache. Dirty pages of an unlinked inode are thrown
+ * away without ever getting blocks, which gives their reservations back;
+ * then the blocks it does have and the inode number are freed, once the
+ * running transaction is on disk. Unwritten blocks written back meanwhile
+ * are converted first
+ */
+void inode_evict_inode(struct inode *inode)
 {
-        unsigned long group       	= 0;
-        struct testfs_group_desc *desc  = NULL;
-        struct testfs_info *testfs_i    = TESTFS_GET_SB_INFO(sb);
+	struct testfs_handle handle;
 
-        int local_block                 = 0;
-	int block_in_bitmap		= 0;
-        struct buffer_head *bitmap_bh   = NULL;
+	truncate_inode_pages(&inode->i_data, 0);
+	testfs_convert_written(inode);
+	testfs_balloc_window_release(inode->i_sb, &TESTFS_GET_INODE(inode)->i_window);
 
-        group     	= block / TESTFS_BLOCKS_PER_GROUP(sb);
-	desc 		= (struct testfs_group_desc *)testfs_i->group_desc_bh[group]->b_data;
-        local_block 	= block - (group * TESTFS_BLOCKS_PER_GROUP(sb));
-	block_in_bitmap = local_block - desc->first_data_block;
+	if (!inode->i_nlink && !is_bad_inode(inode)) {
+		testfs_trans_start(inode->i_sb, &handle);
 
-        desc = (struct testfs_group_desc *)testfs_i->group_desc_bh[group]->b_data;
+		testfs_extent_free_all(inode);
+		i_size_write(inode, 0);
+		inode_dirty_inode(inode, 0);
+		testfs_trans_free(inode->i_sb, TESTFS_FREE_INODE, inode->i_ino, 1);
 
-        if (desc) {
-                if (!(bitmap_bh = sb_bread(sb, desc->block_bitmap))) {
-                        printk(KERN_INFO "testfs: error reading data bitmap at block: %d\n", desc->block_bitmap);
-                        return -EIO;
-                }
-                __test_and_clear_bit_le(block_in_bitmap, bitmap_bh);
+		testfs_trans_stop(&handle);
 	}
 
-	printk(KERN_INFO "testfs: delete data block %lu, local: %d\n", block, block_in_bitmap);
+	invalidate_inode_buffers(inode);
+	clear_inode(inode);
+}
 
-        mark_buffer_dirty(bitmap_bh);
-        brelse(bitmap_bh);
 
-        return 0;
-}
+/*
+ * clears the bit of inode number ino in its group`s inode bitmap
+ */
+int inode_release_inode(struct super_block *sb, unsigned long ino)
+{
+	unsigned long inode_group       = 0;
+        struct testfs_group_desc *desc  = NULL;
+        struct testfs_info *testfs_i    = TESTFS_GET_SB_INFO(sb);
+	struct testfs_group_info *gi	= NULL;
+	int local_ino                   = 0;
+	int freed;
+	struct buffer_head *bitmap_bh	= NULL;
 
+        inode_group     = ino / TESTFS_INODES_PER_GROUP(sb);
+        local_ino       = ino - (inode_group * TESTFS_INODES_PER_GROUP(sb));
 
+        desc 	= TESTFS_GROUP_DESC(sb, inode_group);
+	gi	= &testfs_i->group_info[inode_group];
 
+	if (!(bitmap_bh = get_inode_bitmap(sb, desc)))
+		return -EIO;
 
+	spin_lock(&gi->lock);
+	freed = __test_and_clear_bit_le(local_ino, bitmap_bh->b_data);
+	if (freed)
+		testfs_group_update(sb, inode_group, 0, 1, 0);
+	spin_unlock(&gi->lock);
 
-int inode_get_size(struct inode *inode)
-{
-	struct testfs_inode *raw_inode 		= (struct testfs_inode *)inode->i_private;
+	if (freed) {
+		testfs_trans_dirty_bh(sb, bitmap_bh, TESTFS_TRANS_BITMAP);
+		testfs_trans_dirty_bh(sb, TESTFS_GROUP_DESC_BH(sb, inode_group), TESTFS_TRANS_BITMAP);
+	}
+	brelse(bitmap_bh);
 
-	return le16_to_cpu(raw_inode->i_size);
+	return 0;
+}
+
+
+/*
+ * frees count data blocks starting at block, once the running transaction
+ * is on disk. The run must not cross a group
+ */
+int inode_delete_data_blocks(struct super_block *sb, unsigned long block, unsigned long count)
+{
+	testfs_trans_free(sb, TESTFS_FREE_BLOCKS, block, count);
+	return 0;
 }
 
 
+/*
+ * clears the bits of count data blocks starting at block in the block bitmap
+ */
+int inode_release_data_blocks(struct super_block *sb, unsigned long block, unsigned long count)
+{
+	return testfs_balloc_free(sb, block, count);
+}
 
 
+loff_t inode_get_size(struct inode *inode)
+{
+	return i_size_read(inode);
+}
@@ -3,20 +3,61 @@
 
 #include <linux/fs.h>
 
+#include "extent.h"
+#include "balloc.h"
+
 
 /* On disk inode structure */
 struct testfs_inode {
 	__le16 i_mode;		/* Mode */
-	__le16 i_size;		/* Size */
+	__le16 i_extent_count;	/* Number of extents in use */
 	__le32 group;		/* Block group */
-	__le32 block_ptr;	/* Pointer to data block */
+	__le64 i_size;		/* Size */
+	__le32 i_extent_block;	/* Block holding the extents once they outgrow the inode */
+	struct testfs_extent i_extents[TESTFS_INODE_EXTENTS];
+	__le32 i_blocks;	/* Allocated blocks, extent block included */
+	__le32 i_flags;		/* TESTFS_INODE_* */
+};
+
+/* Inode flags */
+#define TESTFS_INODE_INLINE	0x0001	/* Data in the inode past the fields above, no blocks */
+
+/*
+ * In-memory inode. Holds the fields of the raw inode the VFS inode has no
+ * room for; the extents stay in disk byte order, extent.c works on them
+ * in place
+ */
+struct testfs_inode_info {
+	u32 i_group;			/* Block group */
+	u32 i_flags;			/* TESTFS_INODE_* */
+	__le16 i_extent_count;
+	__le32 i_extent_block;
+	struct testfs_extent i_extents[TESTFS_INODE_EXTENTS];
+	struct mutex i_alloc_mutex;	/* Serializes data block allocation */
+	struct rw_semaphore i_extent_sem;	/* Guards the extent list, taken inside i_alloc_mutex */
+	struct list_head i_unwritten;	/* Unwritten blocks written back, under i_alloc_mutex */
+	struct mutex i_convert_mutex;	/* Serializes converting them, taken outside the transaction */
+	struct testfs_window i_window;	/* Blocks set aside for the file to grow into */
+	u32 i_window_lblk;		/* Logical block the window continues the file at */
+	u32 i_window_size;		/* Blocks the last window was set aside with */
+	struct inode vfs_inode;
 };
 
+/* Group descriptor flags */
+#define TESTFS_BG_BLOCK_UNINIT	0x0001	/* Block bitmap never written, every data block is free */
+#define TESTFS_BG_INODE_UNINIT	0x0002	/* Inode bitmap never written, only inode 0 is in use */
+#define TESTFS_BG_ITABLE_UNINIT	0x0004	/* Inode table never zeroed, see itable.c */
+
 struct testfs_group_desc {
         __le32 block_bitmap;
         __le32 inode_bitmap;
         __le32 inode_table;
 	__le32 first_data_block;
+	__le32 free_blocks_count;	/* Free data blocks */
+	__le32 free_inodes_count;	/* Free inodes */
+	__le16 flags;			/* TESTFS_BG_* */
+	__le16 used_dirs_count;		/* Directories, to spread them over the groups */
+	__le32 reserved;		/* Pads the descriptors of a table to 32 bytes */
 };
 
 /* Inode memory and on disk locations */
@@ -28,16 +69,29 @@ struct testfs_iloc {
 	u32 ino;
 };
 
+int inode_cache_init(void);
+void inode_cache_destroy(void);
+struct inode *inode_alloc_inode(struct super_block *sb);
+void inode_destroy_inode(struct inode *inode);
+void inode_evict_inode(struct inode *inode);
+
 struct inode *inode_iget(struct super_block *sb, u32 ino);
+sector_t inode_table_block(struct super_block *sb, u32 ino);
+u32 inode_table_offset(struct super_block *sb, u32 ino);
 
 struct inode *inode_get_new_inode(struct inode *dir, umode_t mode, int alloc_data_block);
 
 int inode_delete_inode(struct inode *inode);
-int inode_delete_data_block(struct super_block *sb, unsigned long block);
+int inode_delete_data_blocks(struct super_block *sb, unsigned long block, unsigned long count);
+int inode_release_inode(struct super_block *sb, unsigned long ino);
+int inode_release_data_blocks(struct super_block *sb, unsigned long block, unsigned long count);
 
-int inode_alloc_data_block(struct super_block *sb, struct inode *inode);
+unsigned long inode_data_goal(struct super_block *sb, struct inode *inode);
+int inode_alloc_data_blocks(struct super_block *sb, struct inode *inode, unsigned long goal,
+	unsigned long *count, unsigned long *block, int flags);
+void inode_dirty_inode(struct inode *inode, int flags);
 int inode_write_inode(struct inode *inode, struct writeback_control *wbc);
 
-int inode_get_size(struct inode *inode);
+loff_t inode_get_size(struct inode *inode);
 
 #endif /* INODE_H */
@@ -0,0 +1,238 @@
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/jiffies.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+
+#include "testfs.h"
+#include "super.h"
+#include "inode.h"
+#include "commit.h"
+#include "itable.h"
+
+/*
+ * The formatter does not write the inode tables of the groups other than
+ * the first, it flags them TESTFS_BG_ITABLE_UNINIT instead. Nothing in an
+ * unused inode is ever read, so the old contents of the device are
+ * harmless, but they would make a stale inode look valid to anybody
+ * scanning the table. A thread started at mount zeroes the flagged tables
+ * one group at a time, sleeping in between so it does not compete with
+ * the real work, and the inode allocator zeroes a table itself when it
+ * gets to a group first.
+ *
+ * Zeroing happens while no inode of the group is in use, so the whole
+ * table goes at once. The allocator zeroes inside the handle it already
+ * has, the group mutex nests in it. The thread zeroes under the mutex
+ * alone, so that no commit waits for the zeros, and takes a handle
+ * afterwards only to clear the flag.
+ */
+
+
+static int itable_uninit(struct super_block *sb, unsigned long group)
+{
+	struct testfs_group_desc *desc	= TESTFS_GROUP_DESC(sb, group);
+
+	return le16_to_cpu(desc->flags) & TESTFS_BG_ITABLE_UNINIT;
+}
+
+
+/*
+ * the zeros went around the buffer cache, a table block read before must
+ * not hand out the old contents
+ */
+static void zero_cached_blocks(struct super_block *sb, sector_t block, unsigned long count)
+{
+	struct buffer_head *bh;
+	unsigned long i;
+
+	for (i = 0; i < count; i++) {
+		bh = __find_get_block(sb->s_bdev, block + i, sb->s_blocksize);
+		if (!bh)
+			continue;
+
+		lock_buffer(bh);
+		memset(bh->b_data, 0x00, sb->s_blocksize);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		brelse(bh);
+	}
+}
+
+
+/*
+ * zeroes the inode table of a group, under its itable_mutex. Returns once
+ * the zeros are on the device
+ */
+static int zero_itable(struct super_block *sb, unsigned long group)
+{
+	struct testfs_group_desc *desc	= TESTFS_GROUP_DESC(sb, group);
+	unsigned long blocks;
+	sector_t start;
+	int err;
+
+	blocks 	= DIV_ROUND_UP(TESTFS_INODES_PER_GROUP(sb) * TESTFS_INODE_SIZE(sb), sb->s_blocksize);
+	start 	= le32_to_cpu(desc->inode_table);
+
+	err = blkdev_issue_zeroout(sb->s_bdev, start << (sb->s_blocksize_bits - 9),
+		blocks << (sb->s_blocksize_bits - 9), GFP_NOFS);
+	if (err) {
+		printk(KERN_ERR "testfs: error zeroing the inode table of group %lu\n", group);
+		return err;
+	}
+
+	zero_cached_blocks(sb, start, blocks);
+
+	return 0;
+}
+
+
+/*
+ * clears the flag of a zeroed table in the running transaction
+ */
+static void clear_itable_uninit(struct super_block *sb, unsigned long group)
+{
+	struct testfs_group_info *gi	= &TESTFS_GET_SB_INFO(sb)->group_info[group];
+	struct testfs_group_desc *desc	= TESTFS_GROUP_DESC(sb, group);
+
+	spin_lock(&gi->lock);
+	desc->flags &= cpu_to_le16(~TESTFS_BG_ITABLE_UNINIT);
+	spin_unlock(&gi->lock);
+
+	testfs_trans_dirty_bh(sb, TESTFS_GROUP_DESC_BH(sb, group), TESTFS_TRANS_BITMAP);
+}
+
+
+/*
+ * zeroes the inode table of a group if it never was, and clears the flag
+ * in the running transaction. For the inode allocator, which holds a
+ * handle already
+ */
+int testfs_itable_init(struct super_block *sb, unsigned long group)
+{
+	struct testfs_group_info *gi	= &TESTFS_GET_SB_INFO(sb)->group_info[group];
+	struct testfs_handle handle;
+	int err				= 0;
+
+	if (!itable_uninit(sb, group))
+		return 0;
+
+	testfs_trans_start(sb, &handle);
+	mutex_lock(&gi->itable_mutex);
+
+	if (itable_uninit(sb, group)) {
+		err = zero_itable(sb, group);
+		if (!err)
+			clear_itable_uninit(sb, group);
+	}
+
+	mutex_unlock(&gi->itable_mutex);
+	testfs_trans_stop(&handle);
+
+	return err;
+}
+
+
+/*
+ * the thread's version of testfs_itable_init(). The mutex is let go in
+ * between: the allocator takes it inside a handle. An allocator getting
+ * to the group meanwhile zeroes the table once more, which does no harm
+ */
+static int itable_thread_init(struct super_block *sb, unsigned long group)
+{
+	struct testfs_group_info *gi	= &TESTFS_GET_SB_INFO(sb)->group_info[group];
+	struct testfs_handle handle;
+	int err				= 0;
+
+	mutex_lock(&gi->itable_mutex);
+	if (itable_uninit(sb, group))
+		err = zero_itable(sb, group);
+	mutex_unlock(&gi->itable_mutex);
+
+	if (err)
+		return err;
+
+	testfs_trans_start(sb, &handle);
+	mutex_lock(&gi->itable_mutex);
+
+	if (itable_uninit(sb, group))
+		clear_itable_uninit(sb, group);
+
+	mutex_unlock(&gi->itable_mutex);
+	testfs_trans_stop(&handle);
+
+	return 0;
+}
+
+
+static int itable_thread(void *data)
+{
+	struct super_block *sb 		= data;
+	struct testfs_info *testfs_i	= TESTFS_GET_SB_INFO(sb);
+	unsigned long group;
+	unsigned long start;
+
+	for (group = 0; group < testfs_i->sb->group_count; group++) {
+		if (kthread_should_stop())
+			break;
+
+		if (!itable_uninit(sb, group))
+			continue;
+
+		start = jiffies;
+		if (itable_thread_init(sb, group))
+			break;
+
+		schedule_timeout_interruptible((jiffies - start) * TESTFS_ITABLE_WAIT_MULT + 1);
+	}
+
+	/* kthread_stop() wants the thread around */
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+
+/*
+ * starts zeroing the tables left to the kernel, if there are any
+ */
+int testfs_itable_start(struct super_block *sb)
+{
+	struct testfs_info *testfs_i	= TESTFS_GET_SB_INFO(sb);
+	unsigned long group;
+
+	for (group = 0; group < testfs_i->sb->group_count; group++)
+		if (itable_uninit(sb, group))
+			break;
+
+	if (group == testfs_i->sb->group_count)
+		return 0;
+
+	testfs_i->itable_task = kthread_run(itable_thread, sb, "testfs_itable");
+	if (IS_ERR(testfs_i->itable_task)) {
+		int err = PTR_ERR(testfs_i->itable_task);
+
+		printk(KERN_ERR "testfs: error starting the inode table thread\n");
+		testfs_i->itable_task = NULL;
+		return err;
+	}
+
+	return 0;
+}
+
+
+void testfs_itable_stop(struct super_block *sb)
+{
+	struct testfs_info *testfs_i = TESTFS_GET_SB_INFO(sb);
+
+	if (!testfs_i->itable_task)
+		return;
+
+	kthread_stop(testfs_i->itable_task);
+	testfs_i->itable_task = NULL;
+}
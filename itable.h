@@ -0,0 +1,14 @@
+#ifndef ITABLE_H
+#define ITABLE_H
+
+#include <linux/fs.h>
+
+/* The thread sleeps this many times as long as zeroing a table took */
+#define TESTFS_ITABLE_WAIT_MULT	10
+
+int testfs_itable_init(struct super_block *sb, unsigned long group);
+
+int testfs_itable_start(struct super_block *sb);
+void testfs_itable_stop(struct super_block *sb);
+
+#endif /* ITABLE_H */
@@ -0,0 +1,952 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/completion.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+
+#include "testfs.h"
+#include "super.h"
+#include "commit.h"
+#include "journal.h"
+
+/*
+ * Write-ahead metadata journal.
+ *
+ * A commit copies every buffer of the transaction into the journal, which
+ * is a circular log living in a reserved region of group 0. The copies go
+ * out behind one or more descriptor blocks listing their home locations,
+ * then a commit block seals the transaction. Scattered metadata updates so
+ * become one sequential write plus one cache flush.
+ *
+ * Nothing is written home at commit time. The last committed copy of each
+ * block is kept around, and only when the log runs short of space (or at
+ * unmount) are all of them written home at once and the log emptied. As
+ * checkpointing writes the journal copies rather than the live buffers,
+ * changes of transactions not yet committed never reach their home
+ * location early.
+ *
+ * A transaction freeing a block that has a copy in the log also writes a
+ * revoke block naming it, and the copy is forgotten once the transaction
+ * is committed. Reused for file data, the block is so never overwritten by
+ * a checkpoint or a replay.
+ *
+ * On mount, every complete transaction found from the journal superblock
+ * onwards is written home again before anything else reads metadata,
+ * except for the copies a later revoke covers.
+ */
+
+/* Logged block not yet written to its home location */
+struct checkpoint_buf {
+	struct hlist_node node;
+	sector_t blocknr;		/* Home location */
+	struct buffer_head *bh;		/* Live buffer, pinned until written home */
+	struct buffer_head *jbh;	/* Last committed copy, in the journal */
+};
+
+/* Block revoked by a transaction found in the log at mount */
+struct revoke_entry {
+	struct hlist_node node;
+	u32 blocknr;
+	u32 sequence;			/* Latest transaction revoking it */
+};
+
+/* What scan_transaction() does with a transaction */
+enum {
+	SCAN_CHECK,			/* Only tell whether it is complete */
+	SCAN_REVOKE,			/* Record its revokes */
+	SCAN_REPLAY			/* Write its copies home */
+};
+
+struct checkpoint_io {
+	atomic_t pending;
+	int error;
+	struct completion done;
+};
+
+
+static inline struct testfs_journal *get_journal(struct super_block *sb)
+{
+	return TESTFS_GET_SB_INFO(sb)->journal;
+}
+
+
+static inline int seq_geq(u32 x, u32 y)
+{
+	return (s32)(x - y) >= 0;
+}
+
+
+static inline u32 log_size(struct testfs_journal *j)
+{
+	return j->blocks - j->first;
+}
+
+
+static inline u32 log_used(struct testfs_journal *j)
+{
+	return (j->head + log_size(j) - j->tail) % log_size(j);
+}
+
+
+static inline u32 log_free(struct testfs_journal *j)
+{
+	return log_size(j) - log_used(j) - 1;
+}
+
+
+static inline u32 log_next(struct testfs_journal *j, u32 pos)
+{
+	return (++pos == j->blocks) ? j->first : pos;
+}
+
+
+static inline u32 tags_per_desc(struct super_block *sb)
+{
+	return (sb->s_blocksize - sizeof(struct testfs_journal_desc)) / sizeof(__le32);
+}
+
+
+/*
+ * journal blocks needed to log nr buffers: the copies, their descriptors
+ * and the commit block
+ */
+static inline u32 trans_blocks(struct super_block *sb, u32 nr)
+{
+	return nr + DIV_ROUND_UP(nr, tags_per_desc(sb)) + 1;
+}
+
+
+static void fill_header(struct testfs_journal_header *h, u32 type, u32 sequence)
+{
+	h->h_magic 	= cpu_to_le32(TESTFS_JOURNAL_MAGIC);
+	h->h_type 	= cpu_to_le32(type);
+	h->h_sequence 	= cpu_to_le32(sequence);
+	h->h_reserved 	= 0;
+}
+
+
+static int write_sync(struct buffer_head *bh, int rw)
+{
+	lock_buffer(bh);
+	clear_buffer_dirty(bh);
+	get_bh(bh);
+	bh->b_end_io = end_buffer_write_sync;
+	submit_bh(rw, bh);
+	wait_on_buffer(bh);
+
+	return buffer_uptodate(bh) ? 0 : -EIO;
+}
+
+
+/*
+ * records where replay has to start. The cache is flushed first, so that
+ * whatever the journal no longer covers is on disk before it is forgotten
+ */
+static int update_super(struct super_block *sb, u32 start, u32 sequence)
+{
+	struct testfs_journal *j 	= get_journal(sb);
+	struct testfs_journal_super *js = (struct testfs_journal_super *)j->sb_bh->b_data;
+
+	js->s_start 	= cpu_to_le32(start);
+	js->s_sequence 	= cpu_to_le32(sequence);
+
+	return write_sync(j->sb_bh, WRITE_FLUSH_FUA);
+}
+
+
+static struct buffer_head *get_log_block(struct super_block *sb, u32 pos)
+{
+	struct testfs_journal *j 	= get_journal(sb);
+	struct buffer_head *bh		= NULL;
+
+	if (!(bh = sb_getblk(sb, j->start + pos)))
+		return NULL;
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0x00, sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+
+	return bh;
+}
+
+
+static void checkpoint_end_io(struct bio *bio, int err)
+{
+	struct checkpoint_io *io = bio->bi_private;
+
+	if (err)
+		io->error = err;
+
+	if (atomic_dec_and_test(&io->pending))
+		complete(&io->done);
+
+	bio_put(bio);
+}
+
+
+/*
+ * writes the journal copy of a block to its home location, bypassing the
+ * live buffer which may already hold newer, uncommitted changes
+ */
+static void write_home(struct super_block *sb, struct checkpoint_buf *cb, struct checkpoint_io *io)
+{
+	struct bio *bio = bio_alloc(GFP_NOFS, 1);
+
+	bio->bi_bdev 	= sb->s_bdev;
+	bio->bi_sector 	= cb->blocknr << (sb->s_blocksize_bits - 9);
+	bio->bi_end_io 	= checkpoint_end_io;
+	bio->bi_private = io;
+	bio_add_page(bio, cb->jbh->b_page, sb->s_blocksize, bh_offset(cb->jbh));
+
+	atomic_inc(&io->pending);
+	submit_bio(WRITE, bio);
+}
+
+
+static void init_checkpoint_io(struct checkpoint_io *io)
+{
+	atomic_set(&io->pending, 1);
+	io->error = 0;
+	init_completion(&io->done);
+}
+
+
+static int wait_checkpoint_io(struct checkpoint_io *io)
+{
+	if (!atomic_dec_and_test(&io->pending))
+		wait_for_completion(&io->done);
+
+	return io->error;
+}
+
+
+static struct checkpoint_buf *find_checkpoint(struct testfs_journal *j, sector_t blocknr)
+{
+	struct checkpoint_buf *cb = NULL;
+
+	hash_for_each_possible(j->checkpoint, cb, node, blocknr) {
+		if (cb->blocknr == blocknr)
+			return cb;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * remembers that the latest committed copy of bh is jbh. Takes over the
+ * references of both buffers
+ */
+static void add_checkpoint(struct super_block *sb, struct buffer_head *bh, struct buffer_head *jbh)
+{
+	struct testfs_journal *j 	= get_journal(sb);
+	struct checkpoint_buf *cb	= NULL;
+	struct checkpoint_io io;
+
+	if ((cb = find_checkpoint(j, bh->b_blocknr))) {
+		brelse(cb->jbh);
+		cb->jbh = jbh;
+		put_bh(bh);
+		return;
+	}
+
+	cb = kmalloc(sizeof(*cb), GFP_NOFS);
+	if (!cb) {
+		/* out of memory, write this one home right away */
+		struct checkpoint_buf tmp = { .blocknr = bh->b_blocknr, .bh = bh, .jbh = jbh };
+
+		init_checkpoint_io(&io);
+		write_home(sb, &tmp, &io);
+		if (wait_checkpoint_io(&io))
+			printk(KERN_ERR "testfs: error writing metadata block %llu\n",
+				(unsigned long long)bh->b_blocknr);
+
+		put_bh(bh);
+		brelse(jbh);
+		return;
+	}
+
+	cb->blocknr 	= bh->b_blocknr;
+	cb->bh 		= bh;
+	cb->jbh 	= jbh;
+	hash_add(j->checkpoint, &cb->node, cb->blocknr);
+	j->nr_checkpoint++;
+}
+
+
+/*
+ * drops the copy of a block that is being freed, it must never be written
+ * home again
+ */
+static void forget_checkpoint(struct testfs_journal *j, sector_t blocknr)
+{
+	struct checkpoint_buf *cb = find_checkpoint(j, blocknr);
+
+	if (!cb)
+		return;
+
+	hash_del(&cb->node);
+	bforget(cb->bh);
+	brelse(cb->jbh);
+	kfree(cb);
+	j->nr_checkpoint--;
+}
+
+
+/*
+ * lists in j->revoke the blocks freed by t which have a copy in the log,
+ * or are about to get one
+ */
+static int collect_revokes(struct super_block *sb, struct testfs_transaction *t)
+{
+	struct testfs_journal *j 	= get_journal(sb);
+	struct checkpoint_buf *cb	= NULL;
+	struct testfs_trans_buf *tb	= NULL;
+	int bkt, i;
+
+	j->revoke 	= NULL;
+	j->nr_revoke 	= 0;
+
+	if (list_empty(&t->frees))
+		return 0;
+
+	j->revoke = kmalloc((j->nr_checkpoint + t->nr_bufs) * sizeof(*j->revoke), GFP_NOFS);
+	if (!j->revoke)
+		return -ENOMEM;
+
+	hash_for_each(j->checkpoint, bkt, cb, node) {
+		if (testfs_trans_frees_block(t, cb->blocknr))
+			j->revoke[j->nr_revoke++] = cb->blocknr;
+	}
+
+	for (i = 0; i < TESTFS_TRANS_TYPES; i++) {
+		list_for_each_entry(tb, &t->bufs[i], list) {
+			if (testfs_trans_frees_block(t, tb->bh->b_blocknr) &&
+			    !find_checkpoint(j, tb->bh->b_blocknr))
+				j->revoke[j->nr_revoke++] = tb->bh->b_blocknr;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * writes every logged block home and empties the log. With lazy set, only
+ * does so once the log is three quarters full
+ */
+int testfs_journal_checkpoint(struct super_block *sb, int lazy)
+{
+	struct testfs_journal *j 	= get_journal(sb);
+	struct checkpoint_buf *cb	= NULL;
+	struct hlist_node *tmp		= NULL;
+	struct checkpoint_io io;
+	int bkt, err;
+
+	if (!j || j->head == j->tail)
+		return 0;
+
+	if (lazy && log_used(j) < log_size(j) / 4 * 3)
+		return 0;
+
+	init_checkpoint_io(&io);
+	hash_for_each(j->checkpoint, bkt, cb, node)
+		write_home(sb, cb, &io);
+
+	err = wait_checkpoint_io(&io);
+	if (err) {
+		printk(KERN_ERR "testfs: error checkpointing the journal\n");
+		return err;
+	}
+
+	err = update_super(sb, j->head, j->sequence);
+	if (err)
+		return err;
+
+	j->tail = j->head;
+
+	hash_for_each_safe(j->checkpoint, bkt, tmp, cb, node) {
+		hash_del(&cb->node);
+		put_bh(cb->bh);
+		brelse(cb->jbh);
+		kfree(cb);
+	}
+	j->nr_checkpoint = 0;
+
+	return 0;
+}
+
+
+/*
+ * snapshots the buffers of t into journal blocks and lists the blocks it
+ * revokes. Called with the transaction closed to handles, so the copies
+ * are consistent. Fails with -ENOSPC if the transaction does not fit in
+ * the log even once emptied, and with -ENODATA if there is nothing to log
+ */
+int testfs_journal_copy(struct super_block *sb, struct testfs_transaction *t)
+{
+	struct testfs_journal *j 	= get_journal(sb);
+	struct testfs_trans_buf *tb	= NULL;
+	u32 per_desc			= tags_per_desc(sb);
+	u32 pos, needed, n		= 0;
+	int i, err;
+
+	err = collect_revokes(sb, t);
+	if (err)
+		return err;
+
+	if (!t->nr_bufs && !j->nr_revoke) {
+		err = -ENODATA;
+		goto err;
+	}
+
+	needed = trans_blocks(sb, t->nr_bufs) + DIV_ROUND_UP(j->nr_revoke, per_desc);
+
+	if (needed > log_size(j) - 1) {
+		err = -ENOSPC;
+		goto err;
+	}
+
+	if (needed > log_free(j)) {
+		err = testfs_journal_checkpoint(sb, 0);
+		if (err)
+			goto err;
+	}
+
+	pos = j->head;
+
+	for (i = 0; i < TESTFS_TRANS_TYPES; i++) {
+		list_for_each_entry(tb, &t->bufs[i], list) {
+			/* leave room for a descriptor in front of every batch */
+			if (n++ % per_desc == 0)
+				pos = log_next(j, pos);
+
+			if (!(tb->jbh = sb_getblk(sb, j->start + pos))) {
+				err = -ENOMEM;
+				goto err;
+			}
+
+			lock_buffer(tb->jbh);
+			memcpy(tb->jbh->b_data, tb->bh->b_data, sb->s_blocksize);
+			set_buffer_uptodate(tb->jbh);
+			unlock_buffer(tb->jbh);
+
+			pos = log_next(j, pos);
+		}
+	}
+
+	return 0;
+
+err:
+	for (i = 0; i < TESTFS_TRANS_TYPES; i++) {
+		list_for_each_entry(tb, &t->bufs[i], list) {
+			if (tb->jbh)
+				brelse(tb->jbh);
+			tb->jbh = NULL;
+		}
+	}
+
+	kfree(j->revoke);
+	j->revoke 	= NULL;
+	j->nr_revoke 	= 0;
+
+	return err;
+}
+
+
+/*
+ * writes the copies made by testfs_journal_copy() and the revoke blocks,
+ * and seals them with a commit block. The buffers of t move on to the
+ * checkpoint list, the revoked blocks leave it
+ */
+int testfs_journal_write(struct super_block *sb, struct testfs_transaction *t)
+{
+	struct testfs_journal *j 		= get_journal(sb);
+	struct testfs_trans_buf *tb, *next;
+	struct testfs_journal_desc *desc	= NULL;
+	struct testfs_journal_revoke *revoke	= NULL;
+	struct buffer_head **desc_bh		= NULL;
+	struct buffer_head *commit_bh		= NULL;
+	u32 per_desc				= tags_per_desc(sb);
+	u32 nr_desc				= DIV_ROUND_UP(t->nr_bufs, per_desc);
+	u32 nr_log				= nr_desc + DIV_ROUND_UP(j->nr_revoke, per_desc);
+	u32 pos					= j->head;
+	u32 d, r, n				= 0;
+	int i, err				= 0;
+
+	/* descriptors first, then the revoke blocks */
+	desc_bh = kzalloc(nr_log * sizeof(*desc_bh), GFP_NOFS);
+	if (!desc_bh) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* same layout as testfs_journal_copy(): a descriptor, then its copies */
+	for (i = 0; i < TESTFS_TRANS_TYPES; i++) {
+		list_for_each_entry(tb, &t->bufs[i], list) {
+			if (n % per_desc == 0) {
+				d = n / per_desc;
+				if (d > 0)
+					write_dirty_buffer(desc_bh[d - 1], WRITE);
+
+				if (!(desc_bh[d] = get_log_block(sb, pos))) {
+					err = -ENOMEM;
+					goto wait;
+				}
+
+				desc = (struct testfs_journal_desc *)desc_bh[d]->b_data;
+				fill_header(&desc->d_header, TESTFS_JOURNAL_DESC, j->sequence);
+				mark_buffer_dirty(desc_bh[d]);
+
+				pos = log_next(j, pos);
+			}
+
+			desc->d_blocks[le32_to_cpu(desc->d_count)] = cpu_to_le32(tb->bh->b_blocknr);
+			le32_add_cpu(&desc->d_count, 1);
+			n++;
+
+			mark_buffer_dirty(tb->jbh);
+			write_dirty_buffer(tb->jbh, WRITE);
+
+			pos = log_next(j, pos);
+		}
+	}
+
+	if (nr_desc)
+		write_dirty_buffer(desc_bh[nr_desc - 1], WRITE);
+
+	for (r = 0; r < j->nr_revoke; r++) {
+		if (r % per_desc == 0) {
+			d = nr_desc + r / per_desc;
+			if (d > nr_desc)
+				write_dirty_buffer(desc_bh[d - 1], WRITE);
+
+			if (!(desc_bh[d] = get_log_block(sb, pos))) {
+				err = -ENOMEM;
+				goto wait;
+			}
+
+			revoke = (struct testfs_journal_revoke *)desc_bh[d]->b_data;
+			fill_header(&revoke->r_header, TESTFS_JOURNAL_REVOKE, j->sequence);
+			mark_buffer_dirty(desc_bh[d]);
+
+			pos = log_next(j, pos);
+		}
+
+		revoke->r_blocks[r % per_desc] = cpu_to_le32(j->revoke[r]);
+		le32_add_cpu(&revoke->r_count, 1);
+	}
+
+	if (nr_log > nr_desc)
+		write_dirty_buffer(desc_bh[nr_log - 1], WRITE);
+
+wait:
+	for (d = 0; d < nr_log && desc_bh[d]; d++) {
+		wait_on_buffer(desc_bh[d]);
+		if (!buffer_uptodate(desc_bh[d]))
+			err = -EIO;
+	}
+
+	for (i = 0; i < TESTFS_TRANS_TYPES; i++) {
+		list_for_each_entry(tb, &t->bufs[i], list) {
+			wait_on_buffer(tb->jbh);
+			if (!buffer_uptodate(tb->jbh))
+				err = -EIO;
+		}
+	}
+
+	if (err)
+		goto out;
+
+	/* the flush ahead of the commit block orders it after the copies */
+	if (!(commit_bh = get_log_block(sb, pos))) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	fill_header((struct testfs_journal_header *)commit_bh->b_data, TESTFS_JOURNAL_COMMIT, j->sequence);
+	err = write_sync(commit_bh, WRITE_FLUSH_FUA);
+	brelse(commit_bh);
+
+	if (err)
+		goto out;
+
+	j->head = log_next(j, pos);
+	j->sequence++;
+
+out:
+	for (d = 0; desc_bh && d < nr_log; d++)
+		if (desc_bh[d])
+			brelse(desc_bh[d]);
+	kfree(desc_bh);
+
+	for (i = 0; i < TESTFS_TRANS_TYPES; i++) {
+		list_for_each_entry_safe(tb, next, &t->bufs[i], list) {
+			if (err) {
+				/* not logged: let regular writeback take care of it */
+				printk(KERN_ERR "testfs: error logging metadata block %llu\n",
+					(unsigned long long)tb->bh->b_blocknr);
+				mark_buffer_dirty(tb->bh);
+				put_bh(tb->bh);
+				brelse(tb->jbh);
+			}
+			else {
+				add_checkpoint(sb, tb->bh, tb->jbh);
+			}
+
+			list_del(&tb->list);
+			kfree(tb);
+		}
+	}
+
+	/* the blocks may be reused as soon as t releases them */
+	for (r = 0; !err && r < j->nr_revoke; r++)
+		forget_checkpoint(j, j->revoke[r]);
+
+	kfree(j->revoke);
+	j->revoke 	= NULL;
+	j->nr_revoke 	= 0;
+
+	return err;
+}
+
+
+static int add_revoked(struct testfs_journal *j, u32 blocknr, u32 sequence)
+{
+	struct revoke_entry *re = NULL;
+
+	hash_for_each_possible(j->revoked, re, node, blocknr) {
+		if (re->blocknr == blocknr) {
+			if (seq_geq(sequence, re->sequence))
+				re->sequence = sequence;
+			return 0;
+		}
+	}
+
+	re = kmalloc(sizeof(*re), GFP_KERNEL);
+	if (!re)
+		return -ENOMEM;
+
+	re->blocknr 	= blocknr;
+	re->sequence 	= sequence;
+	hash_add(j->revoked, &re->node, blocknr);
+
+	return 0;
+}
+
+
+/*
+ * returns 1 if the copy of blocknr logged by transaction sequence is
+ * revoked by it or a later transaction
+ */
+static int is_revoked(struct testfs_journal *j, u32 blocknr, u32 sequence)
+{
+	struct revoke_entry *re = NULL;
+
+	hash_for_each_possible(j->revoked, re, node, blocknr) {
+		if (re->blocknr == blocknr)
+			return seq_geq(re->sequence, sequence);
+	}
+
+	return 0;
+}
+
+
+static void free_revoked(struct testfs_journal *j)
+{
+	struct revoke_entry *re	= NULL;
+	struct hlist_node *tmp	= NULL;
+	int bkt;
+
+	hash_for_each_safe(j->revoked, bkt, tmp, re, node) {
+		hash_del(&re->node);
+		kfree(re);
+	}
+}
+
+
+/*
+ * walks the transaction starting at log block pos. Returns 1 if it is
+ * complete, in which case *end is the log block following it, and 0 if it
+ * is not. What else is done depends on pass, one of SCAN_*
+ */
+static int scan_transaction(struct super_block *sb, u32 pos, u32 sequence, int pass, u32 *end)
+{
+	struct testfs_journal *j 		= get_journal(sb);
+	struct testfs_journal_header *h		= NULL;
+	struct testfs_journal_desc *desc	= NULL;
+	struct testfs_journal_revoke *revoke	= NULL;
+	struct buffer_head *bh			= NULL;
+	struct buffer_head *data_bh		= NULL;
+	struct buffer_head *home_bh		= NULL;
+	u32 i, type, count, visited		= 0;
+	int err;
+
+	while (visited < log_size(j)) {
+		if (!(bh = sb_bread(sb, j->start + pos))) {
+			printk(KERN_ERR "testfs: error reading journal block %u\n", pos);
+			return -EIO;
+		}
+
+		h = (struct testfs_journal_header *)bh->b_data;
+		if (le32_to_cpu(h->h_magic) != TESTFS_JOURNAL_MAGIC ||
+		    le32_to_cpu(h->h_sequence) != sequence) {
+			brelse(bh);
+			return 0;
+		}
+
+		pos = log_next(j, pos);
+		visited++;
+
+		type = le32_to_cpu(h->h_type);
+
+		if (type == TESTFS_JOURNAL_COMMIT) {
+			brelse(bh);
+			*end = pos;
+			return 1;
+		}
+
+		if (type == TESTFS_JOURNAL_REVOKE) {
+			revoke 	= (struct testfs_journal_revoke *)bh->b_data;
+			count 	= le32_to_cpu(revoke->r_count);
+
+			if (count > tags_per_desc(sb)) {
+				brelse(bh);
+				return 0;
+			}
+
+			for (i = 0; pass == SCAN_REVOKE && i < count; i++) {
+				err = add_revoked(j, le32_to_cpu(revoke->r_blocks[i]), sequence);
+				if (err) {
+					brelse(bh);
+					return err;
+				}
+			}
+
+			/* no copies follow a revoke block */
+			brelse(bh);
+			continue;
+		}
+
+		desc  = (struct testfs_journal_desc *)bh->b_data;
+		count = le32_to_cpu(desc->d_count);
+
+		if (type != TESTFS_JOURNAL_DESC || count > tags_per_desc(sb)) {
+			brelse(bh);
+			return 0;
+		}
+
+		for (i = 0; i < count; i++) {
+			if (pass == SCAN_REPLAY &&
+			    !is_revoked(j, le32_to_cpu(desc->d_blocks[i]), sequence)) {
+				data_bh = sb_bread(sb, j->start + pos);
+				home_bh = sb_getblk(sb, le32_to_cpu(desc->d_blocks[i]));
+
+				if (!data_bh || !home_bh) {
+					printk(KERN_ERR "testfs: error replaying journal block %u\n", pos);
+					brelse(data_bh);
+					brelse(home_bh);
+					brelse(bh);
+					return -EIO;
+				}
+
+				lock_buffer(home_bh);
+				memcpy(home_bh->b_data, data_bh->b_data, sb->s_blocksize);
+				set_buffer_uptodate(home_bh);
+				unlock_buffer(home_bh);
+				mark_buffer_dirty(home_bh);
+
+				brelse(home_bh);
+				brelse(data_bh);
+			}
+
+			pos = log_next(j, pos);
+		}
+
+		visited += count;
+		brelse(bh);
+	}
+
+	return 0;
+}
+
+
+/*
+ * reads the journal described by the superblock and replays whatever was
+ * committed but never checkpointed. A read-only mount leaves the device
+ * alone: it is refused if the journal needs replaying, unless recovery is
+ * set and the device is writable
+ */
+int testfs_journal_load(struct super_block *sb, int recovery)
+{
+	struct testfs_superblock *testfs_sb	= TESTFS_GET_SB(sb);
+	struct testfs_info *testfs_i		= TESTFS_GET_SB_INFO(sb);
+	struct testfs_journal *j		= NULL;
+	struct testfs_journal_super *js		= NULL;
+	u32 pos, end, sequence;
+	int i, replayed				= 0;
+	int ret					= 0;
+
+	if (!testfs_sb->journal_blocks) {
+		printk(KERN_INFO "testfs: no journal, metadata is written in place\n");
+		return 0;
+	}
+
+	j = kmalloc(sizeof(*j), GFP_KERNEL);
+	if (!j) {
+		printk(KERN_ERR "testfs: failed to allocate journal memory\n");
+		return -ENOMEM;
+	}
+	memset(j, 0x00, sizeof(*j));
+	hash_init(j->checkpoint);
+	hash_init(j->revoked);
+
+	j->start 	= le32_to_cpu(testfs_sb->journal_block);
+	j->blocks 	= le32_to_cpu(testfs_sb->journal_blocks);
+
+	if (!(j->sb_bh = sb_bread(sb, j->start))) {
+		printk(KERN_ERR "testfs: unable to read the journal superblock\n");
+		kfree(j);
+		return -EIO;
+	}
+
+	js = (struct testfs_journal_super *)j->sb_bh->b_data;
+	j->first = le32_to_cpu(js->s_first);
+
+	if (le32_to_cpu(js->s_header.h_magic) != TESTFS_JOURNAL_MAGIC ||
+	    le32_to_cpu(js->s_header.h_type) != TESTFS_JOURNAL_SUPER ||
+	    le32_to_cpu(js->s_blocks) != j->blocks ||
+	    j->first < 1 || j->first + 2 >= j->blocks) {
+		printk(KERN_ERR "testfs: invalid journal superblock\n");
+		ret = -EINVAL;
+		goto err;
+	}
+
+	testfs_i->journal 	= j;
+	sequence 		= le32_to_cpu(js->s_sequence);
+
+	if (js->s_start && (sb->s_flags & MS_RDONLY)) {
+		if (bdev_read_only(sb->s_bdev)) {
+			printk(KERN_ERR "testfs: journal needs recovery but the device is read-only\n");
+			ret = -EROFS;
+			goto err;
+		}
+
+		if (!recovery) {
+			printk(KERN_ERR "testfs: journal needs recovery, mount read-write or with the recovery option\n");
+			ret = -EROFS;
+			goto err;
+		}
+	}
+
+	if (js->s_start) {
+		pos = le32_to_cpu(js->s_start);
+
+		/* a revoke covers copies logged before it, so gather them all first */
+		while ((ret = scan_transaction(sb, pos, sequence + replayed, SCAN_CHECK, &end)) > 0) {
+			ret = scan_transaction(sb, pos, sequence + replayed, SCAN_REVOKE, &end);
+			if (ret < 0)
+				break;
+
+			pos = end;
+			replayed++;
+		}
+
+		if (ret < 0)
+			goto err;
+
+		pos = le32_to_cpu(js->s_start);
+
+		for (i = 0; i < replayed; i++) {
+			ret = scan_transaction(sb, pos, sequence, SCAN_REPLAY, &end);
+			if (ret < 0)
+				goto err;
+
+			pos = end;
+			sequence++;
+		}
+
+		free_revoked(j);
+
+		if (replayed) {
+			ret = sync_blockdev(sb->s_bdev);
+			if (ret)
+				goto err;
+			printk(KERN_INFO "testfs: replayed %d transactions from the journal\n", replayed);
+		}
+	}
+
+	j->head 	= j->first;
+	j->tail 	= j->first;
+	j->sequence 	= sequence;
+
+	if (!(sb->s_flags & MS_RDONLY))
+		ret = testfs_journal_start(sb);
+	else if (js->s_start)
+		ret = update_super(sb, 0, sequence);	/* replayed, nothing is left to do */
+
+	if (ret)
+		goto err;
+
+	return 0;
+
+err:
+	free_revoked(j);
+	testfs_i->journal = NULL;
+	brelse(j->sb_bh);
+	kfree(j);
+	return ret;
+}
+
+
+/*
+ * marks the journal in use until it is stopped, which happens at the next
+ * clean unmount or read-only remount
+ */
+int testfs_journal_start(struct super_block *sb)
+{
+	struct testfs_journal *j = get_journal(sb);
+
+	if (!j)
+		return 0;
+
+	return update_super(sb, j->tail, j->sequence);
+}
+
+
+/*
+ * checkpoints everything and marks the journal clean
+ */
+int testfs_journal_stop(struct super_block *sb)
+{
+	struct testfs_journal *j = get_journal(sb);
+	int err;
+
+	if (!j)
+		return 0;
+
+	err = testfs_journal_checkpoint(sb, 0);
+	if (err)
+		return err;
+
+	return update_super(sb, 0, j->sequence);
+}
+
+
+void testfs_journal_release(struct super_block *sb)
+{
+	struct testfs_journal *j = get_journal(sb);
+
+	if (!j)
+		return;
+
+	/* a read-only journal was never started */
+	if (!(sb->s_flags & MS_RDONLY))
+		testfs_journal_stop(sb);
+
+	brelse(j->sb_bh);
+	kfree(j);
+	TESTFS_GET_SB_INFO(sb)->journal = NULL;
+}
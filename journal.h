@@ -0,0 +1,82 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <linux/fs.h>
+#include <linux/hashtable.h>
+
+#include "commit.h"
+
+#define TESTFS_JOURNAL_MAGIC	0x7E57CAFE
+
+/* Type of a journal block */
+enum {
+	TESTFS_JOURNAL_SUPER = 1,
+	TESTFS_JOURNAL_DESC,
+	TESTFS_JOURNAL_COMMIT,
+	TESTFS_JOURNAL_REVOKE
+};
+
+struct testfs_journal_header {
+	__le32 h_magic;		/* TESTFS_JOURNAL_MAGIC */
+	__le32 h_type;		/* Type of the block */
+	__le32 h_sequence;	/* Transaction the block belongs to */
+	__le32 h_reserved;
+};
+
+/* First block of the journal */
+struct testfs_journal_super {
+	struct testfs_journal_header s_header;
+	__le32 s_blocks;	/* Journal length in blocks, this one included */
+	__le32 s_first;		/* First log block */
+	__le32 s_start;		/* Log block of the oldest transaction to replay, 0 if none */
+	__le32 s_sequence;	/* Sequence number of that transaction */
+};
+
+/*
+ * Precedes the copies of the metadata blocks logged by a transaction. Large
+ * transactions use several descriptors; the last copy is followed by a
+ * commit block, which is nothing but a header.
+ */
+struct testfs_journal_desc {
+	struct testfs_journal_header d_header;
+	__le32 d_count;		/* Number of copies following the descriptor */
+	__le32 d_blocks[0];	/* Home location of each copy */
+};
+
+/*
+ * Blocks freed by a transaction, written after its copies. A block may hold
+ * file data once the transaction is on disk, so no copy of it logged by
+ * this transaction or an earlier one is replayed.
+ */
+struct testfs_journal_revoke {
+	struct testfs_journal_header r_header;
+	__le32 r_count;		/* Number of blocks */
+	__le32 r_blocks[0];	/* Home location of each */
+};
+
+/* In-memory journal state */
+struct testfs_journal {
+	u32 start;				/* Block number of the journal superblock */
+	u32 first;				/* First log block */
+	u32 blocks;				/* Journal length */
+	u32 head;				/* Next log block to write */
+	u32 tail;				/* Oldest log block still needed */
+	u32 sequence;				/* Sequence of the next transaction */
+	struct buffer_head *sb_bh;		/* Journal superblock */
+	DECLARE_HASHTABLE(checkpoint, 8);	/* Logged blocks not yet written home */
+	unsigned long nr_checkpoint;
+	u32 *revoke;				/* Blocks the transaction being logged revokes */
+	u32 nr_revoke;
+	DECLARE_HASHTABLE(revoked, 8);		/* Revoked blocks found by replay */
+};
+
+int testfs_journal_load(struct super_block *sb, int recovery);
+int testfs_journal_start(struct super_block *sb);
+int testfs_journal_stop(struct super_block *sb);
+void testfs_journal_release(struct super_block *sb);
+
+int testfs_journal_copy(struct super_block *sb, struct testfs_transaction *t);
+int testfs_journal_write(struct super_block *sb, struct testfs_transaction *t);
+int testfs_journal_checkpoint(struct super_block *sb, int lazy);
+
+#endif /* JOURNAL_H */
@@ -1,10 +1,17 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
+#include <linux/log2.h>
+#include <linux/parser.h>
 #include <linux/slab.h>
+#include <linux/statfs.h>
 
 #include "testfs.h"
 #include "super.h"
 #include "inode.h"
+#include "dir.h"
+#include "commit.h"
+#include "journal.h"
+#include "itable.h"
 
 
 // fill super
@@ -12,12 +19,32 @@ static int fill_super(struct super_block *sb, void *data, int silent);
 
 // super operations
 static void put_super(struct super_block *sb);
+static int sync_fs(struct super_block *sb, int wait);
+static int remount_fs(struct super_block *sb, int *flags, char *data);
+static int statfs(struct dentry *dentry, struct kstatfs *buf);
 
 static struct super_operations testfs_super_ops = {
+	.alloc_inode	= inode_alloc_inode,
+	.destroy_inode	= inode_destroy_inode,
+	.evict_inode	= inode_evict_inode,
 	.put_super 	= put_super,
+	.sync_fs	= sync_fs,
+	.remount_fs	= remount_fs,
+	.statfs		= statfs,
+	.dirty_inode	= inode_dirty_inode,
 	.write_inode	= inode_write_inode
 };
 
+enum {
+	Opt_commit, Opt_recovery, Opt_err
+};
+
+static const match_table_t tokens = {
+	{Opt_commit,	"commit=%u"},
+	{Opt_recovery,	"recovery"},
+	{Opt_err,	NULL}
+};
+
 
 struct dentry *super_mount(struct file_system_type *fs_type,
 	int flags, const char *dev_name, void *data)
@@ -27,6 +54,112 @@ struct dentry *super_mount(struct file_system_type *fs_type,
 }
 
 
+/*
+ * parses the mount options: commit=<seconds>, and recovery to replay the
+ * journal on a read-only mount
+ */
+static int parse_options(char *options, unsigned int *commit_interval, int *recovery)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int option;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, tokens, args)) {
+		case Opt_commit:
+			if (match_int(&args[0], &option) || option <= 0) {
+				printk(KERN_ERR "testfs: invalid commit interval\n");
+				return -EINVAL;
+			}
+			*commit_interval = option;
+			break;
+		case Opt_recovery:
+			*recovery = 1;
+			break;
+		default:
+			printk(KERN_ERR "testfs: unrecognized mount option \"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * block holding descriptor block i: a table right after the superblock
+ * with flex groups, the second block of group i otherwise
+ */
+static unsigned long desc_block(struct super_block *sb, unsigned long i)
+{
+	struct testfs_superblock *testfs_sb = TESTFS_GET_SB(sb);
+
+	if (testfs_sb->feature_incompat & TESTFS_FEATURE_INCOMPAT_FLEX_BG)
+		return TESTFS_SUPER_BLOCK_NUM + 1 + i;
+
+	return (unsigned long)testfs_sb->blocks_per_group * i + 1;
+}
+
+
+/*
+ * reads the group descriptors. All of their blocks are requested before
+ * waiting for the first one, so a table goes in a few large reads
+ */
+static int read_group_descs(struct super_block *sb)
+{
+	struct testfs_info *testfs_i 	= TESTFS_GET_SB_INFO(sb);
+	struct testfs_superblock *testfs_sb = testfs_i->sb;
+	unsigned long i;
+
+	if (testfs_sb->feature_incompat & TESTFS_FEATURE_INCOMPAT_FLEX_BG)
+		testfs_i->desc_per_block = sb->s_blocksize / sizeof(struct testfs_group_desc);
+	else
+		testfs_i->desc_per_block = 1;
+	testfs_i->desc_blocks = DIV_ROUND_UP(testfs_sb->group_count, testfs_i->desc_per_block);
+
+	testfs_i->group_desc_bh = kzalloc(testfs_i->desc_blocks * sizeof(struct buffer_head *), GFP_KERNEL);
+	if (!testfs_i->group_desc_bh) {
+		printk(KERN_ERR "testfs: error allocating memory for group descriptor table!\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < testfs_i->desc_blocks; i++)
+		sb_breadahead(sb, desc_block(sb, i));
+
+	for (i = 0; i < testfs_i->desc_blocks; i++) {
+		testfs_i->group_desc_bh[i] = sb_bread(sb, desc_block(sb, i));
+		if (!testfs_i->group_desc_bh[i]) {
+			printk(KERN_ERR "testfs: error reading group descriptor!\n");
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+
+static void release_group_descs(struct super_block *sb)
+{
+	struct testfs_info *testfs_i = TESTFS_GET_SB_INFO(sb);
+	unsigned long i;
+
+	if (!testfs_i->group_desc_bh)
+		return;
+
+	for (i = 0; i < testfs_i->desc_blocks; i++)
+		brelse(testfs_i->group_desc_bh[i]);
+
+	kfree(testfs_i->group_desc_bh);
+	testfs_i->group_desc_bh = NULL;
+}
+
+
 static int fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct buffer_head *bh 		= NULL;
@@ -34,8 +167,8 @@ static int fill_super(struct super_block *sb, void *data, int silent)
 	struct testfs_superblock *testfs_sb = NULL;
 	struct testfs_info *testfs_i 	= NULL;
 	int ret 			= -1;
-	int i, j 			= 0;	
-	unsigned long desc_block 	= 0;
+	unsigned int commit_interval	= TESTFS_DEFAULT_COMMIT_INTERVAL;
+	int recovery			= 0;
 
     	if (!(bh = sb_bread(sb, TESTFS_SUPER_BLOCK_NUM)))
 	{
@@ -66,37 +199,86 @@ static int fill_super(struct super_block *sb, void *data, int silent)
 		goto err;
 	}
 
+	if (!(testfs_sb->feature_incompat & TESTFS_FEATURE_INCOMPAT_DIRENT)) {
+		printk(KERN_ERR "testfs: old directory format, reformat the device\n");
+		goto err;
+	}
+
+	if (testfs_sb->feature_incompat & ~TESTFS_FEATURE_INCOMPAT_SUPP) {
+		printk(KERN_ERR "testfs: unsupported features 0x%x\n",
+			testfs_sb->feature_incompat & ~TESTFS_FEATURE_INCOMPAT_SUPP);
+		goto err;
+	}
+
+	if (parse_options(data, &commit_interval, &recovery)) {
+		ret = -EINVAL;
+		goto err;
+	}
+
+	/* directory entry lengths are 16 bit, a 64K block is out of their reach */
+	if (testfs_sb->block_size > TESTFS_MAX_BLOCK_SIZE ||
+	    !sb_set_blocksize(sb, testfs_sb->block_size)) {
+		printk(KERN_ERR "testfs: unsupported block size %u\n", testfs_sb->block_size);
+		ret = -EINVAL;
+		goto err;
+	}
+
+	if (!testfs_sb->blocks_per_group || !testfs_sb->inodes_per_group ||
+	    testfs_sb->inodes_per_group > testfs_sb->block_size * 8) {
+		printk(KERN_ERR "testfs: invalid group geometry\n");
+		ret = -EINVAL;
+		goto err;
+	}
+
+	testfs_i->inode_size = sizeof(struct testfs_inode);
+	if (testfs_sb->feature_incompat & TESTFS_FEATURE_INCOMPAT_INLINE_DATA)
+		testfs_i->inode_size = testfs_sb->inode_size;
+
+	/* an inode must not straddle two blocks of the table */
+	if (testfs_i->inode_size < sizeof(struct testfs_inode) || testfs_i->inode_size > sb->s_blocksize ||
+	    !is_power_of_2(testfs_i->inode_size)) {
+		printk(KERN_ERR "testfs: unsupported inode size %lu\n", testfs_i->inode_size);
+		ret = -EINVAL;
+		goto err;
+	}
+
+	/* the superblock sits at the start of block 0 whatever its size */
+	brelse(bh);
+	if (!(bh = sb_bread(sb, TESTFS_SUPER_BLOCK_NUM))) {
+		printk(KERN_ERR "testfs: unable to read superblock.\n");
+		goto err;
+	}
+
 	testfs_i->sb		= testfs_sb;
 	testfs_i->bh		= bh;
 
 	sb->s_fs_info		= testfs_i;
-	sb->s_blocksize 	= testfs_sb->block_size;
-	sb->s_blocksize_bits 	= 12;  // hardcode... block size = 1 << blkbits, 4096 = 1 << blkbits, 4096 = 1 << 12
 	sb->s_magic		= TESTFS_MAGIC_NUM;
 	sb->s_op		= &testfs_super_ops;
 
-	testfs_i->group_desc_bh = kmalloc(testfs_sb->group_count * sizeof(struct buffer_head *), GFP_KERNEL);
-        if (!testfs_i->group_desc_bh) {
-                printk(KERN_ERR "testfs: error allocating memory for group descriptor table!\n");
-                goto err;
-        }
-
-	for (i=0; i<testfs_sb->group_count; i++)
-        {
-                desc_block = (testfs_sb->blocks_per_group * i) + 1;
-                testfs_i->group_desc_bh[i] = sb_bread(sb, desc_block);
-                if (!testfs_i->group_desc_bh[i]) {
-                        for (j=0; j<i; j++)
-                                brelse(testfs_i->group_desc_bh[j]);
-                        printk(KERN_ERR "testfs: error reading group descriptor!\n");
-                        kfree(testfs_i->group_desc_bh);
-                        goto err;
-                }
-        }
+	if (testfs_journal_load(sb, recovery))
+		goto err;
+
+	if (read_group_descs(sb))
+		goto err;
+
+	/* on its way while the groups are checked */
+	sb_breadahead(sb, inode_table_block(sb, TESTFS_ROOT_INODE_NUM));
+
+	if (testfs_balloc_init(sb))
+		goto err;
+
+	if (testfs_commit_init(sb, commit_interval))
+		goto err;
+
+	if (!(sb->s_flags & MS_RDONLY) && testfs_itable_start(sb))
+		goto err;
 
 	root = inode_iget(sb, TESTFS_ROOT_INODE_NUM);
-	if (!root) {
+	if (IS_ERR(root)) {
 		printk(KERN_ERR "testfs: inode_iget failed in fill_super!\n");
+		ret 	= PTR_ERR(root);
+		root 	= NULL;
 		goto err;
 	}
 	testfs_i->root = root;
@@ -113,6 +295,13 @@ err:
 	if (root)
         	iput(root);
 	if (testfs_i) {
+		if (sb->s_fs_info) {
+			testfs_itable_stop(sb);
+			testfs_commit_destroy(sb);
+			testfs_journal_release(sb);
+			testfs_balloc_destroy(sb);
+			release_group_descs(sb);
+		}
 		//if (testfs_i->block_bmp_bh)
 		//	brelse(testfs_i->block_bmp_bh);
 		//if (testfs_i->inode_bmp_bh)
@@ -135,6 +324,12 @@ static void put_super (struct super_block *sb)
 	if (sb->s_fs_info) {
 		testfs_i = sb->s_fs_info;
 
+		testfs_itable_stop(sb);
+		testfs_commit_destroy(sb);
+		testfs_journal_release(sb);
+		testfs_balloc_destroy(sb);
+		release_group_descs(sb);
+
 		if (testfs_i->sb) {
 			kfree(testfs_i->sb);
 		}
@@ -150,3 +345,91 @@ static void put_super (struct super_block *sb)
 }
 
 
+static int sync_fs(struct super_block *sb, int wait)
+{
+	if (!wait)
+		return 0;
+
+	return testfs_commit_wait(sb);
+}
+
+
+/*
+ * switches between read-only and read-write. The VFS has synced everything
+ * before a read-only remount. Other options only take effect at mount
+ */
+static int remount_fs(struct super_block *sb, int *flags, char *data)
+{
+	unsigned int commit_interval	= TESTFS_DEFAULT_COMMIT_INTERVAL;
+	int recovery			= 0;
+	int err;
+
+	if (parse_options(data, &commit_interval, &recovery))
+		return -EINVAL;
+
+	if ((*flags & MS_RDONLY) == (sb->s_flags & MS_RDONLY))
+		return 0;
+
+	if (*flags & MS_RDONLY) {
+		testfs_itable_stop(sb);
+		testfs_commit_destroy(sb);
+
+		err = testfs_journal_stop(sb);
+		if (err) {
+			/* stays read-write */
+			testfs_commit_start(sb);
+			testfs_itable_start(sb);
+		}
+
+		return err;
+	}
+
+	err = testfs_journal_start(sb);
+	if (err)
+		return err;
+
+	err = testfs_commit_start(sb);
+	if (err)
+		goto err;
+
+	err = testfs_itable_start(sb);
+	if (err) {
+		testfs_commit_destroy(sb);
+		goto err;
+	}
+
+	return 0;
+
+err:
+	testfs_journal_stop(sb);
+	return err;
+}
+
+
+/*
+ * the free counts are kept up to date by the allocators, nothing is scanned
+ */
+static int statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb 		= dentry->d_sb;
+	struct testfs_info *testfs_i	= TESTFS_GET_SB_INFO(sb);
+	struct testfs_superblock *testfs_sb = testfs_i->sb;
+	u64 id 				= huge_encode_dev(sb->s_bdev->bd_dev);
+	s64 dirty;
+
+	buf->f_type 	= TESTFS_MAGIC_NUM;
+	buf->f_bsize 	= sb->s_blocksize;
+	buf->f_blocks 	= (u64)testfs_sb->group_count * testfs_sb->blocks_per_group;
+	/* blocks promised to delayed allocations are as good as taken */
+	buf->f_bfree 	= percpu_counter_sum_positive(&testfs_i->free_blocks);
+	dirty 		= percpu_counter_sum_positive(&testfs_i->dirty_blocks);
+	buf->f_bfree 	= buf->f_bfree > dirty ? buf->f_bfree - dirty : 0;
+	buf->f_bavail 	= buf->f_bfree;
+	buf->f_files 	= (u64)testfs_sb->group_count * testfs_sb->inodes_per_group;
+	buf->f_ffree 	= percpu_counter_sum_positive(&testfs_i->free_inodes);
+	buf->f_namelen 	= TESTFS_NAME_LEN;
+	buf->f_fsid.val[0] = (u32)id;
+	buf->f_fsid.val[1] = (u32)(id >> 32);
+
+	return 0;
+}
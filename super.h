@@ -2,6 +2,12 @@
 #define SUPER_H
 
 #include <linux/fs.h>
+#include <linux/percpu_counter.h>
+
+#include "balloc.h"
+#include "commit.h"
+
+struct testfs_journal;
 
 /* Testfs superblock read from disk */
 struct testfs_superblock {
@@ -16,14 +22,57 @@ struct testfs_superblock {
 	//__le32 block_bitmap;	/* Location of block usage bitmap */
 	//__le32 inode_bitmap;	/* Location of inode bitmap */
 	__le32 rootdir_inode;	/* Inode number of the root directory */
+	__le32 journal_block;	/* First block of the journal */
+	__le32 journal_blocks;	/* Journal length in blocks, 0 if there is none */
+	__le32 feature_incompat;	/* Features an older driver cannot mount */
+	__le32 inode_size;	/* Bytes per inode table slot, with TESTFS_FEATURE_INCOMPAT_INLINE_DATA */
 };
 
+/* Directory entries have variable length (see dir.h) */
+#define TESTFS_FEATURE_INCOMPAT_DIRENT	0x0001
+
+/* Extents may be unwritten (see extent.h) */
+#define TESTFS_FEATURE_INCOMPAT_UNWRITTEN	0x0002
+
+/*
+ * The descriptors form one table right after the superblock, and the
+ * bitmaps and inode tables of a few groups are packed at the start of the
+ * first of them (see tools/format.c). Without it every group starts with
+ * its own superblock, descriptor, bitmaps and inode table
+ */
+#define TESTFS_FEATURE_INCOMPAT_FLEX_BG	0x0004
+
+/*
+ * Inodes take inode_size bytes in the table, and the bytes past struct
+ * testfs_inode hold the data of small files and directories (see
+ * inline.c). Without it an inode is just struct testfs_inode
+ */
+#define TESTFS_FEATURE_INCOMPAT_INLINE_DATA	0x0008
+
+#define TESTFS_FEATURE_INCOMPAT_SUPP	(TESTFS_FEATURE_INCOMPAT_DIRENT | \
+					 TESTFS_FEATURE_INCOMPAT_UNWRITTEN | \
+					 TESTFS_FEATURE_INCOMPAT_FLEX_BG | \
+					 TESTFS_FEATURE_INCOMPAT_INLINE_DATA)
+
 /* Testfs in-memory structure */
 struct testfs_info {
 	struct testfs_superblock *sb;		/* Pointer to on disk structure */
 	struct buffer_head *bh;			/* Pointer to sb buffer head */
 	struct inode *root;			/* Root directory inode */
-	struct buffer_head **group_desc_bh;
+	struct buffer_head **group_desc_bh;	/* Blocks holding the group descriptors */
+	unsigned long desc_per_block;		/* Descriptors in each of them */
+	unsigned long desc_blocks;		/* Number of them */
+	unsigned long inode_size;		/* Bytes per inode in the inode tables */
+	struct testfs_group_info *group_info;	/* In-memory state of each group */
+	struct percpu_counter free_blocks;	/* Sum of the free block counts of the groups */
+	struct percpu_counter free_inodes;	/* Sum of the free inode counts of the groups */
+	struct percpu_counter dirs;		/* Sum of the directory counts of the groups */
+	struct percpu_counter dirty_blocks;	/* Blocks reserved for delayed allocation */
+	struct percpu_counter window_blocks;	/* Free blocks set aside in windows, out of the free runs */
+	int __percpu *alloc_group;		/* Group each CPU starts looking at for a top level directory */
+	struct testfs_commit commit;		/* Metadata group commit */
+	struct testfs_journal *journal;		/* Metadata journal, NULL if none */
+	struct task_struct *itable_task;	/* Zeroes the inode tables mkfs left alone */
 //	char *block_bitmap;			/* Pointer to on disk block bitmap */
 //	char *inode_bitmap;			/* Pointer to on disk inode bitmap */
 //	struct buffer_head *block_bmp_bh;	/* Block bitmap buffer head */
@@ -4,13 +4,22 @@
 #define TESTFS_MAGIC_NUM  	0x1012F4DD
 #define TESTFS_SUPER_BLOCK_NUM	0
 #define TESTFS_ROOT_INODE_NUM   1
+#define TESTFS_MAX_BLOCK_SIZE	32768	/* Largest block a 16 bit rec_len spans */
 
 #define TESTFS_GET_BLOCK_SIZE(sb)	(sb->s_blocksize)
-#define TESTFS_GET_INODE(inode)		((struct testfs_inode *)inode->i_private)
+#define TESTFS_GET_INODE(inode)		container_of(inode, struct testfs_inode_info, vfs_inode)
 #define TESTFS_GET_SB_INFO(sb)		((struct testfs_info *)sb->s_fs_info)
 #define TESTFS_GET_SB(s)		((struct testfs_superblock *)TESTFS_GET_SB_INFO(s)->sb)
 
 #define TESTFS_INODES_PER_GROUP(sb)	(TESTFS_GET_SB(sb)->inodes_per_group)
 #define TESTFS_BLOCKS_PER_GROUP(sb)	(TESTFS_GET_SB(sb)->blocks_per_group)
+#define TESTFS_INODE_SIZE(sb)		(TESTFS_GET_SB_INFO(sb)->inode_size)
+
+/* Descriptor of a group, and the buffer holding it */
+#define TESTFS_GROUP_DESC_BH(sb, group)	\
+	(TESTFS_GET_SB_INFO(sb)->group_desc_bh[(group) / TESTFS_GET_SB_INFO(sb)->desc_per_block])
+#define TESTFS_GROUP_DESC(sb, group)	\
+	((struct testfs_group_desc *)TESTFS_GROUP_DESC_BH(sb, group)->b_data + \
+	 (group) % TESTFS_GET_SB_INFO(sb)->desc_per_block)
 
 #endif /* TESTFS_H */
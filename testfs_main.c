@@ -3,6 +3,7 @@
 #include <linux/fs.h>
 
 #include "super.h"
+#include "inode.h"
 
 
 MODULE_LICENSE("Dual BSD/GPL");
@@ -21,11 +22,18 @@ static int __init testfs_init(void)
 
 	printk(KERN_INFO "testfs: init...\n");
 
+	ret = inode_cache_init();
+	if (ret) {
+		printk(KERN_INFO "testfs: failed to create the inode cache\n");
+		return ret;
+	}
+
 	ret = register_filesystem(&testfs_type);
 	
 	if (ret)
 	{
 		printk(KERN_INFO "testfs: file system registration failed!\n");
+		inode_cache_destroy();
 		return -1;
 	}
 	
@@ -37,6 +45,7 @@ static int __init testfs_init(void)
 static void __exit testfs_exit(void)
 {
 	unregister_filesystem(&testfs_type);
+	inode_cache_destroy();
 	printk(KERN_INFO "testfs: exit...\n");
 }
 
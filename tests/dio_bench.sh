@@ -0,0 +1,26 @@
+#!/bin/bash
+# Runs a fio job file on a fresh testfs on a loop device, by default the
+# one comparing buffered and direct I/O; fio/aio_randread_qd32.fio is the
+# asynchronous random read one. The page cache is dropped once after
+# mounting, between the jobs fio's invalidate option takes care of it.
+#
+# usage: dio_bench.sh <format binary> [image size in MB] [job file]
+FORMAT=${1:-../tools/format}
+SIZE=${2:-1024}
+JOBS=${3:-`dirname $0`/fio/buffered_vs_direct.fio}
+IMG=/tmp/testfs_dio.img
+MNT=/mnt/testfs_dio
+
+dd if=/dev/zero of=$IMG bs=1M count=$SIZE 2>/dev/null
+LOOP=`losetup -f --show $IMG`
+$FORMAT $LOOP > /dev/null
+
+mkdir -p $MNT
+mount -t testfs $LOOP $MNT || exit 1
+echo 3 > /proc/sys/vm/drop_caches
+
+DIR=$MNT fio $JOBS
+
+umount $MNT
+losetup -d $LOOP
+rm -f $IMG
@@ -0,0 +1,55 @@
+#!/bin/bash
+# Fills a directory with 100k empty files and measures how fast it can be
+# listed with getdents64, once with a large buffer and once with a small
+# one, which makes every call resume where the previous one stopped.
+#
+# usage: getdents_bench.sh <mount point> [entries]
+MNT=${1:-/mnt/testfs}
+ENTRIES=${2:-100000}
+DIR=$MNT/getdents
+
+rm -rf $DIR
+mkdir $DIR
+for i in `seq 1 $ENTRIES`; do
+	echo -n > $DIR/entry_with_a_somewhat_longer_name_$i
+done
+sync
+
+list()
+{
+	python3 - $DIR $1 <<'PY'
+import ctypes, os, sys, time
+
+SYS_getdents64 = 217
+libc = ctypes.CDLL(None, use_errno=True)
+buf = ctypes.create_string_buffer(int(sys.argv[2]))
+fd = os.open(sys.argv[1], os.O_RDONLY | os.O_DIRECTORY)
+
+entries = calls = 0
+start = time.time()
+while True:
+	n = libc.syscall(SYS_getdents64, fd, buf, len(buf))
+	if n < 0:
+		sys.exit("getdents64: " + os.strerror(ctypes.get_errno()))
+	if n == 0:
+		break
+	calls += 1
+	off = 0
+	while off < n:
+		off += int.from_bytes(buf.raw[off + 16:off + 18], "little")
+		entries += 1
+elapsed = time.time() - start
+os.close(fd)
+
+print("%6d byte buffer: %d entries, %d calls, %.0f entries/s" %
+      (len(buf), entries, calls, entries / elapsed))
+PY
+}
+
+# cold cache first, then warm
+echo 3 > /proc/sys/vm/drop_caches
+list 32768
+list 32768
+list 1024
+
+rm -rf $DIR
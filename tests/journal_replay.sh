@@ -0,0 +1,39 @@
+#!/bin/bash
+# Measures how long mounting takes when the journal has to be replayed.
+# Builds up committed but not checkpointed transactions, snapshots the
+# device as if the machine had crashed, then times the mount of the copy.
+#
+# usage: journal_replay.sh <format binary> [transactions]
+FORMAT=${1:-../tools/format}
+TRANS=${2:-200}
+IMG=/tmp/testfs_replay.img
+CRASH=/tmp/testfs_crash.img
+MNT=/mnt/testfs_replay
+
+dd if=/dev/zero of=$IMG bs=1M count=200 2>/dev/null
+LOOP=`losetup -f --show $IMG`
+$FORMAT $LOOP > /dev/null
+
+mkdir -p $MNT
+mount -t testfs -o commit=3600 $LOOP $MNT || exit 1
+
+# every sync is one transaction in the log
+for i in `seq 1 $TRANS`; do
+	mkdir $MNT/d$i
+	for j in `seq 1 5`; do
+		mkdir $MNT/d$i/s$j
+	done
+	sync
+done
+
+dd if=$LOOP of=$CRASH bs=1M 2>/dev/null
+umount $MNT
+losetup -d $LOOP
+
+LOOP=`losetup -f --show $CRASH`
+time mount -t testfs $LOOP $MNT
+dmesg | grep "testfs: replayed" | tail -1
+
+umount $MNT
+losetup -d $LOOP
+rm -f $IMG $CRASH
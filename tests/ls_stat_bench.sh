@@ -0,0 +1,40 @@
+#!/bin/bash
+# Creates a directory of small files and times a cold cache ls -l and
+# find -ls on it, which look up and stat every entry. Run it once on the
+# old module and once on the new one to compare.
+#
+# usage: ls_stat_bench.sh <mount point> [files]
+MNT=${1:-/mnt/testfs}
+FILES=${2:-5000}
+DIR=$MNT/lsstat
+
+rm -rf $DIR
+mkdir $DIR
+for i in `seq 1 $FILES`; do
+	echo $i > $DIR/f$i
+done
+sync
+
+cold()
+{
+	# the dentries and inodes have to go as well, remount
+	umount $MNT
+	echo 3 > /proc/sys/vm/drop_caches
+	mount -t testfs $DEV $MNT
+}
+
+DEV=`awk -v m=$MNT '$2 == m { print $1 }' /proc/mounts`
+
+cold
+START=`date +%s.%N`
+ls -l $DIR > /dev/null
+END=`date +%s.%N`
+echo "ls -l, $FILES files: `echo "$END - $START" | bc` s"
+
+cold
+START=`date +%s.%N`
+find $DIR -ls > /dev/null
+END=`date +%s.%N`
+echo "find -ls, $FILES files: `echo "$END - $START" | bc` s"
+
+rm -rf $DIR
@@ -0,0 +1,47 @@
+#!/bin/bash
+# Measures how long mounting a large filesystem takes with a cold cache.
+# Formats a sparse image with thousands of groups, uses some of them so
+# their bitmaps are initialized, then times a number of mounts, dropping
+# the caches before each one.
+#
+# usage: mount_bench.sh <format binary> [image size in GB] [mounts] [format options]
+FORMAT=${1:-../tools/format}
+SIZE=${2:-1024}
+MOUNTS=${3:-5}
+OPTIONS=$4
+IMG=/tmp/testfs_mount.img
+MNT=/mnt/testfs_mount
+
+rm -f $IMG
+truncate -s ${SIZE}G $IMG
+LOOP=`losetup -f --show $IMG`
+$FORMAT $OPTIONS $LOOP || exit 1
+
+mkdir -p $MNT
+mount -t testfs $LOOP $MNT || exit 1
+
+# top level directories are spread over the groups
+for i in `seq 1 256`; do
+	mkdir $MNT/d$i
+	echo -n data > $MNT/d$i/f
+done
+umount $MNT
+
+total=0
+for i in `seq 1 $MOUNTS`; do
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+
+	start=`date +%s%N`
+	mount -t testfs $LOOP $MNT || exit 1
+	end=`date +%s%N`
+	umount $MNT
+
+	ms=$(( (end - start) / 1000000 ))
+	total=$(( total + ms ))
+	echo "mount $i: ${ms} ms"
+done
+echo "average: $(( total / MOUNTS )) ms"
+
+losetup -d $LOOP
+rm -f $IMG
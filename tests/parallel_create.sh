@@ -0,0 +1,37 @@
+#!/bin/bash
+# Creates and writes files from a growing number of parallel workers, each
+# in its own directory, and prints the throughput for every worker count.
+# Allocations should scale close to linearly as long as there are enough
+# groups for every CPU.
+#
+# usage: parallel_create.sh <mount point> [files per worker] [max workers]
+MNT=${1:-/mnt/testfs}
+FILES=${2:-1000}
+MAX=${3:-16}
+
+create()
+{
+	mkdir $1
+	for i in `seq 1 $FILES`; do
+		head -c 4096 /dev/zero > $1/f$i
+	done
+}
+
+WORKERS=1
+while [ $WORKERS -le $MAX ]; do
+	rm -rf $MNT/w*
+	sync
+
+	START=`date +%s.%N`
+	for w in `seq 1 $WORKERS`; do
+		create $MNT/w$w &
+	done
+	wait
+	sync
+	END=`date +%s.%N`
+
+	echo "$WORKERS workers: `echo "$WORKERS * $FILES / ($END - $START)" | bc` files/s"
+	WORKERS=$((WORKERS * 2))
+done
+
+rm -rf $MNT/w*
@@ -0,0 +1,67 @@
+#!/bin/bash
+# Measures what tiny files and directories cost: creates a tree of small
+# files, then reports the blocks in use and how long reading every file
+# back takes with a cold cache. Run it once with the default 256 byte
+# inodes, which keep such files inline, and once with -I 64 to compare.
+# Also checks that files growing out of their inode keep their data.
+#
+# usage: small_files_bench.sh <format binary> [directories] [files per directory] [format options]
+FORMAT=${1:-../tools/format}
+DIRS=${2:-100}
+FILES=${3:-100}
+OPTIONS=$4
+IMG=/tmp/testfs_small.img
+MNT=/mnt/testfs_small
+
+rm -f $IMG
+truncate -s 4G $IMG
+LOOP=`losetup -f --show $IMG`
+$FORMAT $OPTIONS $LOOP || exit 1
+
+mkdir -p $MNT
+mount -t testfs $LOOP $MNT || exit 1
+
+before=`df -k --output=used $MNT | tail -1`
+for d in `seq 1 $DIRS`; do
+	mkdir $MNT/d$d
+	for f in `seq 1 $FILES`; do
+		echo "file $f of directory $d" > $MNT/d$d/f$f
+	done
+done
+mkdir $MNT/empty
+sync
+after=`df -k --output=used $MNT | tail -1`
+echo "$DIRS directories, $(( DIRS * FILES )) files: $(( after - before )) KiB in use"
+
+umount $MNT
+echo 3 > /proc/sys/vm/drop_caches
+mount -t testfs $LOOP $MNT || exit 1
+
+start=`date +%s%N`
+cat $MNT/d*/f* > /dev/null
+end=`date +%s%N`
+echo "cold read of every file: $(( (end - start) / 1000000 )) ms"
+
+# grows out of the inode, through write and truncate
+err=0
+echo -n small > $MNT/grow
+head -c 8192 /dev/urandom > /tmp/testfs_small.data
+cat /tmp/testfs_small.data >> $MNT/grow
+truncate -s 100 $MNT/empty_grow
+truncate -s 10000 $MNT/empty_grow
+(echo -n small; cat /tmp/testfs_small.data) | cmp - $MNT/grow || err=1
+[ `stat -c %s $MNT/empty_grow` -eq 10000 ] || err=1
+[ "`cat $MNT/d1/f1`" = "file 1 of directory 1" ] || err=1
+ls $MNT/empty | grep -q . && err=1
+
+umount $MNT
+mount -t testfs $LOOP $MNT || exit 1
+(echo -n small; cat /tmp/testfs_small.data) | cmp - $MNT/grow || err=1
+[ `ls $MNT/d1 | wc -l` -eq $FILES ] || err=1
+umount $MNT
+
+[ $err -eq 0 ] && echo "contents: ok" || echo "contents: MISMATCH"
+
+losetup -d $LOOP
+rm -f $IMG /tmp/testfs_small.data
+exit $err
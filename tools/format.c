@@ -1,3 +1,6 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -5,25 +8,41 @@
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
 
-#define BLK_SIZE 		4096
-#define NUM_INODES		(BLK_SIZE * 8)
-#define ITABLE_SIZE		(NUM_INODES * sizeof(struct testfs_inode))
-#define ITABLE_NUM_BLKS 	(ITABLE_SIZE / BLK_SIZE)
-#define DATA_BLKS_SIZE		(BLK_SIZE * 8 * BLK_SIZE)
-#define BLK_GRP_SIZE 		((BLK_SIZE * 3) + ITABLE_SIZE + DATA_BLKS_SIZE)
-#define BLK_GRP_NUM_BLKS 	(BLK_GRP_SIZE / BLK_SIZE)
+#define MIN_BLK_SIZE		1024
+#define MAX_BLK_SIZE		32768	/* Largest block a 16 bit rec_len spans, as in the kernel */
+#define MAX_INODE_SIZE		1024
+#define IOV_BLKS		512	/* Blocks per pwritev() call, below IOV_MAX */
+#define JOURNAL_BLKS		1024
+#define ROOT_DIR_BLK		(journal_start + JOURNAL_BLKS)
 
 
 
 /* Commands :
  * $dd if=/dev/zero of=loopback.img bs=1024 count=204800
  * $losetup /dev/loop0 loopback.img
- * $format /dev/loop0
+ * $format [-b block-size] [-i bytes-per-inode] [-I inode-size] [-g blocks-per-group] [-G groups-per-flex] /dev/loop0
  */
 int fd;
 uint64_t disk_size = 0;
 
+/* Geometry, see set_geometry() */
+uint32_t blk_size = 4096;	/* Block size */
+uint32_t inode_size = 256;	/* Bytes per inode, what is past struct testfs_inode holds inline data */
+uint32_t num_inodes;		/* Inodes per group */
+uint32_t itable_blks;		/* Inode table blocks per group */
+uint32_t group_blks;		/* Blocks per group */
+uint32_t groups_per_flex = 16;	/* Groups whose bitmaps and inode tables are packed together */
+
+/* Layout, see set_layout() */
+uint32_t desc_blks;		/* Blocks of the descriptor table */
+uint32_t journal_start;		/* First data block of group 0 */
+
 struct testfs_superblock {
 	uint32_t magic;		/* Magic number */
 	uint32_t block_size;	/* Block size */
@@ -36,6 +55,33 @@ struct testfs_superblock {
 	//uint32_t block_bitmap;	/* Location of block usage bitmap */
 	//uint32_t inode_bitmap;	/* Location of inode bitmap */
 	uint32_t rootdir_inode;	/* Inode number of the root directory */
+	uint32_t journal_block;	/* First block of the journal */
+	uint32_t journal_blocks; /* Journal length in blocks, 0 if there is none */
+	uint32_t feature_incompat; /* Features an older driver cannot mount */
+	uint32_t inode_size;	/* Bytes per inode, with FEATURE_INCOMPAT_INLINE_DATA */
+};
+
+#define FEATURE_INCOMPAT_DIRENT	0x0001	/* Variable length directory entries */
+#define FEATURE_INCOMPAT_UNWRITTEN	0x0002	/* Extents may be unwritten */
+#define FEATURE_INCOMPAT_FLEX_BG	0x0004	/* Descriptor table and packed group metadata */
+#define FEATURE_INCOMPAT_INLINE_DATA	0x0008	/* Inodes larger than struct testfs_inode */
+
+#define JOURNAL_MAGIC		0x7E57CAFE
+#define JOURNAL_SUPER		1
+
+struct testfs_journal_header {
+	uint32_t h_magic;
+	uint32_t h_type;
+	uint32_t h_sequence;
+	uint32_t h_reserved;
+};
+
+struct testfs_journal_super {
+	struct testfs_journal_header s_header;
+	uint32_t s_blocks;	/* Journal length, including this block */
+	uint32_t s_first;	/* First block of the log */
+	uint32_t s_start;	/* Oldest transaction to replay, 0 if clean */
+	uint32_t s_sequence;	/* Sequence number of that transaction */
 };
 
 struct testfs_group_desc {
@@ -43,78 +89,170 @@ struct testfs_group_desc {
 	uint32_t inode_bitmap;
 	uint32_t inode_table;
 	uint32_t first_data_block;
+	uint32_t free_blocks_count;	/* Free data blocks */
+	uint32_t free_inodes_count;	/* Free inodes */
+	uint16_t flags;
+	uint16_t used_dirs_count;	/* Directories */
+	uint32_t reserved;		/* Pads the descriptors to 32 bytes */
+};
+
+#define BG_BLOCK_UNINIT		0x0001	/* Block bitmap not written, all blocks free */
+#define BG_INODE_UNINIT		0x0002	/* Inode bitmap not written, only inode 0 used */
+#define BG_ITABLE_UNINIT	0x0004	/* Inode table not zeroed, the kernel does it */
+
+#define INODE_EXTENTS		3
+
+struct testfs_extent {
+	uint32_t ee_block;	/* First logical block */
+	uint32_t ee_start;	/* First physical block */
+	uint16_t ee_len;	/* Number of blocks */
+	uint16_t ee_flags;
 };
 
 struct testfs_inode {
 	uint16_t i_mode;
-	uint16_t i_size;
+	uint16_t i_extent_count;
 	uint32_t group;
-	uint32_t block_ptr;
+	uint64_t i_size;
+	uint32_t i_extent_block;
+	struct testfs_extent i_extents[INODE_EXTENTS];
+	uint32_t i_blocks;
+	uint32_t i_flags;
 };
 
+#define DIR_REC_LEN(len)	((8 + (len) + 3) & ~3)
+
 struct testfs_dir_entry {
 	uint32_t inode_number;	/* Inode number */
-	uint32_t name_len;	/* File name length */
-	char name[20];		/* File name */
+	uint16_t rec_len;	/* Distance to the next entry */
+	uint8_t name_len;	/* File name length */
 	uint8_t type;		/* DT_DIR or DT_REG */
+	char name[];		/* File name, not NUL terminated */
 };
 
+/* bytes of data per inode, which keeps 256 byte inode tables as large as 64 byte ones used to be */
+#define DEFAULT_INODE_RATIO	16384
+
+static unsigned char zero_block[MAX_BLK_SIZE];
+
+int set_geometry(uint32_t inode_ratio, uint32_t blocks);
+int set_layout(uint32_t num_groups);
+int get_disk_size(void);
+int clear_device(uint64_t size);
+int write_metadata(uint32_t num_groups, int zeroed);
+int write_root_dir(void);
+int write_journal(int zeroed);
+
+void usage(void)
+{
+	printf("\nUsage : format [-b block-size] [-i bytes-per-inode] [-I inode-size] [-g blocks-per-group] [-G groups-per-flex] [/dev/sda1]\n\n");
+	printf("  -b  block size, a power of two from %d to %d (default %u)\n",
+		MIN_BLK_SIZE, MAX_BLK_SIZE, blk_size);
+	printf("  -i  bytes of data per inode (default %d)\n", DEFAULT_INODE_RATIO);
+	printf("  -I  inode size, a power of two from %zu to %d; small files and directories\n"
+	       "      live in what is past the first %zu bytes (default %u)\n",
+		sizeof(struct testfs_inode), MAX_INODE_SIZE, sizeof(struct testfs_inode), inode_size);
+	printf("  -g  blocks per group (default: as many as one bitmap block tracks)\n");
+	printf("  -G  groups whose bitmaps and inode tables are packed together (default %u)\n\n",
+		groups_per_flex);
+}
+
 int main(int argc, char *argv[])
 {
 
-	int num_groups, i = 0;
-	uint64_t write_pos = 0;
+	uint32_t num_groups;
+	int zeroed;
+	int opt;
+	uint32_t inode_ratio = DEFAULT_INODE_RATIO;
+	uint32_t blocks = 0;
+
+	while ((opt = getopt(argc, argv, "b:i:I:g:G:")) != -1) {
+		switch (opt) {
+		case 'b':
+			blk_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			inode_ratio = strtoul(optarg, NULL, 0);
+			break;
+		case 'I':
+			inode_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'G':
+			groups_per_flex = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
 
 	/* Read file system name from parameters */
-	if (argc != 2) {
-		printf("\nUsage : format [/dev/sda1]\n\n");
+	if (optind != argc - 1) {
+		usage();
 		exit(EXIT_FAILURE);
 	}
 
+	if (set_geometry(inode_ratio, blocks) < 0)
+		exit(EXIT_FAILURE);
+
 	/* Open file system */
-	fd = open(argv[1], O_RDWR);
-	if (fd <= 0) {
+	fd = open(argv[optind], O_RDWR);
+	if (fd < 0) {
 		perror("error opening filesystem");
 		exit(EXIT_FAILURE);
 	}
 
-	printf("Size of the disk in MB:");
-        scanf("%llu", &disk_size);
+	if (get_disk_size() < 0)
+		goto err;
 
-        disk_size *= 1024 * 1024;
-	
-	num_groups = (int)(disk_size / (uint64_t)BLK_GRP_SIZE);
+	/* block numbers are 32 bit */
+	num_groups = disk_size / ((uint64_t)group_blks * blk_size);
+	if ((uint64_t)num_groups * group_blks > UINT32_MAX)
+		num_groups = UINT32_MAX / group_blks;
 
-	for (i=0;i<num_groups;i++) {
-		write_pos = (uint64_t)i * (uint64_t)BLK_GRP_SIZE;
-		if (write_super(num_groups, write_pos) < 0) {
-			goto err;
-		}
+	if (num_groups < 1) {
+		fprintf(stderr, "Device too small for a group of %u blocks\n", group_blks);
+		goto err;
+	}
 
-		if (write_group_descriptors(write_pos, i) < 0) {
-			goto err;
-		}
+	if (set_layout(num_groups) < 0)
+		goto err;
 
-		if (write_block_bitmap(write_pos, i) < 0) {
-			goto err;
-		}
+	/*
+	 * a device that reads back zeros after this needs no inode table
+	 * written at all. Otherwise the tables of the other groups are left
+	 * as they are and the kernel zeroes them after mount
+	 */
+	zeroed = clear_device((uint64_t)num_groups * group_blks * blk_size);
 
-		if (write_inode_bitmap(write_pos, i) < 0) {
-			goto err;
-		}
+	if (write_metadata(num_groups, zeroed) < 0) {
+		goto err;
+	}
 
-		if (write_itable(write_pos, i) < 0) {
-			goto err;
-		}
+	/*
+	 * we write the . and .. entries to disk (only for the root inode)
+	 */
+	if (write_root_dir() < 0) {
+		goto err;
+	}
 
-		/*
- 		 * we write the . and .. entries to disk (only for the root inode)
- 		 */
-		if (i==0 && write_root_dir() < 0) {
-			goto err;
-		}
+	if (write_journal(zeroed) < 0) {
+		goto err;
+	}
+
+	if (fsync(fd) < 0) {
+		perror("Failed to flush the filesystem");
+		goto err;
 	}
 
+	printf("Wrote %u groups of %u blocks of %u bytes, %u inodes of %u bytes each, %u groups per flex group, "
+	       "inode tables %s\n",
+		num_groups, group_blks, blk_size, num_inodes, inode_size, groups_per_flex,
+		zeroed ? "cleared by the device" : "left to the kernel");
+
 	close(fd);
 	exit(EXIT_SUCCESS);
 err:
@@ -122,138 +260,324 @@ err:
 	exit(EXIT_FAILURE);
 }
 
-int write_super(uint32_t num_groups, uint64_t write_pos)
+/*
+ * sizes a group for the block size: as many blocks as one bitmap block
+ * tracks, unless blocks asks for fewer, and an inode for every inode_ratio
+ * bytes of them, as many as one bitmap block tracks at most
+ */
+int set_geometry(uint32_t inode_ratio, uint32_t blocks)
 {
-	struct testfs_superblock sb;
-	
-	sb.magic		= 0x1012F4DD;
-	sb.block_size		= BLK_SIZE;
-	sb.block_count		= 0; // not used
-	sb.group_count		= num_groups;
-	sb.blocks_per_group 	= (uint32_t)BLK_GRP_NUM_BLKS;
-	sb.inodes_per_group	= (uint32_t)NUM_INODES;
-	//sb.itable	= 4;
-	//sb.itable_size	= ITABLE_NUM_BLKS;	
-	//sb.block_bitmap = 2;
-	//sb.inode_bitmap = 3;
-	sb.rootdir_inode = 1;
-
-	/* Seek to block 0 */
-	if (lseek64(fd, write_pos + (uint64_t)(0 * BLK_SIZE), 0) < (uint64_t)0) {
-		perror("Failed to seek to superblock");
+	uint32_t per_block;
+	uint64_t inodes;
+
+	if (blk_size < MIN_BLK_SIZE || blk_size > MAX_BLK_SIZE || (blk_size & (blk_size - 1))) {
+		fprintf(stderr, "Block size must be a power of two from %d to %d\n",
+			MIN_BLK_SIZE, MAX_BLK_SIZE);
+		return -1;
+	}
+
+	if (inode_size < sizeof(struct testfs_inode) || inode_size > MAX_INODE_SIZE ||
+	    inode_size > blk_size || (inode_size & (inode_size - 1))) {
+		fprintf(stderr, "Inode size must be a power of two from %zu to %d, and at most the block size\n",
+			sizeof(struct testfs_inode), MAX_INODE_SIZE);
+		return -1;
+	}
+
+	if (!inode_ratio) {
+		fprintf(stderr, "Invalid inode ratio\n");
+		return -1;
+	}
+
+	if (!groups_per_flex) {
+		fprintf(stderr, "Invalid number of groups per flex group\n");
+		return -1;
+	}
+
+	if (!blocks)
+		blocks = blk_size * 8;
+
+	if (blocks > blk_size * 8) {
+		fprintf(stderr, "A group has at most %u blocks\n", blk_size * 8);
 		return -1;
 	}
 
-	/* Write superblock */
-	write(fd, &sb, sizeof(sb));
-	printf("Wrote superblock : %lu bytes\n", sizeof(sb));
+	per_block = blk_size / inode_size;
+
+	inodes = (uint64_t)blocks * blk_size / inode_ratio;
+	inodes -= inodes % per_block;
+	if (inodes > blk_size * 8)
+		inodes = blk_size * 8;
+	if (inodes < per_block)
+		inodes = per_block;
+
+	num_inodes 	= inodes;
+	itable_blks 	= num_inodes / per_block;
+	group_blks 	= blocks;
 
 	return 0;
 }
 
-int write_group_descriptors(uint64_t write_pos, int group)
+/*
+ * the superblock and the table of all descriptors come first. The bitmaps
+ * and inode tables of each run of groups_per_flex groups follow at the
+ * start of the first group of the run (right after the descriptor table
+ * for the first run): the block bitmaps, the inode bitmaps, then the inode
+ * tables. The other groups of a run are data from their first block to
+ * their last
+ */
+uint32_t flex_start(uint32_t flex)
+{
+	return flex ? flex * groups_per_flex * group_blks : 1 + desc_blks;
+}
+
+uint32_t flex_groups(uint32_t num_groups, uint32_t flex)
 {
-	struct testfs_group_desc desc;
-	uint32_t start_pos = group * BLK_GRP_NUM_BLKS;
+	uint32_t left = num_groups - flex * groups_per_flex;
 
-	desc.block_bitmap 	= start_pos + 2;
-	desc.inode_bitmap 	= start_pos + 3;
-	desc.inode_table  	= start_pos + 4;
-	desc.first_data_block 	= start_pos + 4 + ITABLE_NUM_BLKS;
+	return left < groups_per_flex ? left : groups_per_flex;
+}
 
-	if (lseek64(fd, write_pos + (uint64_t)(1 * BLK_SIZE), 0) < (uint64_t)0) {
-                perror("Failed to seek to group descriptor table: ");
-                return -1;
-        }
+int set_layout(uint32_t num_groups)
+{
+	uint32_t meta_blks;
 
-        write(fd, &desc, sizeof(desc));
-	printf("Wrote block group descriptor : %lu bytes\n", sizeof(desc));	
+	if (groups_per_flex > num_groups)
+		groups_per_flex = num_groups;
+
+	desc_blks 	= (num_groups * sizeof(struct testfs_group_desc) + blk_size - 1) / blk_size;
+	meta_blks 	= groups_per_flex * (2 + itable_blks);
+	journal_start 	= flex_start(0) + meta_blks;
+
+	/* group 0 holds the journal and the root directory block as well */
+	if (journal_start + JOURNAL_BLKS + 1 > group_blks) {
+		fprintf(stderr, "The metadata of %u groups and the journal do not fit in a group, "
+			"use fewer groups per flex group or larger groups\n", groups_per_flex);
+		return -1;
+	}
 
 	return 0;
 }
 
-int write_block_bitmap(uint64_t write_pos, int group)
+/*
+ * the size of a block device comes from the driver, an image file is taken
+ * as large as it is
+ */
+int get_disk_size(void)
 {
-	unsigned char bitmap[BLK_SIZE] = {0};
-	int c;
+	struct stat st;
 
-	/* Resetting bitmap to dummy data */
-	for (c = 0; c < sizeof(bitmap); c++) {
-		bitmap[c] = 0x00;
+	if (fstat(fd, &st) < 0) {
+		perror("Failed to stat the filesystem");
+		return -1;
 	}
 
-	
-	if (group == 0)
-		bitmap[0] = 0x1;
-
-	/* Seek to block 1 */
-	if (lseek64(fd, write_pos + (uint64_t)(2 * BLK_SIZE), 0) < (uint64_t)0) {
-		perror("Failed to seek to block bitmap: ");
-		return -1;
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, &disk_size) < 0) {
+			perror("Failed to get the device size");
+			return -1;
+		}
 	}
+	else
+		disk_size = st.st_size;
 
-	/* Write block bitmap */
-	write(fd, bitmap, sizeof(bitmap));
-	printf("Wrote block bitmap : %lu bytes\n", sizeof(bitmap));
+	return 0;
 }
 
-int write_inode_bitmap(uint64_t write_pos, int group)
+/*
+ * makes the first size bytes read back as zeros without writing them:
+ * holes punched in an image file, BLKZEROOUT or a discard that zeroes on a
+ * block device. Returns 1 on success, 0 if the old contents are still there
+ */
+int clear_device(uint64_t size)
 {
-	unsigned char bitmap[BLK_SIZE] = {0};
-	int c;
+	struct stat st;
+	uint64_t range[2] = { 0, size };
+	unsigned int discard_zeroes = 0;
 
-	/* Resetting bitmap to dummy data */
-	for (c = 0; c < sizeof(bitmap); c++) {
-		bitmap[c] = 0x00;
-	}
+	if (fstat(fd, &st) < 0)
+		return 0;
+
+	if (S_ISREG(st.st_mode))
+		return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, size) == 0;
+
+	if (!S_ISBLK(st.st_mode))
+		return 0;
+
+	/* cheap when the device offloads it, otherwise it writes the zeros */
+	if (ioctl(fd, BLKDISCARDZEROES, &discard_zeroes) == 0 && discard_zeroes &&
+	    ioctl(fd, BLKDISCARD, range) == 0)
+		return 1;
+
+#ifdef BLKZEROOUT
+	if (ioctl(fd, BLKZEROOUT, range) == 0)
+		return 1;
+#endif
 
+	return 0;
+}
+
+void fill_super(unsigned char *block, uint32_t num_groups)
+{
+	struct testfs_superblock *sb = (struct testfs_superblock *)block;
 	
-	if (group == 0)
-		bitmap[0] = 0x3;
+	sb->magic		= 0x1012F4DD;
+	sb->block_size		= blk_size;
+	sb->block_count		= 0; // not used
+	sb->group_count		= num_groups;
+	sb->blocks_per_group 	= group_blks;
+	sb->inodes_per_group	= num_inodes;
+	//sb->itable	= 4;
+	//sb->itable_size	= itable_blks;	
+	//sb->block_bitmap = 2;
+	//sb->inode_bitmap = 3;
+	sb->rootdir_inode = 1;
+	sb->journal_block = journal_start;
+	sb->journal_blocks = JOURNAL_BLKS;
+	sb->feature_incompat = FEATURE_INCOMPAT_DIRENT | FEATURE_INCOMPAT_UNWRITTEN |
+			       FEATURE_INCOMPAT_FLEX_BG;
+	sb->inode_size = inode_size;
+
+	if (inode_size > sizeof(struct testfs_inode))
+		sb->feature_incompat |= FEATURE_INCOMPAT_INLINE_DATA;
+}
+
+void fill_group_desc(struct testfs_group_desc *desc, uint32_t num_groups, uint32_t group, int zeroed)
+{
+	uint32_t flex 	= group / groups_per_flex;
+	uint32_t index 	= group % groups_per_flex;
+	uint32_t meta 	= flex_start(flex);
+	uint32_t count 	= flex_groups(num_groups, flex);
+	uint32_t data_blks;
+
+	desc->block_bitmap 	= meta + index;
+	desc->inode_bitmap 	= meta + count + index;
+	desc->inode_table  	= meta + 2 * count + index * itable_blks;
+
+	if (index == 0)
+		desc->first_data_block = meta + count * (2 + itable_blks);
 	else
-		bitmap[0] = 0x1;
+		desc->first_data_block = group * group_blks;
 
+	data_blks = (group + 1) * group_blks - desc->first_data_block;
 
-	/* Seek to block 2 */
-	if (lseek64(fd, write_pos + (uint64_t)(3 * BLK_SIZE), 0) < (uint64_t)0) {
-		perror("Failed to seek to inode bitmap");
-		return -1;
+	if (group == 0) {
+		/* journal, root directory block, reserved inode 0 and root inode */
+		desc->free_blocks_count	= data_blks - (JOURNAL_BLKS + 1);
+		desc->free_inodes_count	= num_inodes - 2;
+		desc->flags		= 0;
+		desc->used_dirs_count	= 1;
+	}
+	else {
+		desc->free_blocks_count	= data_blks;
+		desc->free_inodes_count	= num_inodes - 1;
+		desc->flags		= BG_BLOCK_UNINIT | BG_INODE_UNINIT;
+		desc->used_dirs_count	= 0;
+
+		if (!zeroed)
+			desc->flags |= BG_ITABLE_UNINIT;
 	}
-
-	/* Write inode bitmap */
-	write(fd, bitmap, sizeof(bitmap));
-	printf("Wrote inode bitmap : %lu bytes\n", sizeof(bitmap));
 }
 
-int write_itable(uint64_t write_pos, int group)
+/*
+ * the bitmaps and the inode table are only written for group 0, the other
+ * groups initialize them on first use
+ */
+void fill_block_bitmap(unsigned char *bitmap)
 {
-	struct testfs_inode itable[NUM_INODES] = {0};
 	int c;
 
-	/* Resetting itable with dummy data */
-	for (c = 0; c < NUM_INODES; c++) {
-		if (c == 1 && group == 0) {
-			itable[c].i_mode 	= 0x41FF;
-			itable[c].i_size 	= 2 * sizeof(struct testfs_dir_entry);
-			itable[c].group		= 0;
-			itable[c].block_ptr 	= ITABLE_NUM_BLKS + 4;
-			continue;
-		}
-		itable[c].i_mode 	= 0x41FF;	/* Mode = Dir */
-		itable[c].i_size 	= 0;		/* Size */
-		itable[c].group		= group;	/* Block group */
-		itable[c].block_ptr 	= 0;		/* Block Pointer (relative to group) */
-	}
+	/* journal and root directory block */
+	for (c = 0; c <= JOURNAL_BLKS; c++)
+		bitmap[c / 8] |= 1 << (c % 8);
+}
+
+void fill_inode_bitmap(unsigned char *bitmap)
+{
+	/* reserved inode 0 and the root inode */
+	bitmap[0] = 0x3;
+}
 
-	/* Seek to block 3 */
-	if (lseek64(fd, write_pos + (uint64_t)(4 * BLK_SIZE), 0) < (uint64_t)0) {
-		perror("Failed to seek to itable");
+void fill_root_inode(unsigned char *block)
+{
+	/* the root directory keeps its block, it rarely stays small */
+	struct testfs_inode *root = (struct testfs_inode *)(block + inode_size);
+
+	root->i_mode 	= 0x41FF;	/* Mode = Dir */
+	root->i_size 	= blk_size;
+	root->group	= 0;
+	root->i_extent_count		= 1;
+	root->i_extents[0].ee_block	= 0;
+	root->i_extents[0].ee_start	= ROOT_DIR_BLK;
+	root->i_extents[0].ee_len	= 1;
+	root->i_blocks	= 1;
+}
+
+/*
+ * writes the superblock and the descriptor table with a single call, then
+ * what group 0 needs: its bitmaps and its inode table. The bitmaps and
+ * inode tables of the other groups are initialized on first use
+ */
+int write_metadata(uint32_t num_groups, int zeroed)
+{
+	static unsigned char block_bitmap[MAX_BLK_SIZE];
+	static unsigned char inode_bitmap[MAX_BLK_SIZE];
+	static unsigned char root_itable[MAX_BLK_SIZE];
+	struct testfs_group_desc *descs;
+	struct iovec iov[IOV_BLKS];
+	unsigned char *head;
+	size_t len = (size_t)(1 + desc_blks) * blk_size;
+	uint32_t left = zeroed ? 1 : itable_blks;
+	uint64_t block;
+	uint32_t group;
+	int c, nr;
+
+	head = calloc(1, len);
+	if (!head) {
+		perror("Failed to allocate the descriptor table");
 		return -1;
 	}
 
-	/* Write inode table */
-	write(fd, itable, sizeof(itable));
-	printf("Wrote itable : %lu bytes\n", sizeof(itable));
+	fill_super(head, num_groups);
+
+	descs = (struct testfs_group_desc *)(head + blk_size);
+	for (group = 0; group < num_groups; group++)
+		fill_group_desc(&descs[group], num_groups, group, zeroed);
+
+	if (pwrite(fd, head, len, 0) != (ssize_t)len) {
+		perror("Failed to write the superblock and descriptor table");
+		goto err;
+	}
+
+	fill_block_bitmap(block_bitmap);
+	fill_inode_bitmap(inode_bitmap);
+	fill_root_inode(root_itable);
+
+	if (pwrite(fd, block_bitmap, blk_size, (uint64_t)descs[0].block_bitmap * blk_size) != (ssize_t)blk_size ||
+	    pwrite(fd, inode_bitmap, blk_size, (uint64_t)descs[0].inode_bitmap * blk_size) != (ssize_t)blk_size) {
+		perror("Failed to write the bitmaps of group 0");
+		goto err;
+	}
+
+	/* the inode table is up to 8 * MAX_INODE_SIZE blocks, a few calls worth */
+	for (block = descs[0].inode_table; left; block += nr, left -= nr) {
+		nr = left < IOV_BLKS ? left : IOV_BLKS;
+		for (c = 0; c < nr; c++) {
+			iov[c].iov_base = (block + c == descs[0].inode_table) ? root_itable : zero_block;
+			iov[c].iov_len	= blk_size;
+		}
+
+		if (pwritev(fd, iov, nr, block * blk_size) != (ssize_t)nr * blk_size) {
+			perror("Failed to write the inode table of group 0");
+			goto err;
+		}
+	}
+
+	free(head);
+	return 0;
+
+err:
+	free(head);
+	return -1;
 }
 
 /*
@@ -261,29 +585,64 @@ int write_itable(uint64_t write_pos, int group)
  * */
 int write_root_dir(void)
 {
-	struct testfs_dir_entry root[2];
+	static unsigned char block[MAX_BLK_SIZE];
+	struct testfs_dir_entry *root = (struct testfs_dir_entry *)block;
+
+	root->inode_number = 1;		/* Inode number */
+	root->rec_len = DIR_REC_LEN(1);
+	root->name_len = 1;		/* Name length */
+	root->name[0] = '.';
+	root->type = 4;			/* DT_DIR */
+
+	/* .. takes the rest of the block */
+	root = (struct testfs_dir_entry *)(block + DIR_REC_LEN(1));
+	root->inode_number = 1;		/* Inode number */
+	root->rec_len = blk_size - DIR_REC_LEN(1);
+	root->name_len = 2;		/* Name length */
+	root->name[0] = '.';
+	root->name[1] = '.';
+	root->type = 4;			/* DT_DIR */
+
+	/* Write root directory data block, right after the journal */
+	if (pwrite(fd, block, blk_size, (uint64_t)ROOT_DIR_BLK * blk_size) != (ssize_t)blk_size) {
+		perror("Failed to write root directory data block");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * only called once, the journal lives at the start of the first group's
+ * data blocks. The log must not contain stale transactions, so it is zeroed
+ * unless the device already was
+ */
+int write_journal(int zeroed)
+{
+	static unsigned char block[MAX_BLK_SIZE];
+	struct testfs_journal_super *js = (struct testfs_journal_super *)block;
+	struct iovec iov[JOURNAL_BLKS];
+	int nr = zeroed ? 1 : JOURNAL_BLKS;
 	int c;
 
-	root[0].inode_number = 1;	/* Inode number */
-	root[0].name_len = 1;		/* Name length */
-	root[0].name[0] = '.';
-	root[0].name[1] = '\0';
-	root[0].type = 1;		/* DT_DIR or DT_REG */
-
-	root[1].inode_number = 1;	/* Inode number */
-	root[1].name_len = 2;		/* Name length */
-	root[1].name[0] = '.';
-	root[1].name[1] = '.';
-	root[1].name[2] = '\0';
-	root[1].type = 1;		/* DT_DIR or DT_REG */
-
-	/* Seek to block 6 (1 + 6) */
-	if (lseek(fd, (4 + ITABLE_NUM_BLKS) * BLK_SIZE, 0) < 0) {
-		perror("Failed to seek to root directory data block");
+	js->s_header.h_magic	= JOURNAL_MAGIC;
+	js->s_header.h_type	= JOURNAL_SUPER;
+	js->s_blocks		= JOURNAL_BLKS;
+	js->s_first		= 1;
+	js->s_start		= 0;	/* clean */
+	js->s_sequence		= 1;
+
+	iov[0].iov_base = block;
+	iov[0].iov_len	= blk_size;
+	for (c = 1; c < nr; c++) {
+		iov[c].iov_base = zero_block;
+		iov[c].iov_len	= blk_size;
+	}
+
+	if (pwritev(fd, iov, nr, (uint64_t)journal_start * blk_size) != (ssize_t)nr * blk_size) {
+		perror("Failed to write journal");
 		return -1;
 	}
 
-	/* Write root directory data block */
-	write(fd, root, sizeof(root));
-	printf("Wrote root directory data : %lu bytes\n", sizeof(root));
+	return 0;
 }